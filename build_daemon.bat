@@ -9,6 +9,9 @@ echo Compiling rate_daemon...
     -O3 ^
     -static ^
     src\rate_daemon.c ^
+    src\ctl_client.c ^
+    src\replay.c ^
+    src\bench.c ^
     -o bin\rate_daemon
 
 echo Compiling dts_tool...
@@ -12,6 +12,15 @@ IMG_DIR="$MOD_PATH/img"
 WORK_DIR="$MOD_PATH/workspace"
 CONFIG_FILE="$MOD_PATH/config/mode.txt"
 DAEMON_BIN="$BIN_DIR/rate_daemon"
+CTL_SOCK="$MOD_PATH/daemon.sock"
+
+# 守护进程运行时通过控制 socket 修改配置 (由守护进程批量写回 mode.txt)
+# 返回 2 表示守护进程未运行，只有这时才回退为直接改写配置文件；
+# 守护进程拒绝 (1) 或没有及时回复 (3) 时不能再改文件，否则会和守护进程的写回冲突
+daemon_ctl() {
+    [ -S "$CTL_SOCK" ] && [ -x "$DAEMON_BIN" ] || return 2
+    "$DAEMON_BIN" ctl "$MOD_PATH" "$@" >/dev/null 2>&1
+}
 
 mkdir -p "$(dirname "$CONFIG_FILE")"
 [ ! -f "$CONFIG_FILE" ] && echo "1" > "$CONFIG_FILE"
@@ -291,12 +300,19 @@ case "$1" in
         ;;
 
     "set_config")
-        # $2 is global mode id
+        # $2 is global mode id or WxH@fps key
         NEW_MODE="$2"
         if [ -z "$NEW_MODE" ]; then
             echo "Error: Missing mode ID"
             exit 1
         fi
+
+        daemon_ctl set-global "$NEW_MODE"
+        case $? in
+            0) echo "Success: Global mode set to $NEW_MODE"; exit 0 ;;
+            2) ;;
+            *) echo "错误：守护进程拒绝或未响应，配置未修改"; exit 1 ;;
+        esac
         
         # 替换第一行，保持后续行不变
         # sed -i '1s/.*/NEW_MODE/' doesn't work well on android sed sometimes
@@ -312,7 +328,7 @@ case "$1" in
         ;;
 
     "set_app_config")
-        # $2 is package, $3 is mode id (-1 to delete)
+        # $2 is package, $3 is mode id or WxH@fps key (-1 to delete)
         PKG="$2"
         MODE="$3"
         
@@ -321,6 +337,13 @@ case "$1" in
             exit 1
         fi
 
+        daemon_ctl set-app "$PKG" "$MODE"
+        case $? in
+            0) echo "Success: App config saved"; exit 0 ;;
+            2) ;;
+            *) echo "错误：守护进程拒绝或未响应，配置未修改"; exit 1 ;;
+        esac
+
         # 读取第一行作为全局配置
         GLOBAL_MODE=$(head -n 1 "$CONFIG_FILE")
         
@@ -341,6 +364,11 @@ case "$1" in
         echo "Success: App config saved"
         ;;
 
+    "get_stats")
+        # 使用统计 (JSON)，守护进程未运行时读取 stats.bin
+        "$DAEMON_BIN" stats "$MOD_PATH"
+        ;;
+
     "get_app_info")
         PKG="$2"
         if [ -z "$PKG" ]; then
@@ -3,11 +3,12 @@ MODDIR=${0%/*}
 DAEMON_BIN="$MODDIR/bin/rate_daemon"
 
 # 等待系统启动完成
+# bin/ 中的预编译守护进程还不支持 --wait-boot (会忽略该参数)，重新编译之前保留这里的等待
 until [ "$(getprop sys.boot_completed)" = "1" ]; do
     sleep 1
 done
 
 # 启动守护进程
-# 传入模块路径作为参数
+# 传入模块路径作为参数；--wait-boot 在开机已完成时立即返回，换成新版本后可以去掉上面的轮询
 chmod +x "$DAEMON_BIN"
-nohup "$DAEMON_BIN" "$MODDIR" > /dev/null 2>&1 &
+nohup "$DAEMON_BIN" "$MODDIR" --wait-boot > /dev/null 2>&1 &
@@ -0,0 +1,410 @@
+#include "rate_daemon.h"
+
+// 验证内容帧率匹配: rate_daemon content-match <dump文件> <包名> [应用模式ID]
+// 用录制的 dumpsys SurfaceFlinger 输出计算内容帧率和选中的模式 (应用模式默认取 activeConfig)
+int content_match_file(const char *path, const char *pkg, int app_mode) {
+    size_t len = 0;
+    char *data = read_small_file(path, &len);
+    if (!data) {
+        printf("Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    static SfDump dump;
+    parse_sf_dump(data, len, &dump);
+    free(data);
+    if (dump.mode_count == 0) {
+        printf("No display modes in %s\n", path);
+        return 1;
+    }
+    install_modes(&dump);
+    if (app_mode < 0) app_mode = dump.active_config;
+    if (!is_valid_mode(app_mode)) {
+        printf("Invalid app mode %d\n", app_mode);
+        return 1;
+    }
+
+    size_t n = strlen(pkg);
+    for (int i = 0; i < dump.layer_count; i++) {
+        const char *p = strstr(dump.layers[i].name, pkg);
+        if (p && (p[n] == '/' || p[n] == '#')) {
+            printf("layer %s: frameRate=%.2f\n", dump.layers[i].name, dump.layers[i].frame_rate);
+        }
+    }
+    float rate = content_rate_of(&dump, pkg);
+    int target = content_mode_for(app_mode, rate);
+    printf("content %.2f fps, app mode %d (%dHz) -> mode %d (%dHz)\n",
+        rate, app_mode, get_mode_fps(app_mode), target, get_mode_fps(target));
+    return 0;
+}
+
+// 基准测试: rate_daemon bench-parse <dump文件> [次数]
+// 对比关键字合并解析与旧的 fgets + strstr 逐行解析，输出吞吐 (MB/s) 和单次耗时
+// 合成的测试输入由 tests/gen_sf_dump.sh 生成
+int bench_parse(const char *path, int iterations) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    DumpBuffer buf = { NULL, 0, 0 };
+    fseek(fp, 0, SEEK_END);
+    buf.cap = ftell(fp) + 1;
+    fseek(fp, 0, SEEK_SET);
+    buf.data = malloc(buf.cap);
+    buf.len = fread(buf.data, 1, buf.cap - 1, fp);
+    buf.data[buf.len] = '\0';
+    fclose(fp);
+
+    static SfDump dump;
+    long long start = now_us();
+    for (int i = 0; i < iterations; i++) parse_sf_dump(buf.data, buf.len, &dump);
+    long long cost = now_us() - start;
+
+    // 旧实现：逐行 fgets 到 1KB 缓冲区，每行三次 strstr
+    int legacy_modes = 0;
+    long long legacy_start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        FILE *mem = fmemopen(buf.data, buf.len, "r");
+        char line[1024];
+        legacy_modes = 0;
+        while (mem && fgets(line, sizeof(line), mem) != NULL) {
+            if (strstr(line, "id=") && strstr(line, "resolution=") && strstr(line, "vsyncRate=")) legacy_modes++;
+        }
+        if (mem) fclose(mem);
+    }
+    long long legacy_cost = now_us() - legacy_start;
+
+    double mb = (double)buf.len * iterations / (1024.0 * 1024.0);
+    printf("Dump: %s (%zu bytes), %d iterations\n", path, buf.len, iterations);
+    printf("Parsed: %d modes, activeConfig=%d, %d layers\n", dump.mode_count, dump.active_config, dump.layer_count);
+    for (int i = 0; i < dump.mode_count; i++) {
+        printf("  mode id=%d %dx%d@%d\n", dump.modes[i].id, dump.modes[i].width, dump.modes[i].height, dump.modes[i].fps);
+    }
+    for (int i = 0; i < dump.layer_count; i++) {
+        if (dump.layers[i].frame_rate > 0) printf("  layer %s frameRate=%.2f\n", dump.layers[i].name, dump.layers[i].frame_rate);
+    }
+    printf("strstr merge:  %.1f MB/s, %.1f us/dump\n", mb / (cost / 1e6 + 1e-9), (double)cost / iterations);
+    printf("legacy fgets:  %.1f MB/s, %.1f us/dump (%d mode lines)\n",
+        mb / (legacy_cost / 1e6 + 1e-9), (double)legacy_cost / iterations, legacy_modes);
+    free(buf.data);
+    return 0;
+}
+
+// 基准测试用：模拟两个分辨率共 24 个模式
+void bench_fake_modes() {
+    mode_count = 0;
+    for (int i = 0; i < 24 && i < MAX_MODES; i++) {
+        modes[mode_count].id = i;
+        modes[mode_count].width = i < 12 ? 1264 : 948;
+        modes[mode_count].height = i < 12 ? 2780 : 2084;
+        modes[mode_count].fps = 60 + ((i * 37) % 12) * 12;
+        mode_count++;
+    }
+}
+
+// 基准测试: rate_daemon bench-index [应用数] [查询次数]
+// 对比哈希表查找与逐条 strcmp，模式索引查阶梯与每次重建并冒泡排序
+int bench_index(int apps, int lookups) {
+    bench_fake_modes();
+    long long start = now_us();
+    build_mode_index();
+    long long index_cost = now_us() - start;
+
+    char (*names)[MAX_PKG_LEN] = malloc((size_t)apps * MAX_PKG_LEN);
+    if (!names) return 1;
+    AppTable *table = app_table_new(64);
+    start = now_us();
+    for (int i = 0; i < apps; i++) {
+        snprintf(names[i], MAX_PKG_LEN, "com.bench.vendor%d.app%d", i % 97, i);
+        app_table_put(table, names[i], i % mode_count);
+    }
+    long long build_cost = now_us() - start;
+
+    // 查询：一半命中，一半未配置
+    char miss[MAX_PKG_LEN];
+    long long sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        if (i & 1) {
+            sum += app_table_get(table, names[(i * 7919) % apps]);
+        } else {
+            snprintf(miss, sizeof(miss), "com.bench.missing%d", i & 1023);
+            sum += app_table_get(table, miss);
+        }
+    }
+    long long hash_cost = now_us() - start;
+
+    long long linear_sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        const char *pkg;
+        if (i & 1) {
+            pkg = names[(i * 7919) % apps];
+        } else {
+            snprintf(miss, sizeof(miss), "com.bench.missing%d", i & 1023);
+            pkg = miss;
+        }
+        int found = -1;
+        for (int k = 0; k < apps; k++) {
+            if (strcmp(names[k], pkg) == 0) { found = k % mode_count; break; }
+        }
+        linear_sum += found;
+    }
+    long long linear_cost = now_us() - start;
+
+    // 阶梯：索引直接查表 vs 筛选 + 冒泡排序
+    int ladder_sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        const Ladder *ladder = get_mode_ladder(i % mode_count);
+        ladder_sum += ladder->ids[get_mode_rung(i % mode_count)];
+    }
+    long long ladder_cost = now_us() - start;
+
+    int sort_sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        int width = modes[i % mode_count].width;
+        int ids[MAX_MODES], fps[MAX_MODES], count = 0;
+        for (int k = 0; k < mode_count; k++) {
+            if (modes[k].width == width) { ids[count] = modes[k].id; fps[count] = modes[k].fps; count++; }
+        }
+        for (int x = 0; x < count - 1; x++) {
+            for (int y = 0; y < count - x - 1; y++) {
+                if (fps[y] > fps[y + 1]) {
+                    int t = fps[y]; fps[y] = fps[y + 1]; fps[y + 1] = t;
+                    t = ids[y]; ids[y] = ids[y + 1]; ids[y + 1] = t;
+                }
+            }
+        }
+        for (int k = 0; k < count; k++) if (ids[k] == i % mode_count) { sort_sum += ids[k]; break; }
+    }
+    long long sort_cost = now_us() - start;
+
+    printf("Apps: %d (table cap %d), lookups: %d\n", apps, table->cap, lookups);
+    printf("mode index build: %lld us, app table build: %lld us\n", index_cost, build_cost);
+    printf("hash lookup:   %.1f ns/op (checksum %lld)\n", hash_cost * 1000.0 / lookups, sum);
+    printf("linear strcmp: %.1f ns/op (checksum %lld)\n", linear_cost * 1000.0 / lookups, linear_sum);
+    printf("ladder index:  %.1f ns/op (checksum %d)\n", ladder_cost * 1000.0 / lookups, ladder_sum);
+    printf("ladder sort:   %.1f ns/op (checksum %d)\n", sort_cost * 1000.0 / lookups, sort_sum);
+    app_table_free(table);
+    free(names);
+    return 0;
+}
+
+// 读取本进程的 write 系统调用次数 (/proc/self/io 的 syscw)
+long long read_syscw() {
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (!fp) return -1;
+    char line[128];
+    long long v = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscw: %lld", &v) == 1) break;
+    }
+    fclose(fp);
+    return v;
+}
+
+// 基准测试: rate_daemon bench-rules [规则数] [查询次数]
+// 每 4 条规则一个包名，对比编译后的决策表与按文件顺序逐条匹配
+int bench_rules(int rules, int lookups) {
+    static const char *conds[] = {
+        "charging", "battery<20", "battery=20-50 discharging", "time=22:00-07:00",
+        "!charging battery>=80", "time=12:00-13:30 charging"
+    };
+    int cond_kinds = sizeof(conds) / sizeof(conds[0]);
+    if (rules < 1) rules = 1;
+    if (lookups < 1) lookups = 1;
+    int apps = (rules + 3) / 4;
+
+    bench_fake_modes();
+    build_mode_index();
+
+    // 生成 mode.txt: 每个包名若干条件规则 + 一条普通映射
+    size_t cap = (size_t)(rules + apps) * 96 + 16;
+    char *content = malloc(cap);
+    char (*names)[MAX_PKG_LEN] = malloc((size_t)apps * MAX_PKG_LEN);
+    if (!content || !names) return 1;
+    size_t len = snprintf(content, cap, "0\n");
+    for (int i = 0; i < apps; i++) {
+        snprintf(names[i], MAX_PKG_LEN, "com.bench.vendor%d.app%d", i % 97, i);
+        len += snprintf(content + len, cap - len, "%s=%d\n", names[i], i % mode_count);
+    }
+    for (int i = 0; i < rules; i++) {
+        len += snprintf(content + len, cap - len, "%s=%d if %s\n",
+            names[i % apps], (i * 5) % mode_count, conds[i % cond_kinds]);
+    }
+
+    long long start = now_us();
+    ConfigParse res;
+    AppTable *table = parse_mode_config(content, len, &res);
+    long long compile_cost = now_us() - start;
+    free(content);
+    if (!table) return 1;
+
+    // 未编译的对照: 规则按文件顺序平铺，每次决策从头扫描
+    Rule *flat = malloc((size_t)rules * sizeof(Rule));
+    if (!flat) return 1;
+    for (int i = 0; i < rules; i++) {
+        char cond[64];
+        snprintf(cond, sizeof(cond), "%s", conds[i % cond_kinds]);
+        parse_rule_conds(table, cond, &flat[i]);
+        flat[i].mode_id = (i * 5) % mode_count;
+    }
+    uint32_t env_mask = table->pred_count >= 32 ? 0xffffffffu : (1u << table->pred_count) - 1;
+
+    char miss[MAX_PKG_LEN];
+    long long sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        uint32_t env = ((uint32_t)i * 2654435761u >> 7) & env_mask;
+        const char *pkg = names[(i * 7919) % apps];
+        if (i % 4 == 0) {
+            snprintf(miss, sizeof(miss), "com.bench.missing%d", i & 1023);
+            pkg = miss;
+        }
+        int m = rule_lookup(table, pkg, NULL, env);
+        sum += m == -1 ? res.default_id : m;
+    }
+    long long table_cost = now_us() - start;
+
+    long long linear_sum = 0;
+    start = now_us();
+    for (int i = 0; i < lookups; i++) {
+        uint32_t env = ((uint32_t)i * 2654435761u >> 7) & env_mask;
+        const char *pkg = names[(i * 7919) % apps];
+        if (i % 4 == 0) {
+            snprintf(miss, sizeof(miss), "com.bench.missing%d", i & 1023);
+            pkg = miss;
+        }
+        int m = -1;
+        for (int k = 0; k < rules && m == -1; k++) {
+            if ((env & flat[k].mask) == flat[k].want && strcmp(names[k % apps], pkg) == 0) m = flat[k].mode_id;
+        }
+        for (int k = 0; k < apps && m == -1; k++) {
+            if (strcmp(names[k], pkg) == 0) m = k % mode_count;
+        }
+        linear_sum += m == -1 ? res.default_id : m;
+    }
+    long long linear_cost = now_us() - start;
+
+    printf("Rules: %d over %d apps, %d conditions, lookups: %d\n", table->rule_count, apps, table->pred_count, lookups);
+    printf("compile: %lld us (%d lines, %d skipped)\n", compile_cost, res.line_num, res.bad_lines);
+    printf("decision table: %.1f ns/op (checksum %lld)\n", table_cost * 1000.0 / lookups, sum);
+    printf("linear scan:    %.1f ns/op (checksum %lld)\n", linear_cost * 1000.0 / lookups, linear_sum);
+    app_table_free(table);
+    free(flat);
+    free(names);
+    return sum == linear_sum ? 0 : 1;
+}
+
+// 基准测试: rate_daemon bench-exec [次数] [程序 参数...]
+// 对比 popen (sh -c) 与 posix_spawn 直接执行同一程序并读完输出的耗时 (默认 dumpsys SurfaceFlinger)
+int bench_exec(int iterations, int argc, char **argv) {
+    char *defaults[] = { "dumpsys", "SurfaceFlinger", NULL };
+    char *args[16];
+    int n = 0;
+    if (argc == 0) {
+        for (; defaults[n]; n++) args[n] = defaults[n];
+    } else {
+        for (; n < argc && n < 15; n++) args[n] = argv[n];
+    }
+    args[n] = NULL;
+
+    char cmd[512];
+    int off = 0;
+    for (int i = 0; i < n && off < (int)sizeof(cmd); i++) {
+        off += snprintf(cmd + off, sizeof(cmd) - off, "%s%s", i ? " " : "", args[i]);
+    }
+
+    DumpBuffer buf = {0};
+    long long bytes = 0;
+    long long start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        FILE *fp = popen(cmd, "r");
+        if (!fp) break;
+        buf.len = 0;
+        while (dump_buffer_reserve(&buf, 65536) == 0) {
+            size_t got = fread(buf.data + buf.len, 1, buf.cap - buf.len - 1, fp);
+            if (got == 0) break;
+            buf.len += got;
+        }
+        pclose(fp);
+        bytes += buf.len;
+    }
+    long long popen_cost = now_us() - start;
+
+    start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        if (exec_read(args, &buf, NULL) < 0) {
+            printf("Error: spawn %s failed: %s\n", args[0], strerror(errno));
+            break;
+        }
+    }
+    long long spawn_cost = now_us() - start;
+    free(buf.data);
+
+    printf("Command: %s (%d iterations, %lld bytes/run)\n", cmd, iterations, iterations ? bytes / iterations : 0);
+    printf("popen (sh -c):  %lld us/run\n", iterations ? popen_cost / iterations : 0);
+    printf("posix_spawn:    %lld us/run (spawn %lld us, max %lld us)\n",
+        exec_stats.count ? spawn_cost / exec_stats.count : 0,
+        exec_stats.count ? exec_spawn_us / exec_stats.count : 0, exec_stats.max_us);
+    return 0;
+}
+
+// 基准测试: rate_daemon bench-log <目录> [消息数]
+// 对比旧的每条消息 fopen/fclose 与异步环形缓冲区日志的吞吐和每条消息的 write 次数
+int bench_log(const char *dir, int messages) {
+    char legacy_path[512], async_path[512];
+    snprintf(legacy_path, sizeof(legacy_path), "%s/bench_legacy.log", dir);
+    snprintf(async_path, sizeof(async_path), "%s/bench_async.log", dir);
+    unlink(legacy_path);
+    unlink(async_path);
+
+    // 旧实现 (不含 stdout 输出)
+    long long w0 = read_syscw();
+    long long start = now_us();
+    for (int i = 0; i < messages; i++) {
+        FILE *fp = fopen(legacy_path, "a");
+        if (!fp) break;
+        time_t now = time(NULL);
+        struct tm *t = localtime(&now);
+        fprintf(fp, "[%02d-%02d %02d:%02d:%02d] ", t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec);
+        fprintf(fp, "Step UP / 升频: %d (%lld us)", i % 24, (long long)i);
+        fprintf(fp, "\n");
+        fclose(fp);
+    }
+    long long legacy_cost = now_us() - start;
+    long long legacy_writes = read_syscw() - w0;
+
+    // 异步日志 (消息数较大时环形缓冲区可能写满，丢弃数会单独列出)
+    log_max_kb = 1 << 20;
+    log_init(async_path);
+    async_log.to_stdout = 0;
+    w0 = read_syscw();
+    start = now_us();
+    for (int i = 0; i < messages; i++) {
+        log_msg("Step UP / 升频: %d (%lld us)", i % 24, (long long)i);
+    }
+    long long async_cost = now_us() - start;
+    log_shutdown();
+    long long async_writes = read_syscw() - w0;
+
+    // 关闭的 debug 日志
+    log_level = LOG_LEVEL_INFO;
+    start = now_us();
+    for (int i = 0; i < messages; i++) {
+        log_debug("Step UP / 升频: %d (%lld us)", i % 24, (long long)i);
+    }
+    long long disabled_cost = now_us() - start;
+
+    printf("Messages: %d\n", messages);
+    printf("legacy fopen/fclose: %.0f msg/s, %.2f write syscalls/msg\n",
+        messages / (legacy_cost / 1e6 + 1e-9), (double)legacy_writes / messages);
+    printf("async ring buffer:   %.0f msg/s, %.4f write syscalls/msg (%lld written, %lld dropped)\n",
+        messages / (async_cost / 1e6 + 1e-9), (double)async_writes / messages,
+        async_log.messages, async_log.dropped);
+    printf("disabled debug:      %.1f ns/msg\n", disabled_cost * 1000.0 / messages);
+    return 0;
+}
+
@@ -40,7 +40,7 @@ if exist ..\bin\unpack_dtbo (
 
 echo.
 echo Building rate_daemon...
-%CLANG% %FLAGS% -o ..\bin\rate_daemon rate_daemon.c
+%CLANG% %FLAGS% -o ..\bin\rate_daemon rate_daemon.c ctl_client.c replay.c bench.c
 if exist ..\bin\rate_daemon (
     echo rate_daemon Built Successfully!
 ) else (
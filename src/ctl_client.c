@@ -0,0 +1,88 @@
+#include "rate_daemon.h"
+
+// 客户端: rate_daemon ctl <module_path> <命令> [参数...]
+// 发送一行命令并打印回复；subscribe 持续打印事件直到守护进程退出
+// 返回 0 成功，1 守护进程返回错误，2 守护进程未运行 (socket 不存在或拒绝连接)，
+// 3 守护进程在运行但没有及时回复；调用方只应在 2 时绕过守护进程直接改写配置
+int ctl_client(const char *base, int argc, char **argv) {
+    char line[CTL_LINE_MAX];
+    int off = 0;
+    for (int i = 0; i < argc && off < (int)sizeof(line) - 1; i++) {
+        off += snprintf(line + off, sizeof(line) - off, "%s%s", i ? " " : "", argv[i]);
+    }
+    if (off >= (int)sizeof(line) - 1) {
+        printf("Error: command too long\n");
+        return 1;
+    }
+    line[off++] = '\n';
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ctl_socket_path(base, &addr) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int not_running = errno == ECONNREFUSED || errno == ENOENT;
+        printf("Error: %s (%s)\n", not_running ? "daemon not running / 守护进程未运行" : "cannot reach daemon / 无法连接守护进程",
+            strerror(errno));
+        if (fd >= 0) close(fd);
+        return not_running ? 2 : 3;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (write(fd, line, off) != off) {
+        close(fd);
+        return 3;
+    }
+
+    int subscribe = strcmp(argv[0], "subscribe") == 0;
+    char reply[4096];
+    int reply_len = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready;
+    while ((ready = poll(&pfd, 1, subscribe ? -1 : 2000)) > 0) {
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        fwrite(buf, 1, n, stdout);
+        fflush(stdout);
+        // 只保留开头部分用于判断 ok (get-stats 的回复可能很长)
+        if (reply_len < (int)sizeof(reply) - 1) {
+            ssize_t keep = n < (ssize_t)sizeof(reply) - 1 - reply_len ? n : (ssize_t)sizeof(reply) - 1 - reply_len;
+            memcpy(reply + reply_len, buf, keep);
+            reply_len += keep;
+        }
+    }
+    close(fd);
+    reply[reply_len] = '\0';
+    if (reply_len == 0 && ready <= 0) {
+        printf("Error: daemon did not reply / 守护进程没有回复\n");
+        return 3;
+    }
+    return strstr(reply, "\"ok\":true") ? 0 : 1;
+}
+
+// 导出统计: rate_daemon stats <module_path>
+// 守护进程运行时通过控制 socket 取实时数据，否则读取 stats.bin
+int stats_dump(const char *base) {
+    char *argv[] = { "get-stats" };
+    struct sockaddr_un addr;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int alive = probe >= 0 && ctl_socket_path(base, &addr) == 0 &&
+                connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (probe >= 0) close(probe);
+    if (alive) return ctl_client(base, 1, argv);
+
+    // 只用缓存的模式表补充帧率，日志不能混进 JSON 输出
+    log_level = LOG_LEVEL_WARN;
+    mode_count = 0;
+    module_path = (char *)base;
+    load_mode_cache();
+    if (!stats_load(base)) {
+        printf("{\"ok\":false,\"error\":\"no stats\"}\n");
+        return 1;
+    }
+    DumpBuffer out = {0};
+    stats_json(&out);
+    if (out.data) printf("%s\n", out.data);
+    free(out.data);
+    return 0;
+}
+
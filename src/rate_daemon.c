@@ -1,74 +1,606 @@
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include <sys/stat.h>
-#include <ctype.h>
-#include <sys/inotify.h>
-#include <sys/select.h>
-#include <errno.h>
-
-#define MAX_MODES 50
-#define MAX_APPS 200
-#define MAX_PKG_LEN 128
+#include "rate_daemon.h"
+
+DisplayMode modes[MAX_MODES];
+int mode_count = 0;
+// 上一份模式表 (DTBO 重刷或系统更新前)，用于把 mode.txt 中已失效的数字 ID 换算到新表
+DisplayMode prev_modes[MAX_MODES];
+int prev_mode_count = 0;
+
+DumpBuffer sf_dump_buf;
+
+// 双缓冲：重建时写入另一份，完成后切换指针
+ModeIndex mode_index_buf[2];
+ModeIndex *mode_index = NULL;
+
+AppTable *app_table = NULL;
+int default_mode_id = 1;
+
+int current_mode_id = -1;
+
+// 前台应用检测 (后端见 rate_daemon.h 中的 FG_BACKEND_*)
+int fg_backend = FG_BACKEND_AUTO;
+char top_app_path[256] = "";     // 为空时自动探测
+char proc_root[256] = "/proc";
+char fg_pkg[MAX_PKG_LEN] = "";   // cgroup 后端最近一次确定的前台包名
+int fg_pids[MAX_TOP_PIDS];       // 上一次读到的 top-app pid 集合
+int fg_pid_count = 0;
+
+static const char *top_app_candidates[] = {
+    "/dev/cpuset/top-app/cgroup.procs",
+    "/dev/cpuset/top-app/tasks",
+    "/dev/cpuctl/top-app/cgroup.procs",
+    NULL
+};
+
+// 事件循环：所有输入 (inotify / 定时器 / 信号) 都是 epoll 上的 fd
+typedef struct {
+    int fd;
+    event_handler handler;
+} EventSource;
+
+int epoll_fd = -1;
+EventSource event_sources[MAX_EVENT_SOURCES];
+int running = 1;
+long long event_time_us = 0;    // 本轮 epoll 唤醒时间，用于统计决策延迟
+
+char *module_path = NULL;
+int inotify_fd = -1;
+int config_wd = -1;
+int fg_wds[MAX_FG_WATCHES];     // top-app 的 cgroup.procs/tasks，以及 foreground/background 的同名文件
+int fg_wd_count = 0;
+int poll_timer_fd = -1;
+int ramp_timer_fd = -1;
+char last_pkg[MAX_PKG_LEN] = "";
+
+// 控制 socket (<module>/daemon.sock)：每个连接一行命令、一行 JSON 回复
+// subscribe 的连接保持打开，之后推送事件行
+#define CTL_MAX_CLIENTS 8
+#define CTL_MAX_PENDING 64
+#define CONFIG_PERSIST_MS 1000
 
 typedef struct {
-    int id;
-    int fps;
-    int width;
-    int height;
-} DisplayMode;
+    int fd;                     // -1 表示空闲
+    int subscribed;
+    char buf[CTL_LINE_MAX];
+    int len;
+} CtlClient;
 
+// 尚未写回 mode.txt 的修改，mode_id 为 -1 表示删除
 typedef struct {
-    char package[MAX_PKG_LEN];
+    char pkg[MAX_PKG_LEN];
     int mode_id;
-} AppConfig;
+} CtlChange;
 
-DisplayMode modes[MAX_MODES];
-int mode_count = 0;
+int ctl_fd = -1;
+char ctl_path[512] = "";
+CtlClient ctl_clients[CTL_MAX_CLIENTS];
+CtlChange ctl_pending[CTL_MAX_PENDING];
+int ctl_pending_count = 0;
+int ctl_pending_default = -1;   // -1 表示全局默认未修改
+int persist_timer_fd = -1;
+int forced_mode_id = -1;        // force-mode 指定的模式，前台应用切换后失效
 
-AppConfig app_configs[MAX_APPS];
-int app_config_count = 0;
-int default_mode_id = 1;
+// 配置重载：inotify 只关心 mode.txt / daemon.conf，事件先经过去抖窗口合并
+#define CONFIG_DEBOUNCE_MS 150
+#define SCREEN_POLL_MAX_MS 30000
 
-int current_mode_id = -1;
+int config_timer_fd = -1;
+int config_reload_armed = 0;    // 去抖窗口内已有待处理的重载
+uint64_t mode_txt_hash = 0;     // 上次加载的文件内容哈希
+uint64_t daemon_conf_hash = 0;
+long long reloads_done = 0;
+long long reloads_unchanged = 0;    // 内容未变，跳过解析
+long long reloads_rejected = 0;     // 校验失败，保留旧配置
+long long events_filtered = 0;      // 其他文件 (如 mode.txt.tmp) 的事件
+long long events_coalesced = 0;     // 去抖窗口内合并掉的事件
+
+// 屏幕状态 (SCREEN_*)：背光节点、事件来源和熄屏时的检查间隔
+char sys_root[256] = "/sys";    // 主机测试时指向伪造的 sysfs 目录
+char backlight_path[256] = "";  // 为空时在 <sys_root>/class/backlight 下查找
+int backlight_fd = -1;
+int screen_state = SCREEN_ON;
+int screen_timer_fd = -1;
+int uevent_fd = -1;             // NETLINK_KOBJECT_UEVENT：背光设备的 change 事件
+int screen_push = 0;            // 已收到过背光 EPOLLPRI 或 uevent，屏幕状态变化由事件通知，停用屏幕定时器
+int screen_poll_cur_ms = 2000;  // 熄屏时的检查间隔，每次没有变化时加倍 (不超过 SCREEN_POLL_MAX_MS)
+int screen_reapply = 0;         // 亮屏后下一次决策直接下发，不比较当前模式
+long long screen_changed_us = 0;
+long long loop_wakeups = 0;     // epoll 唤醒次数
+long long wakeups_at_change = 0;
+long long daemon_start_us = 0;
+
+// 触摸空闲降频：无输入 idle_timeout_ms 后降到 idle_fps 对应档位，触摸时立即回到应用模式
+#define MAX_INPUT_DEVICES 8
+
+int input_fds[MAX_INPUT_DEVICES];
+int input_count = 0;
+char input_path[256] = "";      // --input=PATH：指定输入设备或录制的事件流
+int idle_timer_fd = -1;
+int touch_idle = 0;             // 1 表示已降到空闲档位
+int idle_timeout_cur_ms = 0;    // 当前生效的超时，反复抖动时翻倍
+long long last_touch_us = 0;
+long long idle_since_us = 0;
+long long idle_drops = 0;
+long long idle_boosts = 0;
+
+// 内容帧率匹配：mode.txt 中带 content 的应用，定期采样其图层的帧率投票
+int content_timer_fd = -1;
+int content_active = 0;         // 当前前台应用开启了 content，正在采样
+float content_rate = 0;         // 已确认的内容帧率，0 表示未知 (使用应用模式)
+int content_candidate = -1;     // 最近一次采样的帧率 (取整)
+int content_hits = 0;           // 连续采样到 content_candidate 的次数
+long long content_samples = 0;
+
+// 温控：按机身温度分级限制最高帧率，降温时带迟滞恢复
+#define MAX_THERMAL_STEPS 8
+
+typedef struct {
+    int temp_mc;                // 阈值 (毫摄氏度)
+    int fps;                    // 达到阈值后允许的最高帧率
+} ThermalStep;
+
+ThermalStep thermal_steps[MAX_THERMAL_STEPS];
+int thermal_step_count = 0;     // 0 表示关闭温控
+char thermal_path[600] = "";
+int thermal_fd = -1;
+int thermal_timer_fd = -1;
+int thermal_level = 0;          // 已超过的阈值个数
+int thermal_cap_fps = 0;        // 当前帧率上限，0 表示不限制
+int thermal_temp_mc = 0;
+long long thermal_changes = 0;
+
+// 规则条件的运行环境：电池状态和当天时间，配置中有条件规则时才定期采样
+#define ENV_POLL_MS 30000
+
+uint32_t env_bits = 0;          // 当前配置各条件谓词的取值
+int env_timer_fd = -1;
+int battery_level = -1;         // 电量百分比，-1 表示未知
+int battery_charging = 0;
+char fg_focus[MAX_LAYER_NAME] = "";     // dumpsys 最近一次的焦点窗口 (pkg/activity)
+
+// 平滑切换的逐级状态，由 ramp_timer_fd 推进，不阻塞主循环
+// 阶梯进行中可随时重定向 (从当前所在档位重新规划) 或取消
+int ramp_ids[MAX_MODES];
+int ramp_len = 0;
+int ramp_pos = 0;
+int ramp_target = -1;           // -1 表示当前没有进行中的阶梯切换
+long long ramp_start_us = 0;
+long long ramp_step_us = 0;     // 最近一次下发的时间
+
+// 切换校验：最后一级下发后读回 activeConfig，确认生效并记录稳定耗时
+// 未生效时重发，重试用尽则以系统实际模式为准，并在一段时间内不再尝试该目标
+#define VERIFY_POLL_MS 20           // 未生效时的最短读回间隔 (实际按稳定耗时，见 verify_poll_ms)
+#define VERIFY_TIMEOUT_MS 500       // 每次下发后等待生效的时长
+#define VERIFY_MAX_RETRIES 2
+#define VERIFY_BACKOFF_MS 5000
+#define RAMP_STEP_MAX_MS 200        // 自动调整的阶梯间隔上限
+#define SF_CALL_TIMEOUT_MS 2000     // service call 的完成标记超时
+int sf_calls_pending = 0;       // 已提交给常驻 shell、还没完成的切换调用
+
+DumpBuffer verify_buf;
+int verify_timer_fd = -1;
+int verify_target = -1;         // 等待确认的模式，-1 表示没有
+int verify_first_probe = 0;     // 本次校验的第一次读回
+int verify_retries_left = 0;
+long long verify_issued_us = 0;
+int verify_reject_id = -1;      // 最近被系统拒绝的目标
+long long verify_reject_until = 0;
+long long verify_ok = 0;
+long long verify_retries = 0;
+long long verify_resyncs = 0;
+long long settle_last_us = 0;
+long long settle_max_us = 0;
+long long settle_ewma_us = 0;   // 用于调整阶梯间隔的稳定耗时均值
+int ramp_step_tuned_ms = 0;     // 自动调整后的阶梯间隔，不低于 ramp_step_ms
+
+// 使用统计：亮屏期间每个前台应用在各模式下的时长，以及切换耗时分布 (发起 -> 确认生效)
+// 每轮事件循环结束时记账 (两次唤醒之间状态不变)；定期写入 <module>/stats.bin，启动时读回继续累计
+#define STATS_MAX_APPS 128          // 超出的应用计入 "(other)"
+#define STATS_APP_MODES 16
+#define STATS_HIST_BUCKETS 14       // 按毫秒 2 的幂分桶: <1, [1,2), [2,4) ... [2048,4096), >=4096
+#define STATS_FLUSH_MS 300000
+#define STATS_MAGIC 0x31534452u     // "RDS1"
+#define STATS_VERSION 2         // 2: 每个模式增加能耗
+
+typedef struct {
+    int mode_id;
+    long long us;
+    long long uj;               // 能耗 (微焦)
+} StatsSlot;
+
+typedef struct {
+    char pkg[MAX_PKG_LEN];
+    long long total_us;
+    long long total_uj;
+    int slot_count;
+    StatsSlot slots[STATS_APP_MODES];
+} StatsApp;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t app_count;
+    uint32_t hist_buckets;
+    int64_t since;
+    int64_t switches;
+    int64_t screen_off_us;
+} StatsFileHeader;
+
+StatsApp stats_apps[STATS_MAX_APPS];
+int stats_app_count = 0;
+long long stats_mode_us[MAX_MODE_ID];
+long long stats_mode_uj[MAX_MODE_ID];
+long long stats_hist[STATS_HIST_BUCKETS];
+long long stats_switches = 0;
+long long stats_screen_off_us = 0;
+long long stats_since = 0;      // 统计开始时间 (time(NULL))
+long long stats_last_us = 0;    // 上次记账的时间，0 表示还没开始
+int stats_prev_app = -1;        // 上次记账时的前台应用 / 模式 / 屏幕状态
+int stats_prev_mode = -1;
+int stats_prev_off = 0;
+int stats_dirty = 0;
+int stats_timer_fd = -1;
+long long switch_request_us = 0;    // 当前切换的发起时间 (触发事件的唤醒时间)
+
+// 能耗归因：低频采样电池 current_now × voltage_now，功率在两次采样之间视为不变
+// 记账时按时长乘以功率计入当时的应用和模式；熄屏和充电期间不计，电流电压读取失败的时长单独统计
+char power_supply_path[320] = "";   // 为空时使用 <sys_root>/class/power_supply/battery
+int energy_status_fd = -1;
+int energy_current_fd = -1;
+int energy_voltage_fd = -1;
+int energy_timer_fd = -1;
+int energy_active = 0;              // 正在采样 (回放时由录制的功率记录开启)
+int energy_charging = 0;
+long long energy_power_uw = -1;     // 最近一次采样的放电功率，-1 表示未知或充电中
+long long energy_samples = 0;
+long long energy_charging_us = 0;   // 充电 (不计能耗) 的亮屏时长
+long long energy_unknown_us = 0;    // 放电但功率读取失败的亮屏时长
+
+// SurfaceFlinger 模式切换后端 (SF_BACKEND_*) 与常驻 shell
+int sf_backend = SF_BACKEND_SHELL;
+char sf_fake_path[256] = "";
+pid_t helper_pid = -1;          // 常驻 shell，模式切换和系统设置同步共用
+int helper_in = -1;             // 写入命令
+int helper_out = -1;            // 读取完成标记 (挂在事件循环上)
+int helper_timer_fd = -1;       // 队首命令的超时
+char helper_line[4];            // 只需要判断是否恰好为 "OK"，更长的行不会匹配
+int helper_line_len = 0;
+
+// 提交给常驻 shell 的命令依次执行，完成标记按提交顺序返回；ok 为 0 表示超时或 shell 退出
+typedef void (*shell_done_handler)(int ok, long long start_us, int arg);
+
+#define SHELL_QUEUE_MAX 16
+typedef struct {
+    shell_done_handler done;
+    long long start_us;         // 提交时间
+    int timeout_ms;             // 从排到队首 (前一条完成) 时开始计时
+    int arg;
+} ShellCmd;
+
+ShellCmd shell_queue[SHELL_QUEUE_MAX];
+int shell_queue_head = 0;
+int shell_queue_len = 0;
+
+// 每次切换调用的耗时统计 (微秒)
+CallStats sf_stats;
+CallStats exec_stats;           // 子进程调用 (dumpsys)：从 spawn 到 waitpid 返回的耗时
+long long exec_spawn_us = 0;    // 其中 posix_spawn 本身的累计耗时
+
+// 异步子进程：输出管道挂在事件循环上，读完后回调 (len 为读到的字节数，失败为 -1)
+typedef void (*exec_done_handler)(DumpBuffer *buf, long len, long long start_us);
+
+#define MAX_EXEC_JOBS 6
+typedef struct {
+    pid_t pid;                  // 0 表示空闲
+    int fd;
+    DumpBuffer *buf;
+    const char *until;          // 读到包含它的完整一行即结束，NULL 为读到 EOF
+    char name[32];              // 追踪中显示的命令
+    size_t scanned;
+    long long start_us;
+    exec_done_handler done;
+} ExecJob;
+
+ExecJob exec_jobs[MAX_EXEC_JOBS];
+
+// 追踪 (--trace=PATH)：输出 Chrome trace-event JSON，可直接用 Perfetto / chrome://tracing 打开
+// 时间戳为单调时钟微秒；未开启时每个埋点只多一次 trace_fp 判断
+#define TRACE_MAX_BYTES (64L * 1024 * 1024)
+enum {
+    TRACE_TID_MAIN = 1,         // 事件循环里的同步调用
+    TRACE_TID_SWITCH,           // 一次切换从触发事件到生效
+    TRACE_TID_VERIFY,           // 下发到读回确认
+    TRACE_TID_EXEC              // 异步子进程 (dumpsys) 和常驻 shell 命令，从发起到完成
+};
+FILE *trace_fp = NULL;
+long trace_bytes = 0;
+long long trace_events = 0;
+int trace_pending = 0;          // 有未刷写的事件，本轮事件处理完后 fflush
+
+// 录制 (--record=PATH)：记录决策的全部输入，供 rate_daemon replay 离线回放
+// 文本格式，每行 "<类型> <相对时间us> ..."：
+//   R 版本 起始时间(epoch)     M id 宽 高 帧率          F 包名 焦点窗口(无为 -)
+//   S 0|1 (屏幕)              B 电量 充电中            A 读到的系统当前模式
+//   I 启动切换 (1 为模式来自缓存)  E 录制结束
+//   P 放电功率uW(-1 为未知) 充电中 (每次采样结果变化时)
+//   C/D 长度，下一行起为 mode.txt / daemon.conf 原文
+#define RECORD_VERSION 1
+FILE *record_fp = NULL;
+long long record_start_us = 0;
+char record_pkg[MAX_PKG_LEN] = "";
+char record_focus[MAX_LAYER_NAME] = "";
+int record_battery = -2;
+int record_charging = -1;
+long long record_power = -2;
+int record_power_charging = -1;
+
+// 回放：虚拟时钟，>= 0 时 now_us() 返回它，定时器由回放循环调度
+long long replay_clock_us = -1;
+time_t replay_wall_base = 0;    // 录制开始时的墙上时间，time= 条件按它换算
+
+#define TRACE_BEGIN() (trace_fp ? now_us() : 0)
+#define TRACE_END(t0, name, ...) do { \
+    if (trace_fp) trace_span(TRACE_TID_MAIN, name, t0, now_us(), __VA_ARGS__); \
+} while (0)
+
+// 系统设置缓存：记录上次写入的值，只写变化的项
+typedef struct {
+    const char *ns;
+    const char *key;
+    char value[16];             // 已确认写入的值，空串表示未知，必须写入
+    char pending[16];           // 已提交、等待完成标记的值
+    int batch;                  // pending 所属的批次
+} SettingEntry;
+
+SettingEntry settings_cache[] = {
+    { "secure", "support_highfps", "", "", 0 },
+    { "system", "peak_refresh_rate", "", "", 0 },
+    { "system", "user_refresh_rate", "", "", 0 },
+    { "system", "min_refresh_rate", "", "", 0 },
+    { "system", "default_refresh_rate", "", "", 0 },
+    { "global", "debug.cpurend.vsync", "", "", 0 },
+    { "global", "hwui.disable_vsync", "", "", 0 },
+};
+#define SETTINGS_COUNT ((int)(sizeof(settings_cache) / sizeof(settings_cache[0])))
+
+long long settings_written = 0;
+long long settings_skipped = 0;
+long long settings_batches = 0;
+int settings_batch_seq = 0;
+int settings_batch_fps[SHELL_QUEUE_MAX];    // 进行中批次的帧率 (按批次号取模，只用于日志)
+
+// 显示模式缓存 (<module>/modes.cache)：以 build 指纹 + DTBO 头部哈希为键
+// 命中时启动不再需要 dumpsys SurfaceFlinger，稍后在后台校验一次
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t count;
+    uint32_t checksum;          // 模式表 (含上一份) 的 FNV-1a
+    uint32_t prev_count;        // 版本 2: 模式表之后是上一份模式表
+} ModeCacheHeader;
+
+char dtbo_path[256] = "";       // 为空时按 ro.boot.slot_suffix 推导
+char prop_dir[256] = "";        // 主机测试用的属性目录
+int modes_from_cache = 0;
+int validate_timer_fd = -1;
+
+// 守护进程参数 (config/daemon.conf，key=value)
+int ramp_step_ms = 50;          // 每一级的停留时间
+int ramp_settle_ms = 50;        // 最后一级到同步系统设置之间的停留时间
+int ramp_stride = 1;            // 每步跨越的档位数，>1 时跳过中间档位
+int ramp_max_steps = 0;         // 单次切换最多下发的步数，0 为不限制 (用于限制切换总时长)
+int verify_switch = 1;          // 切换后读回 activeConfig 校验
+int ramp_auto_tune = 1;         // 按校验得到的稳定耗时加大阶梯间隔
+int screen_poll_ms = 2000;      // 屏幕状态检查间隔 (熄屏时的初始间隔，之后逐次加倍)
+int idle_fps = 0;               // 空闲时的目标刷新率，0 为关闭空闲降频
+int idle_timeout_ms = 3000;     // 无触摸多久后降频
+int content_sample_ms = 1000;   // 内容帧率采样间隔 (每次执行一次 dumpsys SurfaceFlinger)
+char thermal_zone[64] = "";     // 温度节点 (thermal_zoneN 或 type 名)，为空时自动选择
+int thermal_poll_ms = 5000;     // 温度采样间隔 (熄屏时停止)
+int energy_sample_ms = 10000;   // 电池功率采样间隔，0 为关闭能耗统计
+char cpu_affinity[64] = "little";   // 绑定的 CPU: little (自动选能效核) / all / 列表 (如 0-3,6)
+int sched_idle = 1;             // 轮询等日常工作以 SCHED_IDLE 运行，0 时改用 sched_nice
+int sched_nice = 10;
+int ramp_boost = 1;             // 下发切换期间临时提升主线程和常驻 shell 的优先级
+char cgroup_dirs[256] = "";     // 启动后加入的 cgroup 目录，逗号分隔
+float cpu_budget_pct = 0;       // CPU 占用预算 (含 dumpsys 子进程)，超出时记警告，0 为不检查
+int thermal_hysteresis = 2;     // 降级需要低于阈值的度数
 
 // Function Prototypes
+void trace_span(int tid, const char *name, long long start_us, long long end_us, const char *args_fmt, ...);
+void sched_boost(int on);
+void trace_instant(const char *name, const char *args_fmt, ...);
+void trace_counter(const char *name, const char *key, long long value);
+void trace_close();
+void record_event(char tag, const char *fmt, ...);
+void record_snapshot(char tag, const char *base, const char *name);
+void record_foreground(const char *pkg);
 void set_surface_flinger(int id);
 void sync_android_settings(int id);
 int get_mode_width(int id);
-void get_sorted_fps_modes(int width, int *out_ids, int *out_count);
+int get_mode_fps(int id);
+const Ladder *get_mode_ladder(int id);
+int get_mode_rung(int id);
+void build_mode_index();
 int is_valid_mode(int id);
+void ramp_step();
+void ramp_cancel();
+void verify_start(int target_id, int delay_ms);
+void verify_check();
+void verify_cancel();
+int loop_add(int fd, event_handler handler);
+void loop_del(int fd);
+long long now_us();
+void timer_arm(int fd, int delay_ms, int interval_ms);
+int timer_create_fd();
+void timer_drain(int fd);
+void evaluate_foreground();
+void apply_package_mode(const char *pkg, int changed);
+int idle_mode_for(int mode_id);
+int content_mode_for(int app_mode, float rate);
+int thermal_cap_for(int mode_id);
+void parse_thermal_caps(const char *value);
+void content_update(const char *pkg);
+void content_reset();
+void ctl_notify(const char *fmt, ...);
+void ctl_apply_pending();
+void env_sync();
 
-#define LOG_FILE "/data/adb/modules/murongchaopin/daemon.log"
+// 日志 (级别和异步环形缓冲区的定义见 rate_daemon.h)
+int log_level = LOG_LEVEL_INFO;
+int log_max_kb = 512;           // 超过后轮转为 daemon.log.1
 
-void log_msg(const char *fmt, ...) {
-    FILE *fp = fopen(LOG_FILE, "a");
-    if (fp) {
-        va_list args;
-        va_start(args, fmt);
-        
-        // Add timestamp
-        time_t now = time(NULL);
-        struct tm *t = localtime(&now);
-        fprintf(fp, "[%02d-%02d %02d:%02d:%02d] ", 
-            t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec);
-        
-        vfprintf(fp, fmt, args);
-        fprintf(fp, "\n");
-        
-        va_end(args);
-        fclose(fp);
+AsyncLog async_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+// 超过大小上限时轮转 (在刷写线程中调用)
+void log_rotate_if_needed(AsyncLog *lg) {
+    struct stat st;
+    if (lg->fd < 0 || fstat(lg->fd, &st) < 0 || st.st_size < (off_t)log_max_kb * 1024) return;
+
+    char old_path[520];
+    snprintf(old_path, sizeof(old_path), "%s.1", lg->path);
+    rename(lg->path, old_path);
+    close(lg->fd);
+    lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+// 把环形缓冲区中的内容写出 (调用时持有锁；write 期间释放锁，主线程可继续写入 head 之后的空间)
+void log_flush_locked(AsyncLog *lg) {
+    while (lg->tail < lg->head) {
+        size_t start = lg->tail % LOG_RING_SIZE;
+        size_t len = lg->head - lg->tail;
+        if (start + len > LOG_RING_SIZE) len = LOG_RING_SIZE - start;
+
+        pthread_mutex_unlock(&lg->lock);
+        ssize_t n = lg->fd >= 0 ? write(lg->fd, lg->buf + start, len) : -1;
+        pthread_mutex_lock(&lg->lock);
+
+        lg->writes++;
+        // 写不出去 (文件打不开等) 时丢弃，避免缓冲区一直满
+        lg->tail += n > 0 ? (size_t)n : len;
     }
-    
-    // Also print to stdout for debugging if running manually
-    va_list args2;
-    va_start(args2, fmt);
-    vprintf(fmt, args2);
-    printf("\n");
-    va_end(args2);
+    log_rotate_if_needed(lg);
+}
+
+void *log_flusher(void *arg) {
+    AsyncLog *lg = arg;
+    pthread_mutex_lock(&lg->lock);
+    while (lg->running) {
+        // 平时每 LOG_FLUSH_MS 批量写一次，缓冲区超过一半时由写入方提前唤醒
+        if (lg->head - lg->tail <= LOG_RING_SIZE / 2) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += LOG_FLUSH_MS / 1000;
+            pthread_cond_timedwait(&lg->cond, &lg->lock, &ts);
+        }
+        log_flush_locked(lg);
+    }
+    log_flush_locked(lg);
+    pthread_mutex_unlock(&lg->lock);
+    return NULL;
+}
+
+// 启动异步日志；在此之前的日志同步写入
+int log_init(const char *path) {
+    AsyncLog *lg = &async_log;
+    if (snprintf(lg->path, sizeof(lg->path), "%s", path) >= (int)sizeof(lg->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    lg->to_stdout = isatty(STDOUT_FILENO);
+    lg->running = 1;
+    if (pthread_create(&lg->thread, NULL, log_flusher, lg) != 0) {
+        lg->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// 停止后台线程并写出剩余日志
+void log_shutdown() {
+    AsyncLog *lg = &async_log;
+    if (!lg->running) return;
+    pthread_mutex_lock(&lg->lock);
+    lg->running = 0;
+    pthread_cond_signal(&lg->cond);
+    pthread_mutex_unlock(&lg->lock);
+    pthread_join(lg->thread, NULL);
+    if (lg->fd >= 0) close(lg->fd);
+    lg->fd = -1;
+}
+
+void log_vwrite(int level, const char *fmt, va_list args) {
+    static const char *tags[] = { "D/", "", "W/", "E/" };
+    AsyncLog *lg = &async_log;
+    char line[LOG_LINE_MAX];
+
+    // 时间戳每秒只格式化一次
+    time_t now = time(NULL);
+    if (now != lg->stamp_sec) {
+        struct tm t;
+        localtime_r(&now, &t);
+        snprintf(lg->stamp, sizeof(lg->stamp), "[%02d-%02d %02d:%02d:%02d] ",
+            t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        lg->stamp_sec = now;
+    }
+
+    int len = snprintf(line, sizeof(line), "%s%s", lg->stamp, tags[level]);
+    int body = len;
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+
+    // 手动运行时也输出到 stdout 方便调试
+    if (lg->to_stdout || !lg->running) fwrite(line + body, 1, len - body, stdout);
+
+    if (!lg->running) {
+        // 异步日志未启动：同步追加
+        int fd = open(lg->path[0] ? lg->path : LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            ssize_t n = write(fd, line, len);
+            (void)n;
+            close(fd);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&lg->lock);
+    if (lg->head - lg->tail + len > LOG_RING_SIZE) {
+        lg->dropped++;
+    } else {
+        size_t start = lg->head % LOG_RING_SIZE;
+        size_t first = len;
+        if (start + first > LOG_RING_SIZE) first = LOG_RING_SIZE - start;
+        memcpy(lg->buf + start, line, first);
+        memcpy(lg->buf, line + first, len - first);
+        lg->head += len;
+        lg->messages++;
+        // 超过一半时提前唤醒刷写线程
+        if (lg->head - lg->tail > LOG_RING_SIZE / 2) pthread_cond_signal(&lg->cond);
+    }
+    pthread_mutex_unlock(&lg->lock);
+}
+
+void log_at(int level, const char *fmt, ...) {
+    if (level < log_level) return;
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(level, fmt, args);
+    va_end(args);
+}
+
+void log_msg(const char *fmt, ...) {
+    if (LOG_LEVEL_INFO < log_level) return;
+    va_list args;
+    va_start(args, fmt);
+    log_vwrite(LOG_LEVEL_INFO, fmt, args);
+    va_end(args);
 }
 
 // 工具函数：去除字符串两端空白
@@ -82,452 +614,4526 @@ char* trim(char* str) {
     return str;
 }
 
-// 解析 dumpsys SurfaceFlinger 获取模式
-void init_display_modes() {
-    FILE *fp;
-    char line[1024];
-    
-    // 直接读取 dumpsys SurfaceFlinger 输出，手动解析以提高兼容性
-    fp = popen("dumpsys SurfaceFlinger", "r");
-    if (fp == NULL) {
-        log_msg("Failed to run dumpsys SurfaceFlinger / 执行 dumpsys SurfaceFlinger 失败");
-        return;
+extern char **environ;
+
+// 缓冲区至少保留 room 字节空闲 (按需翻倍增长，之后复用)
+int dump_buffer_reserve(DumpBuffer *buf, size_t room) {
+    if (buf->cap - buf->len >= room) return 0;
+    size_t cap = buf->cap ? buf->cap * 2 : 262144;
+    while (cap - buf->len < room) cap *= 2;
+    char *p = realloc(buf->data, cap);
+    if (!p) return -1;
+    buf->data = p;
+    buf->cap = cap;
+    return 0;
+}
+
+// 启动程序，标准输出接到管道，返回子进程 pid 并通过 out_fd 返回管道读端，失败返回 -1
+// 用 posix_spawnp 直接执行 argv (不经过 sh 解析，也不复制守护进程的地址空间)
+pid_t exec_spawn(char *const argv[], int *out_fd) {
+    long long start = now_us();
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // 守护进程屏蔽了 SIGTERM 等信号并忽略 SIGPIPE，子进程恢复默认
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t empty, sigdef;
+    sigemptyset(&empty);
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (rc != 0) {
+        close(fds[0]);
+        errno = rc;
+        return -1;
+    }
+    exec_spawn_us += now_us() - start;
+    *out_fd = fds[0];
+    return pid;
+}
+
+// 缓冲区中 scanned 之后是否出现了包含 until 的完整一行 (从上次检查位置回退 until_len，匹配可能跨两次 read)
+int dump_buffer_has_line(const DumpBuffer *buf, const char *until, size_t *scanned) {
+    size_t until_len = strlen(until);
+    size_t from = *scanned > until_len ? *scanned - until_len : 0;
+    char *hit = memmem(buf->data + from, buf->len - from, until, until_len);
+    *scanned = buf->len;
+    return hit && memchr(hit, '\n', buf->data + buf->len - hit) != NULL;
+}
+
+void exec_account(long long start) {
+    long long cost = now_us() - start;
+    exec_stats.count++;
+    exec_stats.total_us += cost;
+    exec_stats.last_us = cost;
+    if (cost > exec_stats.max_us) exec_stats.max_us = cost;
+}
+
+// 执行程序并把标准输出整块读入缓冲区，返回读取的字节数，失败返回 -1
+// until 不为空时读到包含它的完整一行就关闭管道 (代替 | grep -m1，子进程随后因 SIGPIPE 退出)
+long exec_read(char *const argv[], DumpBuffer *buf, const char *until) {
+    long long start = now_us();
+    int fd;
+    pid_t pid = exec_spawn(argv, &fd);
+    if (pid < 0) return -1;
+
+    size_t scanned = 0;
+    buf->len = 0;
+    while (dump_buffer_reserve(buf, 65536) == 0) {
+        ssize_t n = read(fd, buf->data + buf->len, buf->cap - buf->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf->len += n;
+        if (until && dump_buffer_has_line(buf, until, &scanned)) break;
+    }
+    close(fd);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+    if (buf->data) buf->data[buf->len] = '\0';
+    exec_account(start);
+    return (long)buf->len;
+}
+
+// 结束异步任务：读到需要的内容后子进程不必再输出，直接杀掉；回收后再回调 (回调里可以发起新任务)
+void exec_job_finish(ExecJob *job, long len) {
+    loop_del(job->fd);
+    close(job->fd);
+    kill(job->pid, SIGKILL);
+    while (waitpid(job->pid, NULL, 0) < 0 && errno == EINTR) {}
+    exec_account(job->start_us);
+    trace_span(TRACE_TID_EXEC, job->name, job->start_us, now_us(), "\"bytes\":%ld", len);
+    DumpBuffer *buf = job->buf;
+    exec_done_handler done = job->done;
+    long long start_us = job->start_us;
+    job->pid = 0;
+    buf->data[buf->len] = '\0';
+    if (done) done(buf, len, start_us);
+}
+
+void on_exec_output(int fd, uint32_t events) {
+    (void)events;
+    ExecJob *job = NULL;
+    for (int i = 0; i < MAX_EXEC_JOBS; i++) {
+        if (exec_jobs[i].pid > 0 && exec_jobs[i].fd == fd) job = &exec_jobs[i];
+    }
+    if (!job) return;
+    DumpBuffer *buf = job->buf;
+    while (dump_buffer_reserve(buf, 65536) == 0) {
+        ssize_t n = read(fd, buf->data + buf->len, buf->cap - buf->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) break;
+        buf->len += n;
+        if (job->until && dump_buffer_has_line(buf, job->until, &job->scanned)) break;
+    }
+    exec_job_finish(job, (long)buf->len);
+}
+
+// 是否有以 done 为回调的任务在进行
+int exec_running(exec_done_handler done) {
+    for (int i = 0; i < MAX_EXEC_JOBS; i++) {
+        if (exec_jobs[i].pid > 0 && exec_jobs[i].done == done) return 1;
+    }
+    return 0;
+}
+
+// 异步执行程序 (exec_read 的事件循环版本)，输出读入 buf 后调用 done；启动失败返回 -1，不回调
+int exec_async(char *const argv[], DumpBuffer *buf, const char *until, exec_done_handler done) {
+    ExecJob *job = NULL;
+    for (int i = 0; i < MAX_EXEC_JOBS && !job; i++) {
+        if (exec_jobs[i].pid <= 0) job = &exec_jobs[i];
+    }
+    // 预留缓冲区：回调时 buf->data 总是有效且以 '\0' 结尾
+    if (!job || dump_buffer_reserve(buf, 65536) < 0) return -1;
+    long long start = now_us();
+    int fd;
+    pid_t pid = exec_spawn(argv, &fd);
+    if (pid < 0) return -1;
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || loop_add(fd, on_exec_output) < 0) {
+        close(fd);
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+        return -1;
+    }
+    buf->len = 0;
+    job->pid = pid;
+    job->fd = fd;
+    job->buf = buf;
+    job->until = until;
+    snprintf(job->name, sizeof(job->name), "%s %s", argv[0], argv[1] ? argv[1] : "");
+    job->scanned = 0;
+    job->start_us = start;
+    job->done = done;
+    return 0;
+}
+
+// 取消以 done 为回调的任务 (不回调)；done 为 NULL 时取消全部 (退出时)
+void exec_cancel(exec_done_handler done) {
+    for (int i = 0; i < MAX_EXEC_JOBS; i++) {
+        ExecJob *job = &exec_jobs[i];
+        if (job->pid <= 0 || (done && job->done != done)) continue;
+        job->done = NULL;
+        exec_job_finish(job, -1);
+    }
+}
+
+// 解析 "=" 后面的第一个数字 (跳过 { 之类的前缀)
+float parse_float_after(const char *p, const char *end) {
+    while (p < end && !isdigit((unsigned char)*p) && *p != '-' && *p != '\n') p++;
+    if (p >= end || *p == '\n') return 0;
+    return strtof(p, NULL);
+}
+
+// 解析 dumpsys SurfaceFlinger 时关心的关键字
+enum {
+    SF_TOK_VSYNC = 0,           // 模式行: {id=0, hwcId=0, resolution=1264x2780, vsyncRate=120.000000 Hz, ...}
+    SF_TOK_ACTIVE,              // 当前模式: activeConfig=0
+    SF_TOK_LAYER,               // 图层块开头: "+ Xxx (com.foo/com.foo.MainActivity#123) ..."
+    SF_TOK_FRAMERATE,           // 图层的帧率投票: frameRate={60.00, ...}
+    SF_TOK_COUNT
+};
+
+static const struct {
+    const char *str;
+    size_t len;
+} sf_tokens[SF_TOK_COUNT] = {
+    { "vsyncRate=", 10 },
+    { "activeConfig=", 13 },
+    { "+ ", 2 },
+    { "frameRate=", 10 },
+};
+
+// 在 [line, pos) 范围内查找独立的 key= (前一个字符不是标识符字符)
+const char *find_key_in_line(const char *line, const char *pos, const char *key, size_t klen) {
+    const char *p = line;
+    while ((p = memmem(p, pos - p, key, klen)) != NULL) {
+        if (p == line || !(isalnum((unsigned char)p[-1]) || p[-1] == '_')) return p + klen;
+        p += klen;
+    }
+    return NULL;
+}
+
+// 解析 dumpsys SurfaceFlinger 输出 (原地解析，不拷贝行)
+// 每个关键字各用 strstr 向前查找 (每个关键字扫描一遍缓冲区，共 SF_TOK_COUNT 遍)，命中按出现位置依次合并处理
+// 逐行扫描每个 '=' 的单遍写法实测更慢：一行有多个 '='，短距离 memchr 的调用开销超过 strstr 的整块查找
+// data 必须以 '\0' 结尾 (exec_read 保证)
+void parse_sf_dump(const char *data, size_t len, SfDump *out) {
+    out->mode_count = 0;
+    out->active_config = -1;
+    out->layer_count = 0;
+
+    const char *end = data + len;
+    const char *next[SF_TOK_COUNT];
+    for (int t = 0; t < SF_TOK_COUNT; t++) {
+        next[t] = strstr(data, sf_tokens[t].str);
+    }
+    LayerInfo *layer = NULL;
+
+    while (1) {
+        // 取位置最靠前的关键字
+        int t = -1;
+        for (int i = 0; i < SF_TOK_COUNT; i++) {
+            if (next[i] && (t == -1 || next[i] < next[t])) t = i;
+        }
+        if (t == -1) break;
+
+        const char *pos = next[t];
+        const char *val = pos + sf_tokens[t].len;
+        const char *line = pos;
+        while (line > data && line[-1] != '\n') line--;
+
+        if (t == SF_TOK_VSYNC) {
+            const char *id_p = find_key_in_line(line, pos, "id=", 3);
+            const char *res_p = find_key_in_line(line, pos, "resolution=", 11);
+            int id = id_p ? atoi(id_p) : -1;
+            int w = 0, h = 0;
+            if (res_p) sscanf(res_p, "%dx%d", &w, &h);
+            float fps_f = strtof(val, NULL);
+
+            if (id >= 0 && w > 0 && h > 0 && fps_f > 0 && out->mode_count < MAX_MODES) {
+                // 查重
+                int exists = 0;
+                for (int k = 0; k < out->mode_count; k++) {
+                    if (out->modes[k].id == id) { exists = 1; break; }
+                }
+                if (!exists) {
+                    DisplayMode *m = &out->modes[out->mode_count++];
+                    m->id = id;
+                    m->width = w;
+                    m->height = h;
+                    m->fps = (int)(fps_f + 0.5);
+                }
+            }
+        } else if (t == SF_TOK_ACTIVE) {
+            if (out->active_config == -1 && (pos == line || !isalnum((unsigned char)pos[-1]))) {
+                out->active_config = atoi(val);
+            }
+        } else if (t == SF_TOK_LAYER) {
+            // 只认行首 (允许缩进) 的 "+ "
+            const char *q = line;
+            while (q < pos && *q == ' ') q++;
+            if (q == pos) {
+                const char *eol = memchr(pos, '\n', end - pos);
+                if (!eol) eol = end;
+                const char *lp = memchr(pos, '(', eol - pos);
+                const char *rp = lp ? memchr(lp, ')', eol - lp) : NULL;
+                layer = NULL;
+                if (rp && out->layer_count < MAX_LAYERS) {
+                    layer = &out->layers[out->layer_count++];
+                    size_t n = rp - lp - 1;
+                    if (n >= MAX_LAYER_NAME) n = MAX_LAYER_NAME - 1;
+                    memcpy(layer->name, lp + 1, n);
+                    layer->name[n] = '\0';
+                    layer->frame_rate = 0;
+                }
+            }
+        } else if (t == SF_TOK_FRAMERATE) {
+            if (layer && layer->frame_rate == 0) {
+                const char *eol = memchr(val, '\n', end - val);
+                layer->frame_rate = parse_float_after(val, eol ? eol : end);
+            }
+        }
+
+        next[t] = strstr(val, sf_tokens[t].str);
+    }
+}
+
+// 执行 dumpsys SurfaceFlinger 并解析
+int dump_surface_flinger(SfDump *out) {
+    char *const argv[] = { "dumpsys", "SurfaceFlinger", NULL };
+    if (exec_read(argv, &sf_dump_buf, NULL) < 0) return -1;
+    parse_sf_dump(sf_dump_buf.data, sf_dump_buf.len, out);
+    return 0;
+}
+
+// FNV-1a 64 位哈希
+uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+#define FNV1A64_INIT 14695981039346656037ULL
+
+// 读取系统属性，失败时返回空串
+// prop_dir 非空时从目录读取 (每个属性一个文件，文件名即属性名)，作为主机测试的属性服务替身
+int prop_get(const char *name, char *value) {
+    value[0] = '\0';
+    if (prop_dir[0]) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", prop_dir, name);
+        FILE *fp = fopen(path, "r");
+        if (!fp) return 0;
+        if (!fgets(value, PROP_VALUE_MAX_LEN, fp)) value[0] = '\0';
+        fclose(fp);
+        value[strcspn(value, "\r\n")] = '\0';
+        return strlen(value);
+    }
+#ifdef __ANDROID__
+    return __system_property_get(name, value);
+#else
+    (void)name;
+    return 0;
+#endif
+}
+
+#ifdef __ANDROID__
+typedef struct {
+    char *value;
+    uint32_t serial;
+} PropRead;
+
+void prop_read_cb(void *cookie, const char *name, const char *value, uint32_t serial) {
+    (void)name;
+    PropRead *pr = cookie;
+    strncpy(pr->value, value, PROP_VALUE_MAX_LEN - 1);
+    pr->value[PROP_VALUE_MAX_LEN - 1] = '\0';
+    pr->serial = serial;
+}
+#endif
+
+// 阻塞等待属性变为指定值
+// Android 上使用 __system_property_wait (基于 futex，属性不变时不会唤醒)
+// 属性还不存在时等待全局序列号变化；prop_dir 模式下用 inotify 监听目录
+int prop_wait(const char *name, const char *expected) {
+    char value[PROP_VALUE_MAX_LEN];
+
+    if (prop_dir[0]) {
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) return -1;
+        inotify_add_watch(fd, prop_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        while (1) {
+            prop_get(name, value);
+            if (strcmp(value, expected) == 0) break;
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            if (read(fd, buf, sizeof(buf)) < 0 && errno != EINTR) {
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+        return 0;
+    }
+
+#ifdef __ANDROID__
+    uint32_t global_serial = 0;
+    while (1) {
+        const prop_info *pi = __system_property_find(name);
+        if (pi) {
+            PropRead pr = { value, 0 };
+            __system_property_read_callback(pi, prop_read_cb, &pr);
+            if (strcmp(value, expected) == 0) return 0;
+            uint32_t serial;
+            __system_property_wait(pi, pr.serial, &serial, NULL);
+        } else {
+            // 以 0 为旧序列号会立即返回当前的全局序列号，之后阻塞等待任意属性变化
+            __system_property_wait(NULL, global_serial, &global_serial, NULL);
+        }
+    }
+#else
+    // 没有属性服务也没有替身目录，无法等待
+    (void)expected;
+    log_msg("No property service for / 无法等待属性 %s", name);
+    return -1;
+#endif
+}
+
+// 计算缓存键：build 指纹 + DTBO 分区头部 (dt_table_header 及条目表，节点增删会改变大小和偏移)
+uint64_t mode_cache_key() {
+    char fingerprint[PROP_VALUE_MAX_LEN] = "";
+    prop_get("ro.build.fingerprint", fingerprint);
+    uint64_t h = fnv1a64(FNV1A64_INIT, fingerprint, strlen(fingerprint));
+
+    char path[256];
+    if (dtbo_path[0]) {
+        strncpy(path, dtbo_path, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+    } else {
+        char slot[PROP_VALUE_MAX_LEN] = "";
+        prop_get("ro.boot.slot_suffix", slot);
+        snprintf(path, sizeof(path), "/dev/block/by-name/dtbo%s", slot);
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        unsigned char head[4096];
+        ssize_t n = read(fd, head, sizeof(head));
+        if (n > 0) h = fnv1a64(h, head, n);
+        close(fd);
+    }
+    return h;
+}
+
+void mode_cache_path(char *path, size_t size) {
+    snprintf(path, size, "%s/modes.cache", module_path);
+}
+
+// 保存模式表 (先写临时文件再 rename，避免中途断电留下半个文件)
+void save_mode_cache() {
+    char path[512], tmp[520];
+    mode_cache_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    ModeCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MODE_CACHE_MAGIC;
+    hdr.version = MODE_CACHE_VERSION;
+    hdr.key = mode_cache_key();
+    hdr.count = mode_count;
+    hdr.prev_count = prev_mode_count;
+    uint64_t h = fnv1a64(FNV1A64_INIT, modes, mode_count * sizeof(DisplayMode));
+    hdr.checksum = (uint32_t)fnv1a64(h, prev_modes, prev_mode_count * sizeof(DisplayMode));
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(modes, sizeof(DisplayMode), mode_count, fp) == (size_t)mode_count &&
+             fwrite(prev_modes, sizeof(DisplayMode), prev_mode_count, fp) == (size_t)prev_mode_count;
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(tmp, path) == 0) {
+        log_msg("Mode cache saved / 模式缓存已保存: %d modes", mode_count);
+    } else {
+        unlink(tmp);
+    }
+}
+
+// 加载模式表缓存，键不匹配或文件损坏时返回 0
+int load_mode_cache() {
+    char path[512];
+    mode_cache_path(path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+
+    ModeCacheHeader hdr;
+    DisplayMode cached[MAX_MODES], cached_prev[MAX_MODES];
+    // 版本 1 的头部没有 prev_count，按 0 处理
+    size_t v1_size = offsetof(ModeCacheHeader, prev_count);
+    int ok = fread(&hdr, v1_size, 1, fp) == 1 &&
+             hdr.magic == MODE_CACHE_MAGIC && (hdr.version == 1 || hdr.version == MODE_CACHE_VERSION);
+    hdr.prev_count = 0;
+    if (ok && hdr.version == MODE_CACHE_VERSION) {
+        ok = fread((char *)&hdr + v1_size, sizeof(hdr) - v1_size, 1, fp) == 1 && hdr.prev_count <= MAX_MODES;
+    }
+    ok = ok && hdr.count > 0 && hdr.count <= MAX_MODES &&
+         fread(cached, sizeof(DisplayMode), hdr.count, fp) == hdr.count &&
+         fread(cached_prev, sizeof(DisplayMode), hdr.prev_count, fp) == hdr.prev_count &&
+         hdr.checksum == (uint32_t)fnv1a64(fnv1a64(FNV1A64_INIT, cached, hdr.count * sizeof(DisplayMode)),
+                                           cached_prev, hdr.prev_count * sizeof(DisplayMode));
+    fclose(fp);
+    if (!ok) {
+        log_msg("Mode cache invalid / 模式缓存无效，忽略");
+        return 0;
+    }
+    if (hdr.key != mode_cache_key()) {
+        // 过期缓存里的模式表就是重刷前的模式表，留作换算旧 ID
+        prev_mode_count = hdr.count;
+        memcpy(prev_modes, cached, hdr.count * sizeof(DisplayMode));
+        log_msg("Mode cache stale (fingerprint/DTBO changed) / 模式缓存已过期");
+        return 0;
+    }
+
+    prev_mode_count = hdr.prev_count;
+    memcpy(prev_modes, cached_prev, hdr.prev_count * sizeof(DisplayMode));
+    mode_count = hdr.count;
+    memcpy(modes, cached, mode_count * sizeof(DisplayMode));
+    build_mode_index();
+    log_msg("Loaded %d display modes from cache / 从缓存加载 %d 个显示模式", mode_count, mode_count);
+    return 1;
+}
+
+// 用解析结果替换模式表 (按 ID 排序并重建索引)
+void install_modes(const SfDump *dump) {
+    mode_count = dump->mode_count;
+    memcpy(modes, dump->modes, mode_count * sizeof(DisplayMode));
+    
+    // 按 ID 排序 (冒泡排序)
+    for (int i = 0; i < mode_count - 1; i++) {
+        for (int j = 0; j < mode_count - i - 1; j++) {
+            if (modes[j].id > modes[j+1].id) {
+                DisplayMode temp = modes[j];
+                modes[j] = modes[j+1];
+                modes[j+1] = temp;
+            }
+        }
+    }
+
+    build_mode_index();
+}
+
+// 解析 dumpsys SurfaceFlinger 获取模式
+void init_display_modes() {
+    static SfDump dump;
+
+    // 直接读取 dumpsys SurfaceFlinger 输出，手动解析以提高兼容性
+    if (dump_surface_flinger(&dump) < 0) {
+        log_msg("Failed to run dumpsys SurfaceFlinger / 执行 dumpsys SurfaceFlinger 失败");
+        return;
+    }
+
+    install_modes(&dump);
+    log_msg("Loaded %d display modes (HWC) / 已加载 %d 个显示模式 (HWC):", mode_count, mode_count);
+    for(int i=0; i<mode_count; i++) {
+        log_msg("ID: %d, FPS: %d, Res: %dx%d", modes[i].id, modes[i].fps, modes[i].width, modes[i].height);
+    }
+}
+
+// 读取整个小文件 (配置文件)，结果以 '\0' 结尾，调用者负责 free；失败返回 NULL
+char *read_small_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+    size_t cap = 4096, n = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        n += fread(buf + n, 1, cap - n - 1, fp);
+        if (n < cap - 1) break;
+        char *bigger = realloc(buf, cap * 2);
+        if (!bigger) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = bigger;
+        cap *= 2;
+    }
+    fclose(fp);
+    if (buf) {
+        buf[n] = '\0';
+        *len = n;
+    }
+    return buf;
+}
+
+// 配置文件内容哈希，文件不存在时为 0
+uint64_t file_hash(const char *path) {
+    size_t len = 0;
+    char *buf = read_small_file(path, &len);
+    if (!buf) return 0;
+    uint64_t h = fnv1a64(FNV1A64_INIT, buf, len);
+    free(buf);
+    return h;
+}
+
+// daemon.conf 各参数的默认值 (与声明处的初始值一致)
+// 每次重新解析前先恢复，删除或注释掉的参数随之回到默认值，而不是保留上一次的设置
+void daemon_conf_defaults() {
+    ramp_step_ms = 50;
+    ramp_settle_ms = 50;
+    ramp_stride = 1;
+    ramp_max_steps = 0;
+    verify_switch = 1;
+    ramp_auto_tune = 1;
+    log_level = LOG_LEVEL_INFO;
+    log_max_kb = 512;
+    screen_poll_ms = 2000;
+    idle_fps = 0;
+    idle_timeout_ms = 3000;
+    content_sample_ms = 1000;
+    parse_thermal_caps("");
+    thermal_zone[0] = '\0';
+    thermal_poll_ms = 5000;
+    thermal_hysteresis = 2;
+    energy_sample_ms = 10000;
+    snprintf(cpu_affinity, sizeof(cpu_affinity), "%s", "little");
+    sched_idle = 1;
+    sched_nice = 10;
+    ramp_boost = 1;
+    cgroup_dirs[0] = '\0';
+    cpu_budget_pct = 0;
+}
+
+// 读取守护进程参数 config/daemon.conf (文件不存在时使用默认值)
+void load_daemon_conf(const char* base_path) {
+    char conf_path[512];
+    snprintf(conf_path, sizeof(conf_path), "%s/config/daemon.conf", base_path);
+
+    uint64_t h = file_hash(conf_path);
+    if (h == daemon_conf_hash) return;
+    daemon_conf_hash = h;
+    daemon_conf_defaults();
+
+    FILE *fp = fopen(conf_path, "r");
+    char line[256];
+    while (fp && fgets(line, sizeof(line), fp) != NULL) {
+        char *trimmed = trim(line);
+        if (strlen(trimmed) == 0 || trimmed[0] == '#') continue;
+
+        char *eq = strchr(trimmed, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        char *key = trim(trimmed);
+        char *value = trim(eq + 1);
+
+        if (strcmp(key, "ramp_step_ms") == 0) {
+            ramp_step_ms = atoi(value);
+        } else if (strcmp(key, "ramp_settle_ms") == 0) {
+            ramp_settle_ms = atoi(value);
+        } else if (strcmp(key, "ramp_stride") == 0) {
+            ramp_stride = atoi(value);
+        } else if (strcmp(key, "ramp_max_steps") == 0) {
+            ramp_max_steps = atoi(value);
+        } else if (strcmp(key, "verify_switch") == 0) {
+            verify_switch = atoi(value);
+        } else if (strcmp(key, "ramp_auto_tune") == 0) {
+            ramp_auto_tune = atoi(value);
+        } else if (strcmp(key, "log_level") == 0) {
+            if (strcmp(value, "debug") == 0) log_level = LOG_LEVEL_DEBUG;
+            else if (strcmp(value, "warn") == 0) log_level = LOG_LEVEL_WARN;
+            else if (strcmp(value, "error") == 0) log_level = LOG_LEVEL_ERROR;
+            else log_level = LOG_LEVEL_INFO;
+        } else if (strcmp(key, "log_max_kb") == 0) {
+            log_max_kb = atoi(value);
+        } else if (strcmp(key, "screen_poll_ms") == 0) {
+            screen_poll_ms = atoi(value);
+        } else if (strcmp(key, "idle_fps") == 0) {
+            idle_fps = atoi(value);
+        } else if (strcmp(key, "idle_timeout_ms") == 0) {
+            idle_timeout_ms = atoi(value);
+        } else if (strcmp(key, "content_sample_ms") == 0) {
+            content_sample_ms = atoi(value);
+        } else if (strcmp(key, "thermal_caps") == 0) {
+            parse_thermal_caps(value);
+        } else if (strcmp(key, "thermal_zone") == 0) {
+            strncpy(thermal_zone, value, sizeof(thermal_zone) - 1);
+            thermal_zone[sizeof(thermal_zone) - 1] = '\0';
+        } else if (strcmp(key, "thermal_poll_ms") == 0) {
+            thermal_poll_ms = atoi(value);
+        } else if (strcmp(key, "thermal_hysteresis") == 0) {
+            thermal_hysteresis = atoi(value);
+        } else if (strcmp(key, "energy_sample_ms") == 0) {
+            energy_sample_ms = atoi(value);
+        } else if (strcmp(key, "cpu_affinity") == 0) {
+            strncpy(cpu_affinity, value, sizeof(cpu_affinity) - 1);
+            cpu_affinity[sizeof(cpu_affinity) - 1] = '\0';
+        } else if (strcmp(key, "sched_idle") == 0) {
+            sched_idle = atoi(value);
+        } else if (strcmp(key, "nice") == 0) {
+            sched_nice = atoi(value);
+        } else if (strcmp(key, "ramp_boost") == 0) {
+            ramp_boost = atoi(value);
+        } else if (strcmp(key, "cgroup") == 0) {
+            strncpy(cgroup_dirs, value, sizeof(cgroup_dirs) - 1);
+            cgroup_dirs[sizeof(cgroup_dirs) - 1] = '\0';
+        } else if (strcmp(key, "cpu_budget_pct") == 0) {
+            cpu_budget_pct = atof(value);
+        } else {
+            log_msg("Unknown daemon.conf key / 未知参数: %s", key);
+        }
+    }
+    if (fp) fclose(fp);
+
+    if (ramp_step_ms < 1) ramp_step_ms = 1;
+    if (ramp_settle_ms < 1) ramp_settle_ms = 1;
+    if (ramp_stride < 1) ramp_stride = 1;
+    if (ramp_max_steps < 0) ramp_max_steps = 0;
+    if (log_max_kb < 16) log_max_kb = 16;
+    if (screen_poll_ms < 200) screen_poll_ms = 200;
+    if (idle_fps < 0) idle_fps = 0;
+    if (idle_timeout_ms < 100) idle_timeout_ms = 100;
+    if (content_sample_ms < 250) content_sample_ms = 250;
+    if (thermal_poll_ms < 500) thermal_poll_ms = 500;
+    if (thermal_hysteresis < 0) thermal_hysteresis = 0;
+    if (energy_sample_ms < 0) energy_sample_ms = 0;
+    if (sched_nice < -20) sched_nice = -20;
+    if (sched_nice > 19) sched_nice = 19;
+    if (energy_sample_ms > 0 && energy_sample_ms < 1000) energy_sample_ms = 1000;
+    idle_timeout_cur_ms = idle_timeout_ms;
+    if (!ramp_auto_tune) ramp_step_tuned_ms = 0;
+    log_msg("Daemon conf / 守护参数: step=%dms settle=%dms stride=%d max_steps=%d verify=%d auto_tune=%d",
+        ramp_step_ms, ramp_settle_ms, ramp_stride, ramp_max_steps, verify_switch, ramp_auto_tune);
+}
+
+// 字符串哈希 (FNV-1a 32 位)
+uint32_t hash_str(const char *str) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+AppTable *app_table_new(int cap) {
+    AppTable *t = calloc(1, sizeof(AppTable));
+    if (!t) return NULL;
+    t->cap = cap;
+    t->slots = malloc(cap * sizeof(AppEntry));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    for (int i = 0; i < cap; i++) t->slots[i].name_off = -1;
+    return t;
+}
+
+void app_table_free(AppTable *t) {
+    if (!t) return;
+    free(t->slots);
+    free(t->names);
+    free(t->rules);
+    free(t);
+}
+
+// 查找包名对应的槽位 (命中或第一个空槽)
+AppEntry *app_table_slot(const AppTable *t, const char *pkg, uint32_t h) {
+    int mask = t->cap - 1;
+    for (int i = h & mask; ; i = (i + 1) & mask) {
+        AppEntry *e = &t->slots[i];
+        if (e->name_off < 0) return e;
+        if (e->hash == h && strcmp(t->names + e->name_off, pkg) == 0) return e;
+    }
+}
+
+// 查找包名的模式ID，未配置返回 -1
+int app_table_get(const AppTable *t, const char *pkg) {
+    if (!t) return -1;
+    AppEntry *e = app_table_slot(t, pkg, hash_str(pkg));
+    return e->name_off < 0 ? -1 : e->mode_id;
+}
+
+// 查找包名的配置项，未配置返回 NULL
+AppEntry *app_table_find(const AppTable *t, const char *pkg) {
+    if (!t) return NULL;
+    AppEntry *e = app_table_slot(t, pkg, hash_str(pkg));
+    return e->name_off < 0 ? NULL : e;
+}
+
+// 插入包名 (重复的包名保留第一条，与旧的线性查找行为一致)
+int app_table_put(AppTable *t, const char *pkg, int mode_id) {
+    if ((t->count + 1) * 4 > t->cap * 3) {
+        // 负载超过 3/4，扩容重新插入
+        AppEntry *old = t->slots;
+        int old_cap = t->cap;
+        AppEntry *slots = malloc(old_cap * 2 * sizeof(AppEntry));
+        if (!slots) return -1;
+        t->slots = slots;
+        t->cap = old_cap * 2;
+        for (int i = 0; i < t->cap; i++) t->slots[i].name_off = -1;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].name_off < 0) continue;
+            *app_table_slot(t, t->names + old[i].name_off, old[i].hash) = old[i];
+        }
+        free(old);
+    }
+
+    uint32_t h = hash_str(pkg);
+    AppEntry *e = app_table_slot(t, pkg, h);
+    if (e->name_off >= 0) return 0;
+
+    int len = strlen(pkg) + 1;
+    if (t->names_len + len > t->names_cap) {
+        int cap = t->names_cap ? t->names_cap * 2 : 4096;
+        while (cap < t->names_len + len) cap *= 2;
+        char *names = realloc(t->names, cap);
+        if (!names) return -1;
+        t->names = names;
+        t->names_cap = cap;
+    }
+    memcpy(t->names + t->names_len, pkg, len);
+    e->hash = h;
+    e->mode_id = mode_id;
+    e->flags = 0;
+    e->rule_off = 0;
+    e->rule_count = 0;
+    e->name_off = t->names_len;
+    t->names_len += len;
+    t->count++;
+    return 0;
+}
+
+// 设置包名的模式ID (已存在时原地修改，-1 表示回退到全局默认)
+int app_table_set(AppTable *t, const char *pkg, int mode_id) {
+    AppEntry *e = app_table_slot(t, pkg, hash_str(pkg));
+    if (e->name_off >= 0) {
+        e->mode_id = mode_id;
+        return 0;
+    }
+    if (mode_id == -1) return 0;
+    return app_table_put(t, pkg, mode_id);
+}
+
+// 条件谓词对应的位，相同的谓词共用一位；超过 MAX_RULE_PREDS 返回 -1
+int rule_pred_bit(AppTable *t, int type, int a, int b) {
+    for (int i = 0; i < t->pred_count; i++) {
+        if (t->preds[i].type == type && t->preds[i].a == a && t->preds[i].b == b) return i;
+    }
+    if (t->pred_count >= MAX_RULE_PREDS) return -1;
+    t->preds[t->pred_count].type = type;
+    t->preds[t->pred_count].a = a;
+    t->preds[t->pred_count].b = b;
+    return t->pred_count++;
+}
+
+int rule_add_cond(AppTable *t, Rule *r, int type, int a, int b, int value) {
+    int bit = rule_pred_bit(t, type, a, b);
+    if (bit < 0) return -1;
+    r->mask |= 1u << bit;
+    if (value) r->want |= 1u << bit;
+    else r->want &= ~(1u << bit);
+    return 0;
+}
+
+// 解析 if 之后的条件 (空格分隔，全部满足才命中)，前缀 ! 取反 (电量区间除外):
+// charging / discharging, battery<N, battery>=N, battery=LO-HI, time=HH:MM-HH:MM
+// 先全部解析到局部数组，整行有效后才登记谓词位，被拒绝的行不占用 MAX_RULE_PREDS 的名额
+typedef struct {
+    int type, a, b;
+    int value;                  // 命中时谓词应有的取值
+} RuleCond;
+
+int parse_rule_conds(AppTable *t, char *conds, Rule *r) {
+    RuleCond c[MAX_RULE_PREDS];
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(conds, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        // 电量区间占两个谓词，预留两格
+        if (n + 2 > MAX_RULE_PREDS) return -1;
+        int neg = tok[0] == '!';
+        if (neg) tok++;
+        int v, lo, hi, h1, m1, h2, m2, end = 0;
+        if (strcmp(tok, "charging") == 0) {
+            c[n++] = (RuleCond){ PRED_CHARGING, 0, 0, !neg };
+        } else if (strcmp(tok, "discharging") == 0) {
+            c[n++] = (RuleCond){ PRED_CHARGING, 0, 0, neg };
+        } else if (sscanf(tok, "battery<%d%n", &v, &end) == 1 && tok[end] == '\0') {
+            c[n++] = (RuleCond){ PRED_BATTERY_LT, v, 0, !neg };
+        } else if (sscanf(tok, "battery>=%d%n", &v, &end) == 1 && tok[end] == '\0') {
+            c[n++] = (RuleCond){ PRED_BATTERY_LT, v, 0, neg };
+        } else if (!neg && sscanf(tok, "battery=%d-%d%n", &lo, &hi, &end) == 2 && tok[end] == '\0' && lo <= hi) {
+            // LO <= 电量 <= HI 拆成两个谓词
+            c[n++] = (RuleCond){ PRED_BATTERY_LT, lo, 0, 0 };
+            c[n++] = (RuleCond){ PRED_BATTERY_LT, hi + 1, 0, 1 };
+        } else if (sscanf(tok, "time=%d:%d-%d:%d%n", &h1, &m1, &h2, &m2, &end) == 4 && tok[end] == '\0'
+                   && h1 >= 0 && h1 < 24 && h2 >= 0 && h2 <= 24 && m1 >= 0 && m1 < 60 && m2 >= 0 && m2 < 60) {
+            c[n++] = (RuleCond){ PRED_TIME, h1 * 60 + m1, h2 * 60 + m2, !neg };
+        } else {
+            return -1;
+        }
+    }
+    if (n == 0) return -1;
+
+    // 新谓词会超出上限时整行拒绝，不留下登记了一半的位
+    int fresh = 0;
+    for (int i = 0; i < n; i++) {
+        int known = 0;
+        for (int k = 0; k < t->pred_count && !known; k++) {
+            known = t->preds[k].type == c[i].type && t->preds[k].a == c[i].a && t->preds[k].b == c[i].b;
+        }
+        for (int k = 0; k < i && !known; k++) {
+            known = c[k].type == c[i].type && c[k].a == c[i].a && c[k].b == c[i].b;
+        }
+        if (!known) fresh++;
+    }
+    if (t->pred_count + fresh > MAX_RULE_PREDS) return -1;
+
+    r->mask = 0;
+    r->want = 0;
+    for (int i = 0; i < n; i++) {
+        if (rule_add_cond(t, r, c[i].type, c[i].a, c[i].b, c[i].value) < 0) return -1;
+    }
+    return 0;
+}
+
+// 规范化 activity 键: pkg/.Main 展开为 pkg/pkg.Main，与 dumpsys 的两种写法一致
+void normalize_focus_key(char *key, int size) {
+    char *slash = strchr(key, '/');
+    if (!slash || slash[1] != '.') return;
+    int plen = slash - key;
+    int rest = strlen(slash + 1);
+    if (plen * 2 + rest + 2 > size) return;
+    memmove(slash + 1 + plen, slash + 1, rest + 1);
+    memcpy(slash + 1, key, plen);
+}
+
+// 加载时暂存的条件规则，全部解析完再按键分段写入 rules[]
+typedef struct {
+    char key[MAX_PKG_LEN];
+    Rule rule;
+    int flags;
+} PendingRule;
+
+// 把暂存的规则按键分段排进 t->rules，同一个键内保持文件顺序
+int compile_rules(AppTable *t, const PendingRule *pending, int n) {
+    if (n <= 0) return 0;
+    // 只有条件规则的键普通映射为 -1；pkg/activity 规则同时登记包名，用于标记
+    char pkg[MAX_PKG_LEN];
+    for (int i = 0; i < n; i++) {
+        if (app_table_put(t, pending[i].key, -1) < 0) return -1;
+        const char *slash = strchr(pending[i].key, '/');
+        if (!slash) continue;
+        snprintf(pkg, sizeof(pkg), "%.*s", (int)(slash - pending[i].key), pending[i].key);
+        if (app_table_put(t, pkg, -1) < 0) return -1;
+    }
+    t->rules = malloc(n * sizeof(Rule));
+    if (!t->rules) return -1;
+
+    // 插入全部完成后槽位不再移动，先计数再分配每个键的区间
+    for (int i = 0; i < n; i++) app_table_find(t, pending[i].key)->rule_count++;
+    int off = 0;
+    for (int i = 0; i < t->cap; i++) {
+        AppEntry *e = &t->slots[i];
+        if (e->name_off < 0 || e->rule_count == 0) continue;
+        e->rule_off = off;
+        off += e->rule_count;
+        e->rule_count = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        AppEntry *e = app_table_find(t, pending[i].key);
+        t->rules[e->rule_off + e->rule_count++] = pending[i].rule;
+        e->flags |= pending[i].flags;
+        const char *slash = strchr(pending[i].key, '/');
+        if (!slash) continue;
+        snprintf(pkg, sizeof(pkg), "%.*s", (int)(slash - pending[i].key), pending[i].key);
+        app_table_find(t, pkg)->flags |= APP_FLAG_ACTIVITY;
+    }
+    t->rule_count = n;
+    return 0;
+}
+
+// 普通映射中的 pkg/activity 键：给包名打上 APP_FLAG_ACTIVITY，包名没有映射时登记为 -1
+// 放在所有行解析完之后，避免占位的 -1 挡住后面同一包名的普通映射 (重复键保留第一条)
+int mark_activity_pkgs(AppTable *t) {
+    char pkg[MAX_PKG_LEN];
+    // 按偏移遍历名字区，插入会追加名字并可能重新分配 t->names
+    for (int off = 0; off < t->names_len; off += strlen(t->names + off) + 1) {
+        const char *name = t->names + off;
+        const char *slash = strchr(name, '/');
+        if (!slash) continue;
+        snprintf(pkg, sizeof(pkg), "%.*s", (int)(slash - name), name);
+        if (app_table_put(t, pkg, -1) < 0) return -1;
+        app_table_find(t, pkg)->flags |= APP_FLAG_ACTIVITY;
+    }
+    return 0;
+}
+
+// 一个键的决策：按顺序匹配条件规则，都不命中时使用普通映射 (-1 表示未配置)
+int rule_entry_mode(const AppTable *t, const AppEntry *e, uint32_t env) {
+    if (!e) return -1;
+    const Rule *r = t->rules + e->rule_off;
+    for (int i = 0; i < e->rule_count; i++) {
+        if ((env & r[i].mask) == r[i].want) return r[i].mode_id;
+    }
+    return e->mode_id;
+}
+
+// 规则表决策：依次尝试 pkg/activity、pkg、*，返回 -1 表示使用全局默认
+// focus 为当前焦点窗口 (可为空)，只有包名带 APP_FLAG_ACTIVITY 时才会用到
+int rule_lookup(const AppTable *t, const char *pkg, const char *focus, uint32_t env) {
+    if (!t) return -1;
+    const AppEntry *e = app_table_find(t, pkg);
+    int mode_id = -1;
+    if (e && (e->flags & APP_FLAG_ACTIVITY) && focus && focus[0]) {
+        size_t len = strlen(pkg);
+        if (strncmp(focus, pkg, len) == 0 && focus[len] == '/') {
+            mode_id = rule_entry_mode(t, app_table_find(t, focus), env);
+        }
+    }
+    if (mode_id == -1) mode_id = rule_entry_mode(t, e, env);
+    if (mode_id == -1) mode_id = rule_entry_mode(t, app_table_find(t, "*"), env);
+    return mode_id;
+}
+
+// 解析模式键: 纯数字为 HWC 模式ID，WxH@fps 按当前模式表就近匹配
+// DTBO 增删 timing 节点后 ID 会变化，分辨率 + 帧率的写法在重刷后仍指向同一档位
+// 就近规则: 像素数最接近的分辨率优先，同分辨率内取帧率最接近的 (距离相同取较低的)
+// 返回模式ID，无法解析或没有模式时返回 -1；*exact 为 0 表示是就近匹配的结果
+int resolve_mode_key(const char *key, int *exact) {
+    *exact = 1;
+    char *end;
+    long id = strtol(key, &end, 10);
+    if (end != key && *end == '\0') return is_valid_mode((int)id) ? (int)id : -1;
+
+    int w, h, fps, n = 0;
+    if (sscanf(key, "%dx%d@%d%n", &w, &h, &fps, &n) != 3 || key[n] != '\0') return -1;
+    int best = -1;
+    long long best_cost = 0;
+    for (int i = 0; i < mode_count; i++) {
+        long long area_diff = llabs((long long)modes[i].width * modes[i].height - (long long)w * h);
+        long long cost = area_diff * 4096 + abs(modes[i].fps - fps) * 2 + (modes[i].fps > fps);
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    if (best < 0) return -1;
+    *exact = modes[best].width == w && modes[best].height == h && modes[best].fps == fps;
+    return modes[best].id;
+}
+
+// mode.txt 中的数字 ID 在当前模式表里不存在时 (DTBO 重刷后编号变化)，
+// 按上一份模式表查出它原来的分辨率和帧率，再就近匹配到当前模式；查不到返回 -1
+int resolve_stale_mode_id(const char *key) {
+    char *end;
+    long id = strtol(key, &end, 10);
+    if (end == key || *end != '\0') return -1;
+    for (int i = 0; i < prev_mode_count; i++) {
+        if (prev_modes[i].id != id) continue;
+        char wxh[32];
+        int exact;
+        snprintf(wxh, sizeof(wxh), "%dx%d@%d", prev_modes[i].width, prev_modes[i].height, prev_modes[i].fps);
+        int mid = resolve_mode_key(wxh, &exact);
+        if (mid != -1) {
+            log_msg("Stale mode ID / 模式ID已失效: %ld (was %s) -> %d (%dHz)", id, wxh, mid, get_mode_fps(mid));
+        }
+        return mid;
+    }
+    return -1;
+}
+
+// 模式ID 写回配置时使用的键: WxH@fps，同一键对应多个模式时只能写 ID
+const char *mode_key_of(int id, char *buf, int size) {
+    const DisplayMode *m = NULL;
+    int same = 0;
+    for (int i = 0; i < mode_count; i++) {
+        if (modes[i].id == id) m = &modes[i];
+    }
+    for (int i = 0; m && i < mode_count; i++) {
+        if (modes[i].width == m->width && modes[i].height == m->height && modes[i].fps == m->fps) same++;
+    }
+    if (m && same == 1) snprintf(buf, size, "%dx%d@%d", m->width, m->height, m->fps);
+    else snprintf(buf, size, "%d", id);
+    return buf;
+}
+
+// 把 mode.txt 内容解析成新的应用表 (条件规则已编译)，内存不足返回 NULL
+AppTable *parse_mode_config(char *content, size_t len, ConfigParse *res) {
+    memset(res, 0, sizeof(*res));
+    res->default_id = default_mode_id;
+
+    FILE *fp = fmemopen(content, len ? len : 1, "r");
+    AppTable *table = app_table_new(64);
+    if (!fp || !table) {
+        if (fp) fclose(fp);
+        app_table_free(table);
+        return NULL;
+    }
+
+    char line[256];
+    PendingRule *pending = NULL;
+    int pending_count = 0;
+    int pending_cap = 0;
+
+    while (len && fgets(line, sizeof(line), fp) != NULL) {
+        char *trimmed = trim(line);
+        if (strlen(trimmed) == 0 || trimmed[0] == '#') continue;
+
+        res->line_num++;
+        if (res->line_num == 1) {
+            // 第一行：全局默认ID (或 WxH@fps)
+            int exact;
+            snprintf(res->default_key, sizeof(res->default_key), "%s", trimmed);
+            res->default_id = resolve_mode_key(trimmed, &exact);
+            if (res->default_id == -1) {
+                res->default_id = resolve_stale_mode_id(trimmed);
+                exact = 1;
+                if (res->default_id != -1) res->nearest_keys++;
+            }
+            res->default_ok = res->default_id != -1;
+            if (res->default_ok && !exact) {
+                res->nearest_keys++;
+                log_msg("Mode key %s -> nearest / 就近匹配 %d (%dHz)", trimmed, res->default_id, get_mode_fps(res->default_id));
+            }
+        } else {
+            // 后续行：包名 模式ID [content] [if 条件...]
+            // 支持 pkg=id 或 pkg id 格式
+            char *cond = strstr(trimmed, " if ");
+            if (cond) {
+                *cond = '\0';
+                cond += 4;
+            }
+            char *eq = strchr(trimmed, '=');
+            if (eq) *eq = ' '; // 将等号替换为空格以便 sscanf 解析
+
+            char pkg[MAX_PKG_LEN];
+            char key[32];
+            int rest = 0;
+            int exact;
+            if (sscanf(trimmed, "%127s %31s%n", pkg, key, &rest) != 2) {
+                res->bad_lines++;
+                continue;
+            }
+            int mid = resolve_mode_key(key, &exact);
+            if (mid == -1) {
+                mid = resolve_stale_mode_id(key);
+                exact = 1;
+                if (mid != -1) res->nearest_keys++;
+            }
+            if (mid == -1) {
+                log_msg("Unknown mode key / 模式键不存在: %s (%s)", key, pkg);
+                res->bad_lines++;
+                continue;
+            }
+            if (!exact) {
+                res->nearest_keys++;
+                log_msg("Mode key %s (%s) -> nearest / 就近匹配 %d (%dHz)", key, pkg, mid, get_mode_fps(mid));
+            }
+            // 模式ID之后的关键字: content
+            int flags = strstr(trimmed + rest, "content") ? APP_FLAG_CONTENT : 0;
+            if (cond) {
+                if (pending_count == pending_cap) {
+                    int cap = pending_cap ? pending_cap * 2 : 16;
+                    PendingRule *p = realloc(pending, cap * sizeof(PendingRule));
+                    if (!p) {
+                        res->bad_lines++;
+                        continue;
+                    }
+                    pending = p;
+                    pending_cap = cap;
+                }
+                PendingRule *pr = &pending[pending_count];
+                if (parse_rule_conds(table, cond, &pr->rule) < 0) {
+                    res->bad_lines++;
+                    continue;
+                }
+                snprintf(pr->key, sizeof(pr->key), "%s", pkg);
+                normalize_focus_key(pr->key, sizeof(pr->key));
+                pr->rule.mode_id = mid;
+                pr->flags = flags;
+                pending_count++;
+            } else {
+                normalize_focus_key(pkg, sizeof(pkg));
+                app_table_put(table, pkg, mid);
+                AppEntry *e = app_table_find(table, pkg);
+                if (e) e->flags |= flags;
+            }
+        }
+    }
+    fclose(fp);
+    int rc = mark_activity_pkgs(table);
+    if (rc == 0) rc = compile_rules(table, pending, pending_count);
+    free(pending);
+    if (rc < 0) {
+        app_table_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+// 读取配置文件
+// 解析到新的哈希表中，校验通过后才替换当前表；内容与上次加载相同时跳过 (force 为 1 时总是重载)
+void load_config_file(const char* base_path, int force) {
+    load_daemon_conf(base_path);
+
+    char config_path[512];
+    snprintf(config_path, sizeof(config_path), "%s/config/mode.txt", base_path);
+    
+    size_t len = 0;
+    char *content = read_small_file(config_path, &len);
+    if (content == NULL) return;
+
+    uint64_t h = fnv1a64(FNV1A64_INIT, content, len);
+    if (!force && app_table && h == mode_txt_hash) {
+        reloads_unchanged++;
+        free(content);
+        return;
+    }
+    mode_txt_hash = h;
+
+    ConfigParse res;
+    AppTable *table = parse_mode_config(content, len, &res);
+    free(content);
+    if (!table) {
+        log_msg("Config: out of memory / 内存不足");
+        return;
+    }
+    int new_default = res.default_id;
+
+    // 空文件 (多半是写到一半) 或全局默认无效：保留当前配置
+    // 首次加载时没有可保留的配置，全局默认回退到第一个模式
+    if (res.line_num == 0 || (!res.default_ok && app_table)) {
+        reloads_rejected++;
+        if (res.line_num == 0) {
+            log_msg("Config rejected, keeping current / 配置无效，保留当前配置: empty");
+        } else {
+            log_msg("Config rejected, keeping current / 配置无效，保留当前配置: default mode %s not in mode table (%d modes)",
+                res.default_key, mode_count);
+        }
+        app_table_free(table);
+        return;
+    }
+    if (!res.default_ok) {
+        new_default = modes[0].id;
+        log_msg("Default mode %s not in mode table, using %d / 全局默认模式不存在，暂用 %d", res.default_key,
+            new_default, new_default);
+    }
+    if (res.bad_lines) log_msg("Config: skipped %d invalid lines / 跳过 %d 行无效配置", res.bad_lines, res.bad_lines);
+    if (res.nearest_keys) log_msg("Config: %d mode keys without exact match / %d 个模式键无精确匹配", res.nearest_keys, res.nearest_keys);
+    app_table_free(app_table);
+    app_table = table;
+    default_mode_id = new_default;
+    reloads_done++;
+    // 控制 socket 的修改可能还没写回文件，重新叠加上去
+    ctl_apply_pending();
+    log_msg("Config loaded / 配置已加载. Default: %d, Apps: %d, Rules: %d (%d conditions)",
+        default_mode_id, app_table->count, app_table->rule_count, app_table->pred_count);
+    ctl_notify("{\"event\":\"config\",\"default\":%d,\"apps\":%d}", default_mode_id, app_table->count);
+}
+
+void load_config(const char* base_path, int force) {
+    long long t0 = TRACE_BEGIN();
+    long long before = reloads_done;
+    uint64_t conf_before = daemon_conf_hash;
+    load_config_file(base_path, force);
+    if (record_fp) {
+        if (daemon_conf_hash != conf_before) record_snapshot('D', base_path, "daemon.conf");
+        if (reloads_done != before) record_snapshot('C', base_path, "mode.txt");
+    }
+    TRACE_END(t0, "config reload", "\"force\":%d,\"applied\":%d", force, reloads_done != before);
+}
+
+void smooth_switch(int target_id);
+void direct_switch(int target_id);
+
+// 读到系统当前模式后继续等待中的切换；-1 (读不到) 时直接切换初始化
+// 等待期间已有直接切换 (current_mode_id 已知) 时以那次为准
+int system_mode_target = -1;
+
+void system_mode_done(int actual) {
+    record_event('A', "%d", actual);
+    int target_id = system_mode_target;
+    system_mode_target = -1;
+    if (target_id == -1 || current_mode_id != -1) return;
+    if (actual != -1) {
+        current_mode_id = actual;
+        log_msg("Initialized current mode from system / 从系统初始化当前模式: %d", current_mode_id);
+        smooth_switch(target_id);
+    } else {
+        // 获取失败，直接设置并假设成功
+        log_msg("First switch (unknown current) / 首次切换 (当前未知): -> %d", target_id);
+        direct_switch(target_id);
+    }
+}
+
+// dumpsys SurfaceFlinger 中 activeConfig=ID 即 HWC ID，与 modes[i].id 一致
+void on_system_mode_dump(DumpBuffer *buf, long len, long long start_us) {
+    (void)start_us;
+    const char *p = len > 0 ? strstr(buf->data, "activeConfig=") : NULL;
+    system_mode_done(p ? atoi(p + 13) : -1);
+}
+
+// 异步读取当前系统模式，读完后切换到 target_id (等待期间的新目标覆盖旧目标)
+// 回放时按录制顺序直接取结果
+void system_mode_query(int target_id) {
+    static DumpBuffer mode_buf;
+    char *const argv[] = { "dumpsys", "SurfaceFlinger", NULL };
+    system_mode_target = target_id;
+    if (replay_clock_us >= 0) {
+        system_mode_done(replay_active_mode());
+        return;
+    }
+    if (exec_running(on_system_mode_dump)) return;
+    if (exec_async(argv, &mode_buf, "activeConfig=", on_system_mode_dump) < 0) system_mode_done(-1);
+}
+
+// 直接切换到目标模式 (不走阶梯)
+void direct_switch(int target_id) {
+    system_mode_target = -1;
+    switch_request_us = event_time_us > 0 ? event_time_us : now_us();
+    set_surface_flinger(target_id);
+    ramp_step_us = now_us();
+    sync_android_settings(target_id);
+    current_mode_id = target_id;
+    ctl_notify("{\"event\":\"mode\",\"id\":%d,\"fps\":%d}", target_id, get_mode_fps(target_id));
+    verify_start(target_id, ramp_settle_ms);
+}
+
+// 平滑切换核心逻辑
+void smooth_switch(int target_id) {
+    // 上一次切换的校验不再有意义
+    verify_cancel();
+    switch_request_us = event_time_us > 0 ? event_time_us : now_us();
+
+    // 阶梯切换进行中：取消旧阶梯，从当前所在档位重新规划
+    int was_ramping = ramp_target != -1;
+    if (was_ramping) {
+        if (ramp_target == target_id) return;
+        log_msg("Retarget ramp / 阶梯重定向: %d -> %d (at %d)", ramp_target, target_id, current_mode_id);
+        ramp_cancel();
+        if (current_mode_id == target_id) {
+            sync_android_settings(target_id);
+            return;
+        }
+    }
+
+    if (current_mode_id == -1) {
+        // 首次启动，先读取当前系统状态，读到后在 system_mode_done 中继续
+        system_mode_query(target_id);
+        return;
+    }
+
+    if (current_mode_id == target_id) return;
+    
+    int current_width = get_mode_width(current_mode_id);
+    int target_width = get_mode_width(target_id);
+    
+    // 如果无法获取宽度（无效ID），直接切换
+    if (current_width == 0 || target_width == 0) {
+        log_msg("Invalid width / 无效宽度 (curr=%d, target=%d). Direct switch / 直接切换.", current_width, target_width);
+        direct_switch(target_id);
+        return;
+    }
+
+    if (current_width != target_width) {
+        log_msg("Resolution change / 分辨率变更: %d -> %d. Direct switch / 直接切换.", current_mode_id, target_id);
+        direct_switch(target_id);
+        return;
+    }
+
+    log_msg("Smooth Switch / 平滑切换: %d -> %d", current_mode_id, target_id);
+
+    // 同分辨率的模式在同一阶梯中，位置直接查表
+    const Ladder *ladder = get_mode_ladder(target_id);
+    const int *sorted_ids = ladder->ids;
+    int idx_curr = get_mode_rung(current_mode_id);
+    int idx_target = get_mode_rung(target_id);
+
+    if (idx_curr < 0 || idx_target < 0) {
+        log_msg("Mode not in ladder / 模式不在阶梯中 (curr=%d, target=%d). Direct switch / 直接切换.", current_mode_id, target_id);
+        direct_switch(target_id);
+        return;
+    }
+    
+    // 逐步切换：记录阶梯，由定时器逐级推进
+    // 每步跨越 ramp_stride 级；超过 ramp_max_steps 时加大步幅，保证切换总时长有上限
+    int dir = idx_target > idx_curr ? 1 : -1;
+    int distance = (idx_target - idx_curr) * dir;
+    int stride = ramp_stride;
+    if (ramp_max_steps > 0 && (distance + stride - 1) / stride > ramp_max_steps) {
+        stride = (distance + ramp_max_steps - 1) / ramp_max_steps;
+    }
+
+    ramp_len = 0;
+    for (int i = idx_curr + dir * stride; (idx_target - i) * dir > 0; i += dir * stride) {
+        ramp_ids[ramp_len++] = sorted_ids[i];
+    }
+    ramp_ids[ramp_len++] = target_id;
+
+    ramp_pos = 0;
+    ramp_target = target_id;
+    ramp_start_us = now_us();
+    ramp_step();
+}
+
+// 取消进行中的阶梯，停在当前已下发的档位
+void ramp_cancel() {
+    if (ramp_target == -1) return;
+    timer_arm(ramp_timer_fd, 0, 0);
+    ramp_target = -1;
+    ramp_len = 0;
+    ramp_pos = 0;
+}
+
+// 下发阶梯中的下一级，每级之间停留 ramp_step_ms，最后一级停留 ramp_settle_ms
+void ramp_step() {
+    if (ramp_target == -1) return;
+
+    if (ramp_pos < ramp_len) {
+        int id = ramp_ids[ramp_pos];
+        int up = get_mode_fps(id) > get_mode_fps(current_mode_id);
+        set_surface_flinger(id);
+        ramp_step_us = now_us();
+        log_debug(up ? "Step UP / 升频: %d" : "Step DOWN / 降频: %d", id);
+        current_mode_id = id;
+        ramp_pos++;
+        int step_ms = ramp_step_tuned_ms > ramp_step_ms ? ramp_step_tuned_ms : ramp_step_ms;
+        timer_arm(ramp_timer_fd, ramp_pos < ramp_len ? step_ms : ramp_settle_ms, 0);
+        return;
+    }
+
+    // 最后一级已稳定，同步系统设置
+    int target_id = ramp_target;
+    log_msg("Ramp done / 阶梯完成: %d in %lld ms (%d steps)", target_id,
+        (now_us() - ramp_start_us) / 1000, ramp_len);
+    log_msg("SurfaceFlinger calls / 切换调用: %lld, avg %lld us, max %lld us", sf_stats.count,
+        sf_stats.count ? sf_stats.total_us / sf_stats.count : 0, sf_stats.max_us);
+    ramp_target = -1;
+    current_mode_id = target_id;
+    sync_android_settings(target_id);
+    ctl_notify("{\"event\":\"mode\",\"id\":%d,\"fps\":%d}", target_id, get_mode_fps(target_id));
+    // 已经停留了 ramp_settle_ms，立即读回
+    verify_start(target_id, 0);
+}
+
+// 追加到可增长的缓冲区 (保持 '\0' 结尾)
+void buf_append(DumpBuffer *b, const char *fmt, ...) {
+    va_list ap;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t room = b->cap - b->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data ? b->data + b->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            b->len += n;
+            return;
+        }
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap - b->len <= (size_t)n) cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) return;
+        b->data = p;
+        b->cap = cap;
+    }
+}
+
+// 应用在统计表中的位置，表满后统一计入 "(other)"
+int stats_app_index(const char *pkg) {
+    for (int i = 0; i < stats_app_count; i++) {
+        if (strcmp(stats_apps[i].pkg, pkg) == 0) return i;
+    }
+    if (stats_app_count >= STATS_MAX_APPS - 1) pkg = "(other)";
+    for (int i = 0; i < stats_app_count; i++) {
+        if (strcmp(stats_apps[i].pkg, pkg) == 0) return i;
+    }
+    StatsApp *a = &stats_apps[stats_app_count];
+    memset(a, 0, sizeof(*a));
+    snprintf(a->pkg, sizeof(a->pkg), "%s", pkg);
+    return stats_app_count++;
+}
+
+void stats_add(int app, int mode_id, long long us, long long uj) {
+    StatsApp *a = &stats_apps[app];
+    a->total_us += us;
+    a->total_uj += uj;
+    stats_mode_us[mode_id] += us;
+    stats_mode_uj[mode_id] += uj;
+    for (int i = 0; i < a->slot_count; i++) {
+        if (a->slots[i].mode_id == mode_id) {
+            a->slots[i].us += us;
+            a->slots[i].uj += uj;
+            return;
+        }
+    }
+    if (a->slot_count < STATS_APP_MODES) {
+        a->slots[a->slot_count].mode_id = mode_id;
+        a->slots[a->slot_count].us = us;
+        a->slots[a->slot_count].uj = uj;
+        a->slot_count++;
+    }
+}
+
+// 每轮事件循环结束时调用：把上次记账以来的时间计入当时的应用和模式，再记下当前状态
+void stats_account() {
+    long long now = now_us();
+    if (stats_last_us > 0) {
+        long long d = now - stats_last_us;
+        if (stats_prev_off) {
+            stats_screen_off_us += d;
+        } else if (stats_prev_app >= 0 && stats_prev_mode >= 0 && stats_prev_mode < MAX_MODE_ID) {
+            // µW × µs / 10^6 = µJ
+            long long uj = energy_power_uw > 0 ? energy_power_uw * d / 1000000 : 0;
+            if (energy_power_uw < 0 && energy_active) {
+                if (energy_charging) energy_charging_us += d;
+                else energy_unknown_us += d;
+            }
+            stats_add(stats_prev_app, stats_prev_mode, d, uj);
+            stats_dirty = 1;
+        }
+    }
+    stats_last_us = now;
+    stats_prev_off = screen_state == SCREEN_OFF;
+    stats_prev_mode = current_mode_id;
+    if (last_pkg[0] && (stats_prev_app < 0 || strcmp(stats_apps[stats_prev_app].pkg, last_pkg) != 0)) {
+        stats_prev_app = stats_app_index(last_pkg);
+    }
+}
+
+// 记录一次切换从发起到确认生效的耗时
+void stats_record_switch(long long now) {
+    if (switch_request_us <= 0) return;
+    trace_span(TRACE_TID_SWITCH, "switch", switch_request_us, now, "\"mode\":%d", current_mode_id);
+    long long ms = (now - switch_request_us) / 1000;
+    int b = 0;
+    while (ms > 0 && b < STATS_HIST_BUCKETS - 1) {
+        ms >>= 1;
+        b++;
+    }
+    stats_hist[b]++;
+    stats_switches++;
+    stats_dirty = 1;
+    switch_request_us = 0;
+}
+
+void stats_path(char *path, int size, const char *base) {
+    snprintf(path, size, "%s/stats.bin", base);
+}
+
+// 写入 stats.bin: 文件头 + 切换耗时直方图 + 每个应用 (名称长度, 名称, 模式数, {模式ID, 微秒, 微焦}...)
+void stats_save() {
+    if (!stats_dirty || !module_path) return;
+    char path[512], tmp[520];
+    stats_path(path, sizeof(path), module_path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    StatsFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = STATS_MAGIC;
+    hdr.version = STATS_VERSION;
+    hdr.app_count = stats_app_count;
+    hdr.hist_buckets = STATS_HIST_BUCKETS;
+    hdr.since = stats_since;
+    hdr.switches = stats_switches;
+    hdr.screen_off_us = stats_screen_off_us;
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(stats_hist, sizeof(stats_hist), 1, fp) == 1;
+    for (int i = 0; ok && i < stats_app_count; i++) {
+        const StatsApp *a = &stats_apps[i];
+        uint8_t name_len = strlen(a->pkg);
+        uint8_t n = a->slot_count;
+        ok = fwrite(&name_len, 1, 1, fp) == 1 && fwrite(a->pkg, 1, name_len, fp) == name_len &&
+             fwrite(&n, 1, 1, fp) == 1;
+        for (int k = 0; ok && k < n; k++) {
+            int32_t id = a->slots[k].mode_id;
+            int64_t us = a->slots[k].us;
+            int64_t uj = a->slots[k].uj;
+            ok = fwrite(&id, sizeof(id), 1, fp) == 1 && fwrite(&us, sizeof(us), 1, fp) == 1 &&
+                 fwrite(&uj, sizeof(uj), 1, fp) == 1;
+        }
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(tmp, path) == 0) {
+        stats_dirty = 0;
+    } else {
+        unlink(tmp);
+    }
+}
+
+// 读回 stats.bin 继续累计，文件不存在或损坏时从零开始
+int stats_load(const char *base) {
+    char path[512];
+    stats_path(path, sizeof(path), base);
+    stats_app_count = 0;
+    memset(stats_mode_us, 0, sizeof(stats_mode_us));
+    memset(stats_mode_uj, 0, sizeof(stats_mode_uj));
+    memset(stats_hist, 0, sizeof(stats_hist));
+    stats_switches = 0;
+    stats_screen_off_us = 0;
+    stats_since = time(NULL);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    StatsFileHeader hdr;
+    // 版本 1 没有能耗字段，按 0 读入
+    int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 && hdr.magic == STATS_MAGIC &&
+             (hdr.version == 1 || hdr.version == STATS_VERSION) && hdr.hist_buckets == STATS_HIST_BUCKETS &&
+             hdr.app_count <= STATS_MAX_APPS && fread(stats_hist, sizeof(stats_hist), 1, fp) == 1;
+    for (uint32_t i = 0; ok && i < hdr.app_count; i++) {
+        StatsApp *a = &stats_apps[i];
+        memset(a, 0, sizeof(*a));
+        uint8_t name_len, n;
+        ok = fread(&name_len, 1, 1, fp) == 1 && name_len < MAX_PKG_LEN &&
+             fread(a->pkg, 1, name_len, fp) == name_len && fread(&n, 1, 1, fp) == 1 && n <= STATS_APP_MODES;
+        for (int k = 0; ok && k < n; k++) {
+            int32_t id;
+            int64_t us, uj = 0;
+            ok = fread(&id, sizeof(id), 1, fp) == 1 && fread(&us, sizeof(us), 1, fp) == 1 &&
+                 (hdr.version == 1 || fread(&uj, sizeof(uj), 1, fp) == 1) && id >= 0 && id < MAX_MODE_ID;
+            if (!ok) break;
+            a->slots[k].mode_id = id;
+            a->slots[k].us = us;
+            a->slots[k].uj = uj;
+            a->total_us += us;
+            a->total_uj += uj;
+            stats_mode_us[id] += us;
+            stats_mode_uj[id] += uj;
+        }
+        a->slot_count = n;
+    }
+    fclose(fp);
+    if (!ok) {
+        log_msg("Stats file invalid, starting over / 统计文件无效，重新开始: %s", path);
+        stats_app_count = 0;
+        memset(stats_mode_us, 0, sizeof(stats_mode_us));
+        memset(stats_mode_uj, 0, sizeof(stats_mode_uj));
+        memset(stats_hist, 0, sizeof(stats_hist));
+        return 0;
+    }
+    stats_app_count = hdr.app_count;
+    // 满表的最后一格必须是 "(other)"，否则之后的新应用没有位置可以计入，改名后原来的时间并入其中
+    if (stats_app_count == STATS_MAX_APPS && strcmp(stats_apps[STATS_MAX_APPS - 1].pkg, "(other)") != 0) {
+        snprintf(stats_apps[STATS_MAX_APPS - 1].pkg, sizeof(stats_apps[0].pkg), "%s", "(other)");
+    }
+    stats_since = hdr.since;
+    stats_switches = hdr.switches;
+    stats_screen_off_us = hdr.screen_off_us;
+    return 1;
+}
+
+// 统计导出为 JSON (时长为毫秒)，ctl get-stats 和 rate_daemon stats 共用
+void stats_json(DumpBuffer *out) {
+    out->len = 0;
+    buf_append(out, "{\"ok\":true,\"since\":%lld,\"switches\":%lld,\"screen_off_ms\":%lld,"
+        "\"charging_ms\":%lld,\"power_unknown_ms\":%lld,\"power_mw\":%lld,\"energy_samples\":%lld,\"modes\":[",
+        stats_since, stats_switches, stats_screen_off_us / 1000, energy_charging_us / 1000, energy_unknown_us / 1000,
+        energy_power_uw > 0 ? energy_power_uw / 1000 : -1, energy_samples);
+    int first = 1;
+    for (int id = 0; id < MAX_MODE_ID; id++) {
+        if (stats_mode_us[id] == 0) continue;
+        buf_append(out, "%s{\"id\":%d,\"fps\":%d,\"ms\":%lld,\"mj\":%lld}", first ? "" : ",",
+            id, get_mode_fps(id), stats_mode_us[id] / 1000, stats_mode_uj[id] / 1000);
+        first = 0;
+    }
+    buf_append(out, "],\"apps\":[");
+    for (int i = 0; i < stats_app_count; i++) {
+        const StatsApp *a = &stats_apps[i];
+        buf_append(out, "%s{\"package\":\"%s\",\"ms\":%lld,\"mj\":%lld,\"modes\":[", i ? "," : "",
+            a->pkg, a->total_us / 1000, a->total_uj / 1000);
+        for (int k = 0; k < a->slot_count; k++) {
+            buf_append(out, "%s{\"id\":%d,\"ms\":%lld,\"mj\":%lld}", k ? "," : "",
+                a->slots[k].mode_id, a->slots[k].us / 1000, a->slots[k].uj / 1000);
+        }
+        buf_append(out, "]}");
+    }
+    buf_append(out, "],\"switch_latency_ms\":[");
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        if (b == STATS_HIST_BUCKETS - 1) {
+            buf_append(out, ",{\"ge\":%d,\"count\":%lld}", 1 << (b - 1), stats_hist[b]);
+        } else {
+            buf_append(out, "%s{\"lt\":%d,\"count\":%lld}", b ? "," : "", 1 << b, stats_hist[b]);
+        }
+    }
+    buf_append(out, "]}");
+}
+
+
+void verify_probe_done(int actual, long long probe_us);
+
+// 读回的输出：读到 activeConfig 一行 (或 dumpsys 结束) 后解析并判断
+void on_verify_dump(DumpBuffer *buf, long len, long long probe_us) {
+    int active = -1;
+    const char *p = len > 0 ? strstr(buf->data, "activeConfig=") : NULL;
+    if (p) active = atoi(p + 13);
+    trace_span(TRACE_TID_VERIFY, "verify read-back", probe_us, now_us(), "\"active\":%d", active);
+    verify_probe_done(active, probe_us);
+}
+
+// 未生效时的读回间隔：按稳定耗时均值，每个稳定周期最多读回一次
+int verify_poll_ms() {
+    int ms = (int)(settle_ewma_us / 1000);
+    if (ms < ramp_settle_ms) ms = ramp_settle_ms;
+    if (ms < VERIFY_POLL_MS) ms = VERIFY_POLL_MS;
+    return ms;
+}
+
+void verify_cancel() {
+    exec_cancel(on_verify_dump);
+    if (verify_target == -1) return;
+    verify_target = -1;
+    timer_arm(verify_timer_fd, 0, 0);
+}
+
+// 开始校验最近一次下发 (ramp_step_us) 的目标模式，delay_ms 后第一次读回
+void verify_start(int target_id, int delay_ms) {
+    verify_cancel();
+    if (!verify_switch || verify_timer_fd < 0) {
+        // 不校验时以最后一级下发完成为准
+        stats_record_switch(now_us());
+        return;
+    }
+    verify_target = target_id;
+    verify_first_probe = 1;
+    verify_retries_left = VERIFY_MAX_RETRIES;
+    verify_issued_us = ramp_step_us;
+    if (delay_ms > 0) timer_arm(verify_timer_fd, delay_ms, 0);
+    else verify_check();
+}
+
+// 记录稳定耗时；第一次读回就已生效时真实耗时只知道上限，按 ramp_step_ms 计入均值
+// 这样均值只会被确实偏慢的切换拉高，阶梯间隔随之加大，恢复正常后逐渐回落
+void verify_settled(long long probe_us) {
+    long long settle_us = probe_us - verify_issued_us;
+    trace_span(TRACE_TID_VERIFY, "verify", verify_issued_us, probe_us, "\"target\":%d,\"retries\":%d",
+        verify_target, VERIFY_MAX_RETRIES - verify_retries_left);
+    stats_record_switch(probe_us);
+    verify_ok++;
+    settle_last_us = settle_us;
+    if (settle_us > settle_max_us) settle_max_us = settle_us;
+    long long sample = verify_first_probe ? ramp_step_ms * 1000LL : settle_us;
+    settle_ewma_us = settle_ewma_us ? (settle_ewma_us * 3 + sample) / 4 : sample;
+    log_debug("Switch verified / 切换已确认: %d, settle %lld us", verify_target, settle_us);
+
+    if (!ramp_auto_tune) return;
+    int tuned = (int)(settle_ewma_us / 1000);
+    if (tuned < ramp_step_ms) tuned = ramp_step_ms;
+    if (tuned > RAMP_STEP_MAX_MS) tuned = RAMP_STEP_MAX_MS;
+    if (tuned != (ramp_step_tuned_ms ? ramp_step_tuned_ms : ramp_step_ms)) {
+        log_msg("Ramp step tuned / 阶梯间隔调整: %d ms (settle avg %lld us)", tuned, settle_ewma_us);
+        ramp_step_tuned_ms = tuned;
+    }
+}
+
+// 异步读回 SurfaceFlinger 当前模式 (上一次还没结束时不重复发起)，结果在 verify_probe_done 中处理
+void verify_check() {
+    char *const argv[] = { "dumpsys", "SurfaceFlinger", NULL };
+    if (verify_target == -1 || exec_running(on_verify_dump)) return;
+    if (exec_async(argv, &verify_buf, "activeConfig=", on_verify_dump) < 0) verify_probe_done(-1, now_us());
+}
+
+// 比较读回结果：未生效时继续等待，超时重发，重试用尽后以系统为准
+void verify_probe_done(int actual, long long probe_us) {
+    if (verify_target == -1) return;
+    if (actual == -1) {
+        // 读不到 activeConfig (系统版本不支持)，无法校验
+        log_debug("Switch verify unavailable / 无法读回当前模式");
+        stats_record_switch(probe_us);
+        verify_target = -1;
+        return;
+    }
+    if (actual == verify_target) {
+        verify_settled(probe_us);
+        verify_target = -1;
+        return;
+    }
+    verify_first_probe = 0;
+    // 切换调用还在常驻 shell 中排队时继续等待 (shell 卡住时由其超时让调用失败)
+    if (probe_us - verify_issued_us < VERIFY_TIMEOUT_MS * 1000LL || sf_calls_pending > 0) {
+        timer_arm(verify_timer_fd, verify_poll_ms(), 0);
+        return;
+    }
+    if (verify_retries_left > 0) {
+        verify_retries_left--;
+        verify_retries++;
+        log_msg("Switch not applied, retrying / 切换未生效，重试: want %d, active %d", verify_target, actual);
+        set_surface_flinger(verify_target);
+        ramp_step_us = now_us();
+        verify_issued_us = ramp_step_us;
+        timer_arm(verify_timer_fd, verify_poll_ms(), 0);
+        return;
+    }
+
+    verify_resyncs++;
+    trace_span(TRACE_TID_VERIFY, "verify", verify_issued_us, probe_us, "\"target\":%d,\"rejected\":1,\"active\":%d",
+        verify_target, actual);
+    log_msg("Switch rejected, resync / 切换被拒绝，以系统为准: want %d, active %d", verify_target, actual);
+    verify_reject_id = verify_target;
+    verify_reject_until = probe_us + VERIFY_BACKOFF_MS * 1000LL;
+    verify_target = -1;
+    if (is_valid_mode(actual)) {
+        current_mode_id = actual;
+        sync_android_settings(actual);
+    } else {
+        current_mode_id = -1;
+    }
+    ctl_notify("{\"event\":\"verify\",\"rejected\":%d,\"active\":%d}", verify_reject_id, actual);
+}
+
+
+// 验证包名格式 - 必须包含点号、长度合理且只包含合法字符（字母、数字、点、下划线）
+int is_valid_package(const char *candidate) {
+    size_t candidate_len = strlen(candidate);
+    if (candidate_len < 3 || candidate_len >= MAX_PKG_LEN) return 0;
+
+    int has_dot = 0;
+    for (const char* p = candidate; *p; p++) {
+        if (*p == '.') has_dot = 1;
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '_') return 0;
+    }
+    return has_dot;
+}
+
+// 从 dumpsys window 输出中取前台应用 (使用用户提供的优化逻辑)，同时更新 fg_focus
+// 查找 mCurrentFocus 行在进程内完成，不再经过 sh 和 grep
+void parse_window_focus(const char *data, char *buffer, int size) {
+    char line[1024];
+    char* last_valid = NULL;
+    char focus[MAX_LAYER_NAME] = "";
+
+    const char *pos = data ? data : "";
+    while ((pos = strstr(pos, "mCurrentFocus")) != NULL) {
+        const char *eol = strchr(pos, '\n');
+        size_t line_len = eol ? (size_t)(eol - pos) : strlen(pos);
+        if (line_len > sizeof(line) - 1) line_len = sizeof(line) - 1;
+        memcpy(line, pos, line_len);
+        line[line_len] = '\0';
+        pos += line_len;
+        
+        char* start = strchr(line, '{');
+        char* end = strrchr(line, '}');  // 使用最后一个 } 作为结束点
+
+        if (start && end && end > start) {
+            // 提取 {} 之间的内容
+            size_t len = end - start - 1;
+            char inner[256];
+            if (len > 0 && len < sizeof(inner) - 1) {  // 预留null终止符空间
+                strncpy(inner, start + 1, len);
+                inner[len] = '\0';
+
+                // 提取最后一个空格后的内容
+                char* last_space = strrchr(inner, ' ');
+                char* candidate = last_space ? last_space + 1 : inner;
+
+                // 处理 PopupWindow: 前缀
+                char* popup_prefix = strstr(candidate, "PopupWindow:");
+                if (popup_prefix) {
+                    candidate = popup_prefix + 12;  // 跳过 "PopupWindow:"
+                }
+
+                // 处理斜杠后的 activity 名 (完整的 pkg/activity 留给 activity 规则)
+                char full[MAX_LAYER_NAME];
+                snprintf(full, sizeof(full), "%s", candidate);
+                char* slash = strchr(candidate, '/');
+                if (slash) *slash = '\0';
+
+                if (is_valid_package(candidate)) {
+                    snprintf(focus, sizeof(focus), "%s", slash ? full : "");
+                    // 安全地分配新内存
+                    char* new_valid = strdup(candidate);
+                    if (new_valid) {
+                        // 释放之前的内存
+                        if (last_valid) free(last_valid);
+                        last_valid = new_valid;
+                    }
+                }
+            }
+        }
+    }
+    normalize_focus_key(focus, sizeof(focus));
+    memcpy(fg_focus, focus, sizeof(fg_focus));
+
+    // 返回最后一个有效包名或 unknown
+    if (last_valid) {
+        strncpy(buffer, last_valid, size);
+        buffer[size - 1] = '\0';
+        free(last_valid);
+    } else {
+        strncpy(buffer, "unknown", size);
+        buffer[size - 1] = '\0';
+    }
+}
+
+// 获取前台应用 - dumpsys 后端，同步执行 (只在启动时确定初始前台应用，之后都走 window_dump_start)
+void get_foreground_app_dumpsys(char *buffer, int size) {
+    long long t0 = TRACE_BEGIN();
+    static DumpBuffer window_buf;
+    char *const argv[] = { "dumpsys", "window", NULL };
+    if (exec_read(argv, &window_buf, NULL) < 0) {
+        log_msg("get_foreground_app: exec failed / 执行 dumpsys 失败: %s", strerror(errno));
+        strncpy(buffer, "unknown", size);
+        buffer[size - 1] = '\0';
+        return;
+    }
+    parse_window_focus(window_buf.data, buffer, size);
+    TRACE_END(t0, "dumpsys window", "\"activity\":%d", fg_focus[0] != '\0');
+}
+
+void foreground_decide(const char *current_pkg);
+
+int window_dump_sets_pkg = 0;   // cgroup 后端判定不了前台应用，由这次 dumpsys 结果决定
+int window_focus_fresh = 0;     // 正在按刚读到的焦点窗口决策，不再查询
+
+// dumpsys window 读完：dumpsys 后端据此决策；cgroup 后端更新前台包名或焦点窗口 (activity 规则) 后重新决策
+void on_window_dump(DumpBuffer *buf, long len, long long start_us) {
+    (void)start_us;
+    char pkg[MAX_PKG_LEN] = "unknown";
+    if (len < 0) log_msg("get_foreground_app: exec failed / 执行 dumpsys 失败: %s", strerror(errno));
+    else parse_window_focus(buf->data, pkg, sizeof(pkg));
+    if (fg_backend == FG_BACKEND_DUMPSYS) {
+        foreground_decide(pkg);
+        return;
+    }
+    if (window_dump_sets_pkg) snprintf(fg_pkg, sizeof(fg_pkg), "%s", pkg);
+    window_dump_sets_pkg = 0;
+    window_focus_fresh = 1;
+    evaluate_foreground();
+    window_focus_fresh = 0;
+}
+
+// 异步执行 dumpsys window (已有一次在进行时合并)，结果在 on_window_dump 中处理
+void window_dump_start(int sets_pkg) {
+    static DumpBuffer window_buf;
+    char *const argv[] = { "dumpsys", "window", NULL };
+    if (sets_pkg) window_dump_sets_pkg = 1;
+    if (exec_running(on_window_dump)) return;
+    if (exec_async(argv, &window_buf, NULL, on_window_dump) < 0) on_window_dump(&window_buf, -1, 0);
+}
+
+// 通过 /proc/<pid>/cmdline 获取进程所属包名 (去掉 :remote 之类的进程后缀)
+int pid_to_package(int pid, char *buffer, int size) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/%d/cmdline", proc_root, pid);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    char cmdline[MAX_PKG_LEN + 64];
+    size_t n = fread(cmdline, 1, sizeof(cmdline) - 1, fp);
+    fclose(fp);
+    cmdline[n] = '\0'; // cmdline 以 NUL 分隔参数，只取第一个
+
+    char *colon = strchr(cmdline, ':');
+    if (colon) *colon = '\0';
+    if (!is_valid_package(cmdline)) return 0;
+
+    strncpy(buffer, cmdline, size);
+    buffer[size - 1] = '\0';
+    return 1;
+}
+
+// 读取 top-app cgroup 的 pid 列表
+int read_top_app_pids(int *pids, int max) {
+    FILE *fp = fopen(top_app_path, "r");
+    if (!fp) return -1;
+    int count = 0;
+    int pid;
+    while (count < max && fscanf(fp, "%d", &pid) == 1) {
+        pids[count++] = pid;
+    }
+    fclose(fp);
+    return count;
+}
+
+// top-app 变化时调用：新加入 top-app 的进程即为新的前台应用
+// 没有新进程时，若原前台应用仍在 top-app 中则保持不变，否则交给 dumpsys 判定 (异步，读完后重新决策)
+void update_foreground_from_cgroup() {
+    long long t0 = TRACE_BEGIN();
+    int pids[MAX_TOP_PIDS];
+    int count = read_top_app_pids(pids, MAX_TOP_PIDS);
+    if (count < 0) {
+        log_msg("Failed to read / 读取失败 %s: %s", top_app_path, strerror(errno));
+        window_dump_start(1);
+        TRACE_END(t0, "top-app", "\"fallback\":1");
+        return;
+    }
+
+    char new_pkg[MAX_PKG_LEN] = "";
+    int current_present = 0;
+    char pkg[MAX_PKG_LEN];
+
+    for (int i = 0; i < count; i++) {
+        int seen = 0;
+        for (int k = 0; k < fg_pid_count; k++) {
+            if (fg_pids[k] == pids[i]) { seen = 1; break; }
+        }
+        // 旧进程只需判断原前台应用是否还在，避免重复读取 cmdline
+        if (seen && current_present) continue;
+        if (!pid_to_package(pids[i], pkg, sizeof(pkg))) continue;
+
+        if (!seen && new_pkg[0] == '\0') {
+            strncpy(new_pkg, pkg, sizeof(new_pkg));
+        }
+        if (strcmp(pkg, fg_pkg) == 0) current_present = 1;
+    }
+
+    memcpy(fg_pids, pids, count * sizeof(int));
+    fg_pid_count = count;
+
+    if (new_pkg[0] != '\0') {
+        strncpy(fg_pkg, new_pkg, sizeof(fg_pkg));
+    } else if (!current_present) {
+        window_dump_start(1);
+    }
+    TRACE_END(t0, "top-app", "\"pids\":%d,\"fallback\":%d", count, new_pkg[0] == '\0' && !current_present);
+}
+
+// 选择前台检测后端，成功时返回 top-app 文件路径已就绪
+int init_foreground_cgroup() {
+    if (top_app_path[0] == '\0') {
+        for (int i = 0; top_app_candidates[i]; i++) {
+            if (access(top_app_candidates[i], R_OK) == 0) {
+                strncpy(top_app_path, top_app_candidates[i], sizeof(top_app_path) - 1);
+                break;
+            }
+        }
+    }
+    if (top_app_path[0] == '\0' || access(top_app_path, R_OK) != 0) {
+        log_msg("top-app cgroup not available / top-app cgroup 不可用, fallback to dumpsys / 回退到 dumpsys");
+        return 0;
+    }
+
+    // 先记录当前 pid 集合，初始前台应用由 dumpsys 确定
+    int count = read_top_app_pids(fg_pids, MAX_TOP_PIDS);
+    fg_pid_count = count > 0 ? count : 0;
+    get_foreground_app_dumpsys(fg_pkg, sizeof(fg_pkg));
+    return 1;
+}
+
+// 监听 top-app 文件本身，以及进程移入/移出 top-app 时会被写入的其它文件：
+// - 同目录的 tasks / cgroup.procs：部分机型按线程写 tasks，只监听 cgroup.procs 收不到事件
+// - 同级 foreground / background 的同名文件：应用退到后台时是写入目标 cgroup，top-app 文件本身不会触发事件
+// 只有 top-app 文件是必需的，其余不存在时跳过
+int watch_foreground_cgroup() {
+    fg_wd_count = 0;
+    int wd = inotify_add_watch(inotify_fd, top_app_path, IN_MODIFY);
+    if (wd < 0) {
+        log_msg("Error adding watch for / 添加监听失败 %s: %s", top_app_path, strerror(errno));
+        return -1;
+    }
+    fg_wds[fg_wd_count++] = wd;
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", top_app_path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) return 0;
+    *slash = '\0';
+    const char *base = slash + 1;
+    const char *other = strcmp(base, "tasks") == 0 ? "cgroup.procs" : "tasks";
+
+    char path[320];
+    char *parent_end = strrchr(dir, '/');
+    const char *siblings[] = { "foreground", "background" };
+    for (int i = -1; i < 2 && fg_wd_count < MAX_FG_WATCHES; i++) {
+        if (i < 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, other);
+        } else if (parent_end) {
+            snprintf(path, sizeof(path), "%.*s/%s/%s", (int)(parent_end - dir), dir, siblings[i], base);
+        } else {
+            break;
+        }
+        if (access(path, R_OK) != 0) continue;
+        wd = inotify_add_watch(inotify_fd, path, IN_MODIFY);
+        if (wd < 0) {
+            log_msg("Error adding watch for / 添加监听失败 %s: %s", path, strerror(errno));
+            continue;
+        }
+        fg_wds[fg_wd_count++] = wd;
+    }
+    return 0;
+}
+
+// 由 modes[] 重建模式索引：写入备用缓冲区，完成后切换指针
+void build_mode_index() {
+    ModeIndex *idx = mode_index == &mode_index_buf[0] ? &mode_index_buf[1] : &mode_index_buf[0];
+    memset(idx->by_id, -1, sizeof(idx->by_id));
+    memset(idx->ladder_of, -1, sizeof(idx->ladder_of));
+    memset(idx->rung, -1, sizeof(idx->rung));
+    idx->ladder_count = 0;
+
+    for (int i = 0; i < mode_count; i++) {
+        int id = modes[i].id;
+        if (id < 0 || id >= MAX_MODE_ID) {
+            log_msg("Mode id %d out of index range / 模式ID超出索引范围, ignored", id);
+            continue;
+        }
+        idx->by_id[id] = i;
+
+        // 找到 (或新建) 该分辨率的阶梯，按 FPS 插入 (稳定，FPS 相同时保持 ID 顺序)
+        int l = 0;
+        while (l < idx->ladder_count && idx->ladders[l].width != modes[i].width) l++;
+        if (l == idx->ladder_count) {
+            idx->ladders[l].width = modes[i].width;
+            idx->ladders[l].count = 0;
+            idx->ladder_count++;
+        }
+        Ladder *ladder = &idx->ladders[l];
+        int pos = ladder->count;
+        while (pos > 0 && modes[idx->by_id[ladder->ids[pos - 1]]].fps > modes[i].fps) {
+            ladder->ids[pos] = ladder->ids[pos - 1];
+            pos--;
+        }
+        ladder->ids[pos] = id;
+        ladder->count++;
+        idx->ladder_of[id] = l;
+    }
+
+    for (int l = 0; l < idx->ladder_count; l++) {
+        for (int r = 0; r < idx->ladders[l].count; r++) {
+            idx->rung[idx->ladders[l].ids[r]] = r;
+        }
+    }
+    mode_index = idx;
+}
+
+// 根据 ID 获取模式，不存在返回 NULL
+const DisplayMode *find_mode(int id) {
+    if (!mode_index || id < 0 || id >= MAX_MODE_ID || mode_index->by_id[id] < 0) return NULL;
+    return &modes[(int)mode_index->by_id[id]];
+}
+
+// 检查模式是否有效
+int is_valid_mode(int id) {
+    return find_mode(id) != NULL;
+}
+
+// 获取模式的宽度
+int get_mode_width(int id) {
+    const DisplayMode *m = find_mode(id);
+    return m ? m->width : 0;
+}
+
+// 获取模式的刷新率
+int get_mode_fps(int id) {
+    const DisplayMode *m = find_mode(id);
+    return m ? m->fps : 0;
+}
+
+// 获取模式所在的阶梯 (同分辨率按 FPS 升序)
+const Ladder *get_mode_ladder(int id) {
+    if (!find_mode(id)) return NULL;
+    return &mode_index->ladders[(int)mode_index->ladder_of[id]];
+}
+
+// 获取模式在阶梯中的位置，不存在返回 -1
+int get_mode_rung(int id) {
+    if (!find_mode(id)) return -1;
+    return mode_index->rung[id];
+}
+
+// 关闭常驻 shell (排队的命令直接丢弃，不回调)
+void helper_stop() {
+    if (helper_out >= 0) loop_del(helper_out);
+    if (helper_in >= 0) close(helper_in);
+    if (helper_out >= 0) close(helper_out);
+    helper_in = helper_out = -1;
+    shell_queue_len = 0;
+    timer_arm(helper_timer_fd, 0, 0);
+    if (helper_pid > 0) {
+        // 连同正在执行的子命令一起杀掉，超时的批量命令不会在之后继续写入
+        kill(-helper_pid, SIGKILL);
+        waitpid(helper_pid, NULL, 0);
+    }
+    helper_pid = -1;
+}
+
+void on_helper_output(int fd, uint32_t events);
+void on_helper_timer(int fd, uint32_t events);
+
+// 启动常驻 shell (stdin/stdout 通过管道连接到守护进程，完成标记由事件循环读取)
+int helper_start() {
+    if (helper_timer_fd < 0) {
+        helper_timer_fd = timer_create_fd();
+        if (helper_timer_fd < 0) return -1;
+        if (loop_add(helper_timer_fd, on_helper_timer) < 0) {
+            close(helper_timer_fd);
+            helper_timer_fd = -1;
+            return -1;
+        }
+    }
+    int in_pipe[2], out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) < 0) return -1;
+    if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+        close(in_pipe[0]); close(in_pipe[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(in_pipe[0]); close(in_pipe[1]);
+        close(out_pipe[0]); close(out_pipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // 子进程：恢复信号屏蔽，stdin/stdout 接到管道
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        setpgid(0, 0);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        const char *sh = access("/system/bin/sh", X_OK) == 0 ? "/system/bin/sh" : "/bin/sh";
+        execl(sh, "sh", (char *)NULL);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    helper_pid = pid;
+    helper_in = in_pipe[1];
+    helper_out = out_pipe[0];
+    helper_line_len = 0;
+    if (fcntl(helper_out, F_SETFL, O_NONBLOCK) < 0 || loop_add(helper_out, on_helper_output) < 0) {
+        helper_stop();
+        return -1;
+    }
+    log_msg("Shell helper started / 常驻 shell 已启动: pid %d", (int)pid);
+    return 0;
+}
+
+// 常驻 shell 超时或退出：杀掉 shell (连同正在执行的命令)，排队的命令全部按失败回调
+void helper_fail(const char *why) {
+    ShellCmd failed[SHELL_QUEUE_MAX];
+    int n = shell_queue_len;
+    for (int i = 0; i < n; i++) failed[i] = shell_queue[(shell_queue_head + i) % SHELL_QUEUE_MAX];
+    log_msg("Shell helper %s / 常驻 shell 异常, %d pending commands failed", why, n);
+    helper_stop();
+    for (int i = 0; i < n; i++) {
+        if (failed[i].done) failed[i].done(0, failed[i].start_us, failed[i].arg);
+    }
+}
+
+void on_helper_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    if (shell_queue_len > 0) helper_fail("timeout");
+}
+
+// 队首命令完成：出队，下一条开始计时
+void helper_complete() {
+    if (shell_queue_len == 0) return;
+    ShellCmd cmd = shell_queue[shell_queue_head];
+    shell_queue_head = (shell_queue_head + 1) % SHELL_QUEUE_MAX;
+    shell_queue_len--;
+    timer_arm(helper_timer_fd, shell_queue_len > 0 ? shell_queue[shell_queue_head].timeout_ms : 0, 0);
+    if (cmd.done) cmd.done(1, cmd.start_us, cmd.arg);
+}
+
+// 读取完成标记：每个内容为 OK 的行对应队首的一条命令，其余输出丢弃
+void on_helper_output(int fd, uint32_t events) {
+    (void)events;
+    pid_t pid = helper_pid;
+    char buf[256];
+    while (1) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            helper_fail("exited");
+            return;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                int ok = helper_line_len == 2 && memcmp(helper_line, "OK", 2) == 0;
+                helper_line_len = 0;
+                if (!ok) continue;
+                helper_complete();
+                // 回调里可能重启了 shell，旧管道不再读取
+                if (helper_pid != pid) return;
+            } else if (helper_line_len < (int)sizeof(helper_line)) {
+                helper_line[helper_line_len++] = buf[i];
+            }
+        }
+    }
+}
+
+// 把一条命令提交给常驻 shell，立即返回；结果在完成标记到达 (或超时) 时回调
+// 队列已满或 shell 无法启动时返回 -1，不回调
+int helper_submit(const char *command, int timeout_ms, shell_done_handler done, int arg) {
+    if (shell_queue_len >= SHELL_QUEUE_MAX) return -1;
+    if (helper_pid <= 0 && helper_start() < 0) return -1;
+
+    char cmd[1024];
+    // 批量命令用 ; 连接，整体加 { } 才能把每一条的输出都重定向，不混进完成标记所在的管道
+    int len = snprintf(cmd, sizeof(cmd), "{ %s; } >/dev/null 2>&1; echo OK\n", command);
+    if (len >= (int)sizeof(cmd)) return -1;
+    if (write(helper_in, cmd, len) != len) {
+        helper_fail("exited");
+        return -1;
+    }
+    ShellCmd *c = &shell_queue[(shell_queue_head + shell_queue_len) % SHELL_QUEUE_MAX];
+    c->done = done;
+    c->start_us = now_us();
+    c->timeout_ms = timeout_ms;
+    c->arg = arg;
+    shell_queue_len++;
+    if (shell_queue_len == 1) timer_arm(helper_timer_fd, timeout_ms, 0);
+    return 0;
+}
+
+// 执行 shell 命令 (输出丢弃)，结果通过 done 回调 (ok 为 0 表示超时或失败，可能只执行了一部分)：
+// shell 后端提交给常驻 shell 后立即返回，完成标记由事件循环读取；system 后端用 system() 同步执行后回调。
+// fallback 为 1 时常驻 shell 无法启动改用 system() 兜底 (下次调用会重新拉起 shell)
+void run_shell(const char *command, int timeout_ms, int fallback, shell_done_handler done, int arg) {
+    long long start = now_us();
+    if (sf_backend == SF_BACKEND_SHELL) {
+        if (helper_submit(command, timeout_ms, done, arg) == 0) return;
+        // 队列已满 (shell 卡住) 时不兜底，超时后整队失败
+        if (!fallback || helper_pid > 0) {
+            if (done) done(0, start, arg);
+            return;
+        }
+    }
+
+    char cmd[1100];
+    snprintf(cmd, sizeof(cmd), "{ %s; } > /dev/null 2>&1", command);
+    int ok = system(cmd) != -1;
+    if (done) done(ok, start, arg);
+}
+
+// SurfaceFlinger 调用完成：统计从提交到完成标记的耗时；失败时由读回校验发现未生效并重发
+void sf_call_done(int ok, long long start, int id) {
+    long long cost = now_us() - start;
+    if (sf_calls_pending > 0) sf_calls_pending--;
+    trace_span(TRACE_TID_EXEC, "set_surface_flinger", start, now_us(), "\"id\":%d,\"fps\":%d,\"ok\":%d",
+        id, get_mode_fps(id), ok);
+    if (!ok) {
+        log_msg("SurfaceFlinger call failed / 切换调用失败: %d", id);
+        return;
+    }
+    sf_stats.count++;
+    sf_stats.total_us += cost;
+    sf_stats.last_us = cost;
+    if (cost > sf_stats.max_us) sf_stats.max_us = cost;
+    // 下发时间以调用完成为准 (与同步调用时一致)，排队的时间不计入稳定耗时
+    if (sf_calls_pending == 0) ramp_step_us = now_us();
+    if (id == verify_target) verify_issued_us = now_us();
+}
+
+// 执行 SurfaceFlinger 调用
+void set_surface_flinger(int id) {
+    // 现在的 ID 直接来自 HWC (dumpsys SurfaceFlinger)，不需要 -1
+    // service call SurfaceFlinger 1035 i32 <HWC_ID>
+    sched_boost(1);
+    long long start = now_us();
+    trace_counter("refresh rate", "fps", get_mode_fps(id));
+
+    if (sf_backend == SF_BACKEND_FAKE) {
+        FILE *fp = fopen(sf_fake_path, "a");
+        if (fp) {
+            fprintf(fp, "%lld set_mode %d\n", start, id);
+            fclose(fp);
+        }
+        sf_call_done(1, start, id);
+    } else {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "service call SurfaceFlinger 1035 i32 %d", id);
+        sf_calls_pending++;
+        run_shell(cmd, SF_CALL_TIMEOUT_MS, 1, sf_call_done, id);
+    }
+}
+
+// 系统设置缓存失效，下次同步时全部重写 (设置可能被系统或用户改动)
+void settings_cache_reset() {
+    for (int i = 0; i < SETTINGS_COUNT; i++) settings_cache[i].value[0] = '\0';
+}
+
+// 一批设置的完成标记到达：本批的项确认写入；超时或失败时不用 system() 重跑 (shell 可能已写了一部分)，
+// 本批的项标记为未知，下次同步时重写
+void settings_batch_done(int ok, long long start, int batch) {
+    int written = 0;
+    for (int i = 0; i < SETTINGS_COUNT; i++) {
+        SettingEntry *e = &settings_cache[i];
+        // 已被更新的批次覆盖的项由那一批确认
+        if (!e->pending[0] || e->batch != batch) continue;
+        if (ok) snprintf(e->value, sizeof(e->value), "%s", e->pending);
+        else e->value[0] = '\0';
+        e->pending[0] = '\0';
+        written++;
+    }
+    int fps = settings_batch_fps[batch % SHELL_QUEUE_MAX];
+    trace_span(TRACE_TID_EXEC, "settings sync", start, now_us(), "\"fps\":%d,\"written\":%d,\"ok\":%d", fps, written, ok);
+    if (!ok) {
+        // 本批的项都已被后面的批次覆盖时由那一批报告
+        if (written > 0) log_msg("Settings sync to %dHz failed / 系统设置同步失败 (%d keys marked dirty)", fps, written);
+        return;
+    }
+    settings_written += written;
+    settings_batches++;
+    log_msg("Synced system settings to %dHz / 已同步系统设置到 %dHz (wrote %d, total written %lld, skipped %lld, batches %lld)",
+        fps, fps, written, settings_written, settings_skipped, settings_batches);
+}
+
+// 同步 Android 系统设置 (User Request)
+// 只写入与已确认 (或已提交) 的值不同的项，合并成一条命令交给常驻 shell (仍是每项一个 settings put 进程)；
+// 缓存在完成标记到达后才更新，见 settings_batch_done
+#define SETTINGS_PUT_TIMEOUT_MS 1000    // 每个 settings put 进程允许的时间
+
+void sync_android_settings(int id) {
+    int fps = get_mode_fps(id);
+    if (fps <= 0) return;
+
+    char fps_str[16];
+    snprintf(fps_str, sizeof(fps_str), "%d", fps);
+    const char *values[SETTINGS_COUNT] = {
+        "1", fps_str, fps_str, fps_str, fps_str, "true", "false"
+    };
+
+    char cmd[1024];
+    int len = 0;
+    int changed = 0;
+    int batch = ++settings_batch_seq;
+    for (int i = 0; i < SETTINGS_COUNT; i++) {
+        SettingEntry *e = &settings_cache[i];
+        if (strcmp(e->pending[0] ? e->pending : e->value, values[i]) == 0) {
+            settings_skipped++;
+            continue;
+        }
+        len += snprintf(cmd + len, sizeof(cmd) - len, "%ssettings put %s %s %s",
+            changed ? ";" : "", e->ns, e->key, values[i]);
+        snprintf(e->pending, sizeof(e->pending), "%s", values[i]);
+        e->batch = batch;
+        changed++;
+    }
+
+    if (changed == 0) {
+        log_msg("Settings already at %dHz / 系统设置无需更新", fps);
+        return;
+    }
+
+    settings_batch_fps[batch % SHELL_QUEUE_MAX] = fps;
+    if (sf_backend == SF_BACKEND_FAKE) {
+        long long start = now_us();
+        FILE *fp = fopen(sf_fake_path, "a");
+        if (fp) {
+            fprintf(fp, "%lld settings %s\n", start, cmd);
+            fclose(fp);
+        }
+        settings_batch_done(1, start, batch);
+    } else {
+        run_shell(cmd, SETTINGS_PUT_TIMEOUT_MS * changed, 0, settings_batch_done, batch);
+    }
+}
+
+// 单调时钟 (微秒)
+long long now_us() {
+    if (replay_clock_us >= 0) return replay_clock_us;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// 写一个追踪事件：head 为事件头 (未闭合的 JSON 对象)，args 为 args 对象的内容
+void trace_write(const char *head, const char *args) {
+    int n = fprintf(trace_fp, "%s%s,\"pid\":%d,\"args\":{%s}}", trace_events ? ",\n" : "", head, (int)getpid(), args);
+    trace_events++;
+    trace_pending = 1;
+    if (n > 0) trace_bytes += n;
+    if (trace_bytes > TRACE_MAX_BYTES) {
+        log_msg("Trace size limit reached, stopped / 追踪文件达到上限，已停止");
+        trace_close();
+    }
+}
+
+void trace_span(int tid, const char *name, long long start_us, long long end_us, const char *args_fmt, ...) {
+    if (!trace_fp || start_us <= 0) return;
+    char head[160], args[256];
+    snprintf(head, sizeof(head), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"tid\":%d",
+        name, start_us, end_us - start_us, tid);
+    va_list ap;
+    va_start(ap, args_fmt);
+    vsnprintf(args, sizeof(args), args_fmt, ap);
+    va_end(ap);
+    trace_write(head, args);
+}
+
+void trace_instant(const char *name, const char *args_fmt, ...) {
+    if (!trace_fp) return;
+    char head[160], args[256];
+    snprintf(head, sizeof(head), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"tid\":%d",
+        name, now_us(), TRACE_TID_MAIN);
+    va_list ap;
+    va_start(ap, args_fmt);
+    vsnprintf(args, sizeof(args), args_fmt, ap);
+    va_end(ap);
+    trace_write(head, args);
+}
+
+// 计数轨道，在查看器中显示为随时间变化的曲线 (如当前刷新率)
+void trace_counter(const char *name, const char *key, long long value) {
+    if (!trace_fp) return;
+    char head[160], args[96];
+    snprintf(head, sizeof(head), "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%lld,\"tid\":%d",
+        name, now_us(), TRACE_TID_MAIN);
+    snprintf(args, sizeof(args), "\"%s\":%lld", key, value);
+    trace_write(head, args);
+}
+
+void trace_thread_name(int tid, const char *name) {
+    char head[96], args[64];
+    snprintf(head, sizeof(head), "{\"name\":\"thread_name\",\"ph\":\"M\",\"tid\":%d", tid);
+    snprintf(args, sizeof(args), "\"name\":\"%s\"", name);
+    trace_write(head, args);
+}
+
+// 打开追踪文件 (覆盖写入)；JSON 数组在退出时闭合，被强杀时查看器也能容忍缺少结尾的 ]
+int trace_open(const char *path) {
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) {
+        log_msg("Cannot open trace file / 无法打开追踪文件 %s: %s", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(trace_fp, NULL, _IOFBF, 65536);
+    fputs("[\n", trace_fp);
+    trace_thread_name(TRACE_TID_MAIN, "event loop");
+    trace_thread_name(TRACE_TID_SWITCH, "switch");
+    trace_thread_name(TRACE_TID_VERIFY, "verify");
+    trace_thread_name(TRACE_TID_EXEC, "async exec");
+    log_msg("Tracing to / 追踪输出: %s", path);
+    return 0;
+}
+
+// 每轮事件处理完后调用，事件很少 (只在切换和重载时产生)，刷写开销可以忽略
+void trace_flush() {
+    if (!trace_fp || !trace_pending) return;
+    fflush(trace_fp);
+    trace_pending = 0;
+}
+
+void trace_close() {
+    if (!trace_fp) return;
+    fputs("\n]\n", trace_fp);
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+// 录制时间取本轮事件的唤醒时间：同一次唤醒中产生的记录时间相同，回放时据此还原先后关系
+long long record_time() {
+    return (event_time_us > 0 ? event_time_us : now_us()) - record_start_us;
+}
+
+// 写一条录制记录；记录只在输入变化时产生，每条都立即刷写，被强杀时也不丢
+void record_event(char tag, const char *fmt, ...) {
+    if (!record_fp) return;
+    fprintf(record_fp, "%c %lld", tag, record_time());
+    if (fmt[0]) {
+        va_list ap;
+        va_start(ap, fmt);
+        fputc(' ', record_fp);
+        vfprintf(record_fp, fmt, ap);
+        va_end(ap);
+    }
+    fputc('\n', record_fp);
+    fflush(record_fp);
+}
+
+// 配置快照：原样保存文件内容，回放时写回临时目录走同一条加载路径
+void record_snapshot(char tag, const char *base, const char *name) {
+    if (!record_fp) return;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/config/%s", base, name);
+    size_t len = 0;
+    char *data = read_small_file(path, &len);
+    if (!data) return;
+    fprintf(record_fp, "%c %lld %zu\n", tag, record_time(), len);
+    fwrite(data, 1, len, record_fp);
+    fputc('\n', record_fp);
+    fflush(record_fp);
+    free(data);
+}
+
+// 前台应用或焦点窗口变化时记录 (轮询结果不变时不写)
+void record_foreground(const char *pkg) {
+    if (!record_fp) return;
+    if (strcmp(pkg, record_pkg) == 0 && strcmp(fg_focus, record_focus) == 0) return;
+    snprintf(record_pkg, sizeof(record_pkg), "%s", pkg);
+    snprintf(record_focus, sizeof(record_focus), "%s", fg_focus);
+    record_event('F', "%s %s", pkg, fg_focus[0] ? fg_focus : "-");
+}
+
+// 开始录制：文件头和模式表，之后的配置加载会写入快照
+int record_open(const char *path) {
+    record_fp = fopen(path, "w");
+    if (!record_fp) {
+        log_msg("Cannot open record file / 无法打开录制文件 %s: %s", path, strerror(errno));
+        return -1;
+    }
+    record_start_us = now_us();
+    record_event('R', "%d %lld", RECORD_VERSION, (long long)time(NULL));
+    for (int i = 0; i < mode_count; i++) {
+        record_event('M', "%d %d %d %d", modes[i].id, modes[i].width, modes[i].height, modes[i].fps);
+    }
+    log_msg("Recording to / 录制输出: %s", path);
+    return 0;
+}
+
+void record_close() {
+    if (!record_fp) return;
+    record_event('E', "");
+    fclose(record_fp);
+    record_fp = NULL;
+}
+
+// 注册 fd 到事件循环
+int loop_add_events(int fd, uint32_t mask, event_handler handler) {
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (event_sources[i].handler == NULL) {
+            event_sources[i].fd = fd;
+            event_sources[i].handler = handler;
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = mask;
+            ev.data.ptr = &event_sources[i];
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                log_msg("epoll_ctl add failed / 添加事件源失败: %s", strerror(errno));
+                event_sources[i].handler = NULL;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    log_msg("Too many event sources / 事件源过多");
+    return -1;
+}
+
+int loop_add(int fd, event_handler handler) {
+    return loop_add_events(fd, EPOLLIN, handler);
+}
+
+// 从事件循环移除 fd (不关闭)
+void loop_del(int fd) {
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (event_sources[i].handler != NULL && event_sources[i].fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            event_sources[i].handler = NULL;
+            event_sources[i].fd = -1;
+            return;
+        }
+    }
+}
+
+// 创建 timerfd
+int timer_create_fd() {
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// 设置定时器，delay_ms 为 0 表示停止
+void timer_arm(int fd, int delay_ms, int interval_ms) {
+    if (fd < 0) return;
+    if (replay_clock_us >= 0) {
+        replay_timer_set(fd, delay_ms, interval_ms);
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = (long)(delay_ms % 1000) * 1000000L;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+// 读走 timerfd 的到期计数
+void timer_drain(int fd) {
+    uint64_t expirations;
+    ssize_t n = read(fd, &expirations, sizeof(expirations));
+    (void)n;
+}
+
+// 前台应用决策：cgroup 和回放后端直接使用 fg_pkg；dumpsys 后端异步读取 dumpsys window，
+// 读完后在 on_window_dump 中决策
+void evaluate_foreground() {
+    if (screen_state == SCREEN_OFF) return;
+    if (fg_backend == FG_BACKEND_DUMPSYS) {
+        window_dump_start(0);
+        return;
+    }
+    foreground_decide(fg_pkg[0] ? fg_pkg : "unknown");
+}
+
+// 根据当前前台包名计算目标模式并发起切换
+void foreground_decide(const char *current_pkg) {
+    if (screen_state == SCREEN_OFF || strlen(current_pkg) == 0) return;
+    record_foreground(current_pkg);
+
+    // 记录应用切换
+    int changed = strcmp(current_pkg, last_pkg) != 0;
+    if (changed) {
+        log_msg("Detected App Change / 检测到应用切换: %s", current_pkg);
+        snprintf(last_pkg, sizeof(last_pkg), "%s", current_pkg);
+        forced_mode_id = -1;
+        content_reset();
+        ctl_notify("{\"event\":\"app\",\"package\":\"%s\"}", current_pkg);
+    }
+
+    // 总是检查是否需要切换，因为可能配置变了但应用没变
+    apply_package_mode(current_pkg, changed);
+}
+
+// 按包名配置 (或 force-mode) 计算目标模式，与当前/进行中的目标不同时发起切换
+void apply_package_mode(const char *pkg, int changed) {
+    if (screen_state == SCREEN_OFF) return;
+
+    // activity 规则: cgroup 后端不经过 dumpsys，切换到这类应用时异步查询一次焦点窗口，
+    // 读到后 (on_window_dump) 再决策，避免先按包名规则切换一次
+    if (changed && fg_backend == FG_BACKEND_CGROUP && !window_focus_fresh) {
+        AppEntry *e = app_table_find(app_table, pkg);
+        if (e && (e->flags & APP_FLAG_ACTIVITY)) {
+            window_dump_start(0);
+            return;
+        }
+    }
+    int target_id = rule_lookup(app_table, pkg, fg_focus, env_bits);
+    if (target_id == -1) target_id = default_mode_id;
+    content_update(pkg);
+    // 优先级: force-mode > 内容帧率 > 触摸空闲
+    if (forced_mode_id != -1) target_id = forced_mode_id;
+    else if (content_rate > 0) target_id = content_mode_for(target_id, content_rate);
+    else if (touch_idle) target_id = idle_mode_for(target_id);
+    // 温控上限最后应用，对 force-mode 同样生效
+    target_id = thermal_cap_for(target_id);
+
+    // 亮屏后显示 HAL 可能已重置模式，不信任 current_mode_id，直接下发
+    if (screen_reapply && is_valid_mode(target_id)) {
+        screen_reapply = 0;
+        ramp_cancel();
+        log_msg("Re-apply after wake / 亮屏重新下发: %d", target_id);
+        direct_switch(target_id);
+        return;
+    }
+
+    // 刚被系统拒绝的目标暂不重试，避免每次轮询都重新发起
+    if (target_id == verify_reject_id && now_us() < verify_reject_until) return;
+
+    // 阶梯切换进行中时与最终目标比较
+    int effective = ramp_target != -1 ? ramp_target : current_mode_id;
+    if (is_valid_mode(target_id) && target_id != effective) {
+        if (changed && event_time_us > 0) {
+            log_msg("Decision latency / 决策延迟: %lld us (target %d)", now_us() - event_time_us, target_id);
+        }
+        trace_instant("decision", "\"package\":\"%s\",\"target\":%d,\"from\":%d", pkg, target_id, effective);
+        smooth_switch(target_id);
+    }
+}
+
+// 内容帧率对应的模式：在 app_mode 所在阶梯中 (不超过 app_mode 的帧率)
+// 优先选帧率为内容帧率整数倍的最低档，其次选不低于内容帧率的最低档，都没有时保持 app_mode
+int content_mode_for(int app_mode, float rate) {
+    const Ladder *ladder = get_mode_ladder(app_mode);
+    int r = (int)(rate + 0.5f);
+    if (!ladder || r <= 0) return app_mode;
+    int cap = get_mode_fps(app_mode);
+    for (int i = 0; i < ladder->count; i++) {
+        int fps = get_mode_fps(ladder->ids[i]);
+        if (fps > cap) break;
+        if (fps % r == 0) return ladder->ids[i];
+    }
+    for (int i = 0; i < ladder->count; i++) {
+        int fps = get_mode_fps(ladder->ids[i]);
+        if (fps > cap) break;
+        if (fps >= r) return ladder->ids[i];
+    }
+    return app_mode;
+}
+
+// 应用图层的内容帧率：取名称为 "pkg/..." 或 "pkg#..." 的图层中最高的帧率投票
+float content_rate_of(const SfDump *dump, const char *pkg) {
+    size_t n = strlen(pkg);
+    float best = 0;
+    for (int i = 0; i < dump->layer_count; i++) {
+        const LayerInfo *l = &dump->layers[i];
+        const char *p = strstr(l->name, pkg);
+        if (p && (p[n] == '/' || p[n] == '#') && l->frame_rate > best) best = l->frame_rate;
+    }
+    return best;
+}
+
+// 清空内容帧率状态并停止采样 (前台应用切换、熄屏时)
+void on_content_dump(DumpBuffer *buf, long len, long long start_us);
+
+void content_reset() {
+    exec_cancel(on_content_dump);
+    content_active = 0;
+    content_rate = 0;
+    content_candidate = -1;
+    content_hits = 0;
+    timer_arm(content_timer_fd, 0, 0);
+}
+
+void on_content_timer(int fd, uint32_t events);
+
+// 前台应用开启了 content 时启动采样定时器，否则停止
+void content_update(const char *pkg) {
+    AppEntry *e = app_table_find(app_table, pkg);
+    int want = e && (e->flags & APP_FLAG_CONTENT) && forced_mode_id == -1;
+    if (want == content_active) return;
+    content_reset();
+    if (!want) return;
+
+    if (content_timer_fd < 0) {
+        content_timer_fd = timer_create_fd();
+        if (content_timer_fd < 0 || loop_add(content_timer_fd, on_content_timer) < 0) {
+            log_msg("Error creating content timer / 创建内容采样定时器失败: %s", strerror(errno));
+            if (content_timer_fd >= 0) close(content_timer_fd);
+            content_timer_fd = -1;
+            return;
+        }
+    }
+    content_active = 1;
+    timer_arm(content_timer_fd, content_sample_ms, content_sample_ms);
+}
+
+// 采样前台应用图层的帧率投票，连续两次一致才生效，避免瞬时投票引起来回切换
+void on_content_dump(DumpBuffer *buf, long len, long long start_us) {
+    (void)start_us;
+    if (len <= 0 || !content_active || screen_state == SCREEN_OFF || !last_pkg[0]) return;
+
+    static SfDump dump;
+    parse_sf_dump(buf->data, buf->len, &dump);
+    content_samples++;
+
+    float rate = content_rate_of(&dump, last_pkg);
+    int rounded = (int)(rate + 0.5f);
+    if (rounded == content_candidate) {
+        content_hits++;
+    } else {
+        content_candidate = rounded;
+        content_hits = 1;
+    }
+    if (content_hits != 2 || rounded == (int)(content_rate + 0.5f)) return;
+
+    content_rate = rate;
+    log_msg("Content rate / 内容帧率: %s %.2f fps", last_pkg, rate);
+    apply_package_mode(last_pkg, 0);
+}
+
+// dumpsys SurfaceFlinger 在事件循环上异步读取，上一次还没读完时跳过本次采样
+void on_content_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    if (!content_active || screen_state == SCREEN_OFF || !last_pkg[0]) return;
+    static DumpBuffer content_buf;
+    char *const argv[] = { "dumpsys", "SurfaceFlinger", NULL };
+    if (!exec_running(on_content_dump)) exec_async(argv, &content_buf, NULL, on_content_dump);
+}
+
+// 温控限制后的模式：目标帧率超过 thermal_cap_fps 时，取同一阶梯中不超过上限的最高档 (没有时取最低档)
+int thermal_cap_for(int mode_id) {
+    if (thermal_cap_fps <= 0 || get_mode_fps(mode_id) <= thermal_cap_fps) return mode_id;
+    const Ladder *ladder = get_mode_ladder(mode_id);
+    if (!ladder) return mode_id;
+    int capped = ladder->ids[0];
+    for (int r = 0; r < ladder->count; r++) {
+        if (get_mode_fps(ladder->ids[r]) <= thermal_cap_fps) capped = ladder->ids[r];
+    }
+    return capped;
+}
+
+// 解析 thermal_caps=42:144,45:120,48:90 (温度°C:最高帧率，按温度升序)
+void parse_thermal_caps(const char *value) {
+    thermal_step_count = 0;
+    const char *p = value;
+    while (*p && thermal_step_count < MAX_THERMAL_STEPS) {
+        float temp;
+        int fps, n = 0;
+        if (sscanf(p, " %f:%d%n", &temp, &fps, &n) != 2) break;
+        if (thermal_step_count == 0 || temp * 1000 > thermal_steps[thermal_step_count - 1].temp_mc) {
+            thermal_steps[thermal_step_count].temp_mc = (int)(temp * 1000);
+            thermal_steps[thermal_step_count].fps = fps;
+            thermal_step_count++;
+        }
+        p += n;
+        while (*p == ',' || *p == ' ') p++;
+    }
+}
+
+// 查找温度节点：thermal_zone 为 thermal_zoneN 时直接使用，否则按 type 匹配；
+// 未配置时依次尝试常见的机身温度传感器
+int find_thermal_zone(const char *name, char *path, size_t size) {
+    static const char *preferred[] = { "skin-therm", "skin_therm", "shell_front", "shell_back", "quiet-therm", "xo-therm", NULL };
+    char dir[320];
+    snprintf(dir, sizeof(dir), "%s/class/thermal", sys_root);
+
+    if (strncmp(name, "thermal_zone", 12) == 0) {
+        snprintf(path, size, "%s/%s/temp", dir, name);
+        return access(path, R_OK) == 0;
+    }
+
+    for (int pass = 0; name[0] ? pass < 1 : preferred[pass] != NULL; pass++) {
+        const char *want = name[0] ? name : preferred[pass];
+        DIR *d = opendir(dir);
+        if (!d) return 0;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (strncmp(de->d_name, "thermal_zone", 12) != 0) continue;
+            char type_path[600], type[64] = "";
+            snprintf(type_path, sizeof(type_path), "%s/%s/type", dir, de->d_name);
+            FILE *fp = fopen(type_path, "r");
+            if (!fp) continue;
+            if (fgets(type, sizeof(type), fp)) trim(type);
+            fclose(fp);
+            if (strcmp(type, want) == 0) {
+                snprintf(path, size, "%s/%s/temp", dir, de->d_name);
+                closedir(d);
+                return 1;
+            }
+        }
+        closedir(d);
+    }
+    return 0;
+}
+
+// 读取温度 (毫摄氏度)，部分驱动直接报摄氏度
+int read_thermal_mc() {
+    char buf[32];
+    ssize_t n = pread(thermal_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return INT32_MIN;
+    buf[n] = '\0';
+    int v = atoi(buf);
+    return v > -1000 && v < 1000 ? v * 1000 : v;
+}
+
+// 温控控制器：温度达到某一级阈值时升级，低于当前级阈值 thermal_hysteresis 度后才降级
+void thermal_check() {
+    int mc = read_thermal_mc();
+    if (mc == INT32_MIN) return;
+    thermal_temp_mc = mc;
+
+    int level = thermal_level;
+    while (level < thermal_step_count && mc >= thermal_steps[level].temp_mc) level++;
+    while (level > 0 && mc < thermal_steps[level - 1].temp_mc - thermal_hysteresis * 1000) level--;
+    if (level == thermal_level) return;
+
+    thermal_level = level;
+    thermal_cap_fps = level > 0 ? thermal_steps[level - 1].fps : 0;
+    thermal_changes++;
+    if (thermal_cap_fps > 0) {
+        log_msg("Thermal cap / 温控限制: %.1f C -> max %d Hz (level %d)", mc / 1000.0, thermal_cap_fps, level);
+    } else {
+        log_msg("Thermal cap lifted / 温控解除: %.1f C", mc / 1000.0);
+    }
+    ctl_notify("{\"event\":\"thermal\",\"temp\":%.1f,\"cap\":%d}", mc / 1000.0, thermal_cap_fps);
+    if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+}
+
+void on_thermal_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    thermal_check();
+}
+
+// 按 daemon.conf 打开温度节点并启动定时器 (启动时和每次重载配置后调用)
+void thermal_sync() {
+    if (epoll_fd < 0) return;
+    if (thermal_step_count == 0) {
+        if (thermal_fd >= 0) {
+            close(thermal_fd);
+            thermal_fd = -1;
+            timer_arm(thermal_timer_fd, 0, 0);
+            log_msg("Thermal control disabled / 温控已关闭");
+        }
+        if (thermal_cap_fps > 0) {
+            thermal_level = 0;
+            thermal_cap_fps = 0;
+            if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+        }
+        return;
+    }
+
+    char path[600];
+    if (!find_thermal_zone(thermal_zone, path, sizeof(path))) {
+        if (thermal_fd < 0) log_msg("No thermal zone / 未找到温度节点: %s", thermal_zone[0] ? thermal_zone : "auto");
+        return;
+    }
+    if (thermal_fd < 0 || strcmp(path, thermal_path) != 0) {
+        if (thermal_fd >= 0) close(thermal_fd);
+        thermal_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (thermal_fd < 0) return;
+        snprintf(thermal_path, sizeof(thermal_path), "%s", path);
+        log_msg("Thermal zone / 温度节点: %s (%d steps, hysteresis %d C)", thermal_path, thermal_step_count, thermal_hysteresis);
+    }
+
+    if (thermal_timer_fd < 0) {
+        thermal_timer_fd = timer_create_fd();
+        if (thermal_timer_fd < 0 || loop_add(thermal_timer_fd, on_thermal_timer) < 0) {
+            log_msg("Error creating thermal timer / 创建温控定时器失败: %s", strerror(errno));
+            return;
+        }
+    }
+    if (screen_state != SCREEN_OFF) timer_arm(thermal_timer_fd, thermal_poll_ms, thermal_poll_ms);
+    thermal_check();
+}
+
+// 读取电池电量和充电状态 (<sys_root>/class/power_supply/battery)
+void env_read_battery() {
+    if (replay_clock_us >= 0) return;    // 回放时由录制的 B 记录设置
+    char path[320];
+    size_t len;
+    snprintf(path, sizeof(path), "%s/class/power_supply/battery/capacity", sys_root);
+    char *v = read_small_file(path, &len);
+    battery_level = v ? atoi(v) : -1;
+    free(v);
+    snprintf(path, sizeof(path), "%s/class/power_supply/battery/status", sys_root);
+    v = read_small_file(path, &len);
+    battery_charging = v && (strncmp(v, "Charging", 8) == 0 || strncmp(v, "Full", 4) == 0);
+    free(v);
+    if (record_fp && (battery_level != record_battery || battery_charging != record_charging)) {
+        record_battery = battery_level;
+        record_charging = battery_charging;
+        record_event('B', "%d %d", battery_level, battery_charging);
+    }
+}
+
+// 计算配置中各条件谓词的当前取值，电量未知时 battery<N 不成立
+uint32_t env_eval(const AppTable *t) {
+    time_t now = replay_clock_us >= 0 ? replay_wall_base + replay_clock_us / 1000000 : time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+
+    uint32_t bits = 0;
+    for (int i = 0; i < t->pred_count; i++) {
+        const RulePred *p = &t->preds[i];
+        int v = 0;
+        if (p->type == PRED_CHARGING) {
+            v = battery_charging;
+        } else if (p->type == PRED_BATTERY_LT) {
+            v = battery_level >= 0 && battery_level < p->a;
+        } else if (p->type == PRED_TIME) {
+            v = p->a <= p->b ? (minute >= p->a && minute < p->b) : (minute >= p->a || minute < p->b);
+        }
+        if (v) bits |= 1u << i;
+    }
+    return bits;
+}
+
+// 重新采样规则条件，取值变化时按当前前台应用重新决策
+void env_check() {
+    if (!app_table || app_table->pred_count == 0) return;
+    env_read_battery();
+    uint32_t bits = env_eval(app_table);
+    if (bits == env_bits) return;
+    log_msg("Rule conditions changed / 规则条件变化: 0x%x -> 0x%x (battery %d%%, %s)",
+        env_bits, bits, battery_level, battery_charging ? "charging" : "discharging");
+    env_bits = bits;
+    if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+}
+
+void on_env_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    env_check();
+}
+
+// 配置加载后调用：谓词编号随配置变化，直接重新计算；没有条件规则时停掉采样
+void env_sync() {
+    if (!app_table) return;
+    if (app_table->pred_count == 0) {
+        env_bits = 0;
+        timer_arm(env_timer_fd, 0, 0);
+        return;
+    }
+    env_read_battery();
+    env_bits = env_eval(app_table);
+    if (epoll_fd < 0) return;
+    if (env_timer_fd < 0) {
+        env_timer_fd = timer_create_fd();
+        if (env_timer_fd < 0 || loop_add(env_timer_fd, on_env_timer) < 0) {
+            log_msg("Error creating rule timer / 创建规则定时器失败: %s", strerror(errno));
+            return;
+        }
+    }
+    if (screen_state != SCREEN_OFF) timer_arm(env_timer_fd, ENV_POLL_MS, ENV_POLL_MS);
+}
+
+long long read_sysfs_ll(int fd, int *ok) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    *ok = n > 0;
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    return atoll(buf);
+}
+
+// 采样电池功率：current_now (µA，不同设备符号相反，取绝对值) × voltage_now (µV)
+// 只有 status 明确为 Charging / Full 才算充电；status 缺失或无法识别时按放电计，
+// 电流电压读取失败时功率记为未知 (计入 energy_unknown_us，不归入充电)
+void energy_sample() {
+    char status[32];
+    ssize_t n = energy_status_fd >= 0 ? pread(energy_status_fd, status, sizeof(status) - 1, 0) : -1;
+    status[n > 0 ? n : 0] = '\0';
+    energy_charging = strncmp(status, "Charging", 8) == 0 || strncmp(status, "Full", 4) == 0;
+
+    int ok_i, ok_v;
+    long long ua = read_sysfs_ll(energy_current_fd, &ok_i);
+    long long uv = read_sysfs_ll(energy_voltage_fd, &ok_v);
+    energy_samples++;
+    if (energy_charging || !ok_i || !ok_v) {
+        energy_power_uw = -1;
+    } else {
+        // µA × µV = pW，除以 10^6 得到 µW
+        energy_power_uw = llabs(ua) * uv / 1000000;
+        log_debug("Battery power / 电池功率: %lld mW", energy_power_uw / 1000);
+    }
+    if (record_fp && (energy_power_uw != record_power || energy_charging != record_power_charging)) {
+        record_power = energy_power_uw;
+        record_power_charging = energy_charging;
+        record_event('P', "%lld %d", energy_power_uw, energy_charging);
+    }
+}
+
+void on_energy_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    // 先按旧功率记账，再更新
+    stats_account();
+    energy_sample();
+}
+
+void energy_close() {
+    if (energy_status_fd >= 0) close(energy_status_fd);
+    if (energy_current_fd >= 0) close(energy_current_fd);
+    if (energy_voltage_fd >= 0) close(energy_voltage_fd);
+    energy_status_fd = -1;
+    energy_current_fd = -1;
+    energy_voltage_fd = -1;
+    energy_active = 0;
+    energy_power_uw = -1;
+    timer_arm(energy_timer_fd, 0, 0);
+}
+
+// 配置加载后调用：按 energy_sample_ms 开启、调整或关闭功率采样
+void energy_sync() {
+    if (epoll_fd < 0) return;
+    if (energy_sample_ms == 0) {
+        if (energy_current_fd >= 0) log_msg("Energy sampling disabled / 能耗统计已关闭");
+        energy_close();
+        return;
+    }
+    if (power_supply_path[0] == '\0') {
+        snprintf(power_supply_path, sizeof(power_supply_path), "%s/class/power_supply/battery", sys_root);
+    }
+    if (energy_current_fd < 0) {
+        char path[384];
+        snprintf(path, sizeof(path), "%s/current_now", power_supply_path);
+        energy_current_fd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "%s/voltage_now", power_supply_path);
+        energy_voltage_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (energy_current_fd < 0 || energy_voltage_fd < 0) {
+            log_msg("No battery current/voltage / 无法读取电池电流电压: %s", power_supply_path);
+            energy_close();
+            return;
+        }
+        // status 打不开时按放电处理，不影响采样
+        snprintf(path, sizeof(path), "%s/status", power_supply_path);
+        energy_status_fd = open(path, O_RDONLY | O_CLOEXEC);
+        energy_active = 1;
+        log_msg("Energy sampling / 能耗采样: %s every %d ms", power_supply_path, energy_sample_ms);
+    }
+    if (energy_timer_fd < 0) {
+        energy_timer_fd = timer_create_fd();
+        if (energy_timer_fd < 0 || loop_add(energy_timer_fd, on_energy_timer) < 0) {
+            log_msg("Error creating energy timer / 创建能耗定时器失败: %s", strerror(errno));
+            energy_close();
+            return;
+        }
+    }
+    if (screen_state != SCREEN_OFF) {
+        timer_arm(energy_timer_fd, energy_sample_ms, energy_sample_ms);
+        energy_sample();
+    }
+}
+
+// 调度 ---------------------------------------------------------------
+// 守护进程默认绑定到能效核并以 SCHED_IDLE 运行，1 Hz 的 dumpsys 轮询不唤醒大核、不和前台游戏争抢；
+// 只有下发模式切换时临时提升到普通调度类的高优先级
+#define RAMP_BOOST_NICE -10
+
+int sched_boosted = 0;
+long long sched_boosts = 0;
+long long cpu_check_us = 0;     // 上次 CPU 预算检查的时间和当时的累计 CPU 时间
+long long cpu_check_used_us = 0;
+
+// 解析 CPU 列表 (如 0-3,6)，返回 CPU 数，格式错误返回 -1
+int parse_cpu_list(const char *value, cpu_set_t *set) {
+    CPU_ZERO(set);
+    int count = 0;
+    const char *p = value;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p) return -1;
+        long hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            if (c >= 0 && !CPU_ISSET(c, set)) {
+                CPU_SET(c, set);
+                count++;
+            }
+        }
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return count;
+}
+
+// 能效核：cpuinfo_max_freq 最低的一簇；读不到或所有核相同时返回 0 (不绑定)
+int find_little_cpus(cpu_set_t *set) {
+    CPU_ZERO(set);
+    long min_freq = 0, max_freq = 0;
+    int count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            char path[320];
+            snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d", sys_root, cpu);
+            if (access(path, F_OK) != 0) break;
+            snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", sys_root, cpu);
+            size_t len;
+            char *v = read_small_file(path, &len);
+            if (!v) continue;   // 离线核没有 cpufreq
+            long freq = atol(v);
+            free(v);
+            if (freq <= 0) continue;
+            if (pass == 0) {
+                if (min_freq == 0 || freq < min_freq) min_freq = freq;
+                if (freq > max_freq) max_freq = freq;
+            } else if (freq == min_freq) {
+                CPU_SET(cpu, set);
+                count++;
+            }
+        }
+        if (min_freq == max_freq) return 0;
+    }
+    return count;
+}
+
+// CPU 集合格式化为列表 (0-3,6)
+void cpu_list_str(const cpu_set_t *set, char *buf, size_t size) {
+    size_t off = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && off < size; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) hi++;
+        off += snprintf(buf + off, size - off, hi > c ? "%s%d-%d" : "%s%d", off ? "," : "", c, hi);
+        c = hi;
+    }
+}
+
+int sched_set_thread(pid_t tid, const cpu_set_t *cpus, int policy, int nice_value) {
+    if (cpus && sched_setaffinity(tid, sizeof(*cpus), cpus) < 0) return -1;
+    struct sched_param sp = { 0 };
+    if (sched_setscheduler(tid, policy, &sp) < 0) return -1;
+    if (policy != SCHED_IDLE) setpriority(PRIO_PROCESS, tid, nice_value);
+    return 0;
+}
+
+// 应用到本进程所有线程 (日志线程已经创建，不会自动跟随主线程)
+int sched_apply_threads(const cpu_set_t *cpus, int policy, int nice_value) {
+    DIR *d = opendir("/proc/self/task");
+    if (!d) return -1;
+    int failed = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (sched_set_thread((pid_t)atoi(de->d_name), cpus, policy, nice_value) < 0) failed++;
+    }
+    closedir(d);
+    return failed ? -1 : 0;
+}
+
+// 把本进程写入 cgroup_dirs 中每个 cgroup 的 cgroup.procs
+void cgroup_join() {
+    char dirs[sizeof(cgroup_dirs)];
+    memcpy(dirs, cgroup_dirs, sizeof(dirs));
+    char *save = NULL;
+    for (char *dir = strtok_r(dirs, ",", &save); dir; dir = strtok_r(NULL, ",", &save)) {
+        dir = trim(dir);
+        if (!*dir) continue;
+        char path[320], pid_str[16];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+        int n = snprintf(pid_str, sizeof(pid_str), "%d", (int)getpid());
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || write(fd, pid_str, n) != n) {
+            log_msg("Cannot join cgroup / 无法加入 cgroup %s: %s", dir, strerror(errno));
+        } else {
+            log_msg("Joined cgroup / 已加入 cgroup: %s", dir);
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+// 配置加载后调用：CPU 绑定、调度类或 cgroup 变化时重新应用 (常驻 shell 一并调整)
+void sched_sync() {
+    if (epoll_fd < 0) return;
+    static char applied[sizeof(cpu_affinity) + sizeof(cgroup_dirs) + 32] = "";
+    char key[sizeof(applied)];
+    snprintf(key, sizeof(key), "%s|%d|%d|%d|%s", cpu_affinity, sched_idle, sched_nice, ramp_boost, cgroup_dirs);
+    if (strcmp(key, applied) == 0) return;
+    memcpy(applied, key, sizeof(applied));
+
+    if (cgroup_dirs[0]) cgroup_join();
+
+    cpu_set_t cpus;
+    int n = 0;
+    if (strcmp(cpu_affinity, "little") == 0) {
+        n = find_little_cpus(&cpus);
+        if (n == 0) log_msg("No distinct little cores / 未识别出能效核, not pinning");
+    } else if (cpu_affinity[0] && strcmp(cpu_affinity, "all") != 0) {
+        n = parse_cpu_list(cpu_affinity, &cpus);
+        if (n <= 0) log_msg("Invalid cpu_affinity / CPU 列表无效: %s", cpu_affinity);
+    }
+    if (n <= 0) {
+        CPU_ZERO(&cpus);
+        long conf = sysconf(_SC_NPROCESSORS_CONF);
+        for (long c = 0; c < conf && c < CPU_SETSIZE; c++) CPU_SET(c, &cpus);
+    }
+
+    int policy = sched_idle ? SCHED_IDLE : SCHED_OTHER;
+    int rc = sched_apply_threads(&cpus, policy, sched_nice);
+    if (helper_pid > 0) sched_set_thread(helper_pid, &cpus, policy, sched_nice);
+    sched_boosted = 0;
+
+    char list[128];
+    cpu_list_str(&cpus, list, sizeof(list));
+    if (rc < 0) log_msg("Scheduling partly failed / 调度设置部分失败: %s", strerror(errno));
+    log_msg("Scheduling / 调度: cpus %s, %s, ramp boost %s", list,
+        sched_idle ? "SCHED_IDLE" : "SCHED_OTHER", ramp_boost ? "on" : "off");
+    if (!sched_idle) log_msg("Scheduling / 调度: nice %d", sched_nice);
+}
+
+// 下发切换时提升主线程和常驻 shell (其子进程 service call 继承)，事件循环处理完且没有进行中的阶梯时恢复
+void sched_boost(int on) {
+    if (!ramp_boost || on == sched_boosted || epoll_fd < 0) return;
+    sched_boosted = on;
+    if (on) sched_boosts++;
+    int policy = on || !sched_idle ? SCHED_OTHER : SCHED_IDLE;
+    int nice_value = on ? RAMP_BOOST_NICE : sched_nice;
+    sched_set_thread((pid_t)syscall(SYS_gettid), NULL, policy, nice_value);
+    if (helper_pid > 0) sched_set_thread(helper_pid, NULL, policy, nice_value);
+}
+
+// 累计 CPU 时间 (微秒)，who 为 RUSAGE_SELF / RUSAGE_THREAD / RUSAGE_CHILDREN
+long long cpu_time_us(int who) {
+    struct rusage ru;
+    if (getrusage(who, &ru) < 0) return 0;
+    return (long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// 每个统计周期检查一次 CPU 占用 (本进程 + 已回收的 dumpsys 子进程)
+void cpu_check() {
+    long long now = now_us();
+    long long used = cpu_time_us(RUSAGE_SELF) + cpu_time_us(RUSAGE_CHILDREN);
+    if (cpu_check_us > 0 && now > cpu_check_us) {
+        double pct = (used - cpu_check_used_us) * 100.0 / (now - cpu_check_us);
+        if (cpu_budget_pct > 0 && pct > cpu_budget_pct) {
+            log_at(LOG_LEVEL_WARN, "CPU over budget / CPU 占用超出预算: %.2f%% > %.2f%% (%lld ms in %lld s)",
+                pct, cpu_budget_pct, (used - cpu_check_used_us) / 1000, (now - cpu_check_us) / 1000000);
+        } else {
+            log_debug("CPU usage / CPU 占用: %.2f%% (%lld ms)", pct, (used - cpu_check_used_us) / 1000);
+        }
+    }
+    cpu_check_us = now;
+    cpu_check_used_us = used;
+}
+
+// 应用模式对应的空闲模式：同一阶梯中不高于 idle_fps 的最高档位 (没有时取最低档)
+int idle_mode_for(int mode_id) {
+    const Ladder *ladder = get_mode_ladder(mode_id);
+    if (!ladder || idle_fps <= 0) return mode_id;
+    int idle = ladder->ids[0];
+    for (int r = 0; r < ladder->count; r++) {
+        if (get_mode_fps(ladder->ids[r]) <= idle_fps) idle = ladder->ids[r];
+    }
+    return get_mode_fps(idle) < get_mode_fps(mode_id) ? idle : mode_id;
+}
+
+// 有触摸输入：空闲状态下立即回到应用模式，活跃状态只记录时间 (定时器到期时再判断)
+void touch_activity() {
+    long long now = now_us();
+    last_touch_us = now;
+    if (!touch_idle) return;
+
+    // 迟滞：降频后很快又被触摸说明超时太短，翻倍 (最多 4 倍)；长时间空闲后恢复基础值
+    long long idle_ms = (now - idle_since_us) / 1000;
+    if (idle_ms < idle_timeout_cur_ms) {
+        if (idle_timeout_cur_ms < idle_timeout_ms * 4) idle_timeout_cur_ms *= 2;
+    } else if (idle_ms > (long long)idle_timeout_ms * 4) {
+        idle_timeout_cur_ms = idle_timeout_ms;
+    }
+
+    touch_idle = 0;
+    idle_boosts++;
+    timer_arm(idle_timer_fd, idle_timeout_cur_ms, 0);
+    log_debug("Touch boost / 触摸升频 (idle %lld ms, timeout %d ms)", idle_ms, idle_timeout_cur_ms);
+    if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+}
+
+// 空闲定时器到期：距上次触摸已满超时则降到空闲档位，否则按剩余时间重新计时
+void on_idle_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    if (touch_idle || screen_state == SCREEN_OFF) return;
+
+    long long quiet_ms = (now_us() - last_touch_us) / 1000;
+    if (quiet_ms < idle_timeout_cur_ms) {
+        timer_arm(idle_timer_fd, idle_timeout_cur_ms - quiet_ms, 0);
+        return;
+    }
+    touch_idle = 1;
+    idle_since_us = now_us();
+    idle_drops++;
+    log_debug("Idle downclock / 空闲降频 (no input for %lld ms)", quiet_ms);
+    if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+}
+
+void on_input(int fd, uint32_t events) {
+    (void)events;
+    struct input_event ev[64];
+    int got = 0;
+    ssize_t n;
+    // 一次读空，只关心 "有输入"，不解析坐标
+    while ((n = read(fd, ev, sizeof(ev))) > 0) got = 1;
+    if (got) touch_activity();
+}
+
+// 判断是否为触摸屏 (支持多点触控坐标)
+int is_touch_device(int fd) {
+    unsigned long bits[(ABS_MAX + 1 + 8 * sizeof(long) - 1) / (8 * sizeof(long))];
+    memset(bits, 0, sizeof(bits));
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(bits)), bits) < 0) return 0;
+    int bit = ABS_MT_POSITION_X;
+    return (bits[bit / (8 * sizeof(long))] >> (bit % (8 * sizeof(long)))) & 1;
+}
+
+void input_close() {
+    for (int i = 0; i < input_count; i++) {
+        loop_del(input_fds[i]);
+        close(input_fds[i]);
+    }
+    input_count = 0;
+}
+
+// 按 daemon.conf 打开或关闭触摸输入 (启动时和每次重载配置后调用)
+// --input=PATH 直接使用指定设备或录制的事件流 (FIFO)，不做触摸屏检测
+void input_sync() {
+    if (epoll_fd < 0) return;
+    if (idle_fps <= 0) {
+        if (input_count > 0) {
+            input_close();
+            timer_arm(idle_timer_fd, 0, 0);
+            log_msg("Idle downclock disabled / 空闲降频已关闭");
+        }
+        if (touch_idle) {
+            touch_idle = 0;
+            if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+        }
+        return;
+    }
+    if (idle_timeout_cur_ms < idle_timeout_ms) idle_timeout_cur_ms = idle_timeout_ms;
+    if (input_count > 0) return;
+
+    if (idle_timer_fd < 0) {
+        idle_timer_fd = timer_create_fd();
+        if (idle_timer_fd < 0 || loop_add(idle_timer_fd, on_idle_timer) < 0) {
+            log_msg("Error creating idle timer / 创建空闲定时器失败: %s", strerror(errno));
+            return;
+        }
+    }
+
+    if (input_path[0]) {
+        // 以读写方式打开，FIFO 的写入端关闭后不会一直报 EPOLLHUP
+        int fd = open(input_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) fd = open(input_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0 && loop_add(fd, on_input) == 0) input_fds[input_count++] = fd;
+        else if (fd >= 0) close(fd);
+    } else {
+        for (int i = 0; i < 32 && input_count < MAX_INPUT_DEVICES; i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/dev/input/event%d", i);
+            int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) continue;
+            if (is_touch_device(fd) && loop_add(fd, on_input) == 0) {
+                input_fds[input_count++] = fd;
+                log_msg("Touch input / 触摸输入: %s", path);
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (input_count == 0) {
+        log_msg("No touch input, idle downclock off / 未找到触摸设备，空闲降频不可用");
+        return;
+    }
+    last_touch_us = now_us();
+    timer_arm(idle_timer_fd, idle_timeout_cur_ms, 0);
+    log_msg("Idle downclock / 空闲降频: %d fps after %d ms", idle_fps, idle_timeout_ms);
+}
+
+// 查找背光亮度节点：<sys>/class/backlight/*/brightness，其次 <sys>/class/leds/lcd-backlight/brightness
+int find_backlight(char *path, size_t size) {
+    char dir[320];
+    snprintf(dir, sizeof(dir), "%s/class/backlight", sys_root);
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.') continue;
+            snprintf(path, size, "%s/%s/brightness", dir, de->d_name);
+            if (access(path, R_OK) == 0) {
+                closedir(d);
+                return 1;
+            }
+        }
+        closedir(d);
+    }
+    snprintf(path, size, "%s/class/leds/lcd-backlight/brightness", sys_root);
+    return access(path, R_OK) == 0;
+}
+
+// 读取背光节点的屏幕状态，只需一次 pread；没有背光节点时为 SCREEN_UNKNOWN (由 screen_check 异步读取 dumpsys power)
+int read_screen_state() {
+    if (backlight_fd < 0) return SCREEN_UNKNOWN;
+    char buf[32];
+    ssize_t n = pread(backlight_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return SCREEN_UNKNOWN;
+    buf[n] = '\0';
+    return atoi(buf) > 0 ? SCREEN_ON : SCREEN_OFF;
+}
+
+// 上次状态变化以来的唤醒统计
+void screen_log_wakeups(const char *what, int state) {
+    long long now = now_us();
+    long long elapsed_ms = (now - screen_changed_us) / 1000;
+    long long wakeups = loop_wakeups - wakeups_at_change;
+    log_msg("%s (%s for %lld s, %lld wakeups, %lld/h)", what, state == SCREEN_ON ? "on" : "off",
+        elapsed_ms / 1000, wakeups, elapsed_ms > 0 ? wakeups * 3600000LL / elapsed_ms : 0);
+    screen_changed_us = now;
+    wakeups_at_change = loop_wakeups;
+}
+
+// 屏幕定时器：
+// - 背光变化会推送 (EPOLLPRI / uevent 已经触发过) 时不需要
+// - 亮屏且有 dumpsys 轮询时，背光节点由轮询顺带检查
+// - 熄屏时单次触发，间隔由 on_screen_timer 逐次加倍
+void screen_timer_update() {
+    if (screen_push || (screen_state != SCREEN_OFF && poll_timer_fd >= 0 && backlight_fd >= 0)) {
+        timer_arm(screen_timer_fd, 0, 0);
+    } else if (screen_state == SCREEN_OFF) {
+        timer_arm(screen_timer_fd, screen_poll_cur_ms, 0);
+    } else {
+        timer_arm(screen_timer_fd, screen_poll_ms, screen_poll_ms);
+    }
+}
+
+// 熄屏：取消进行中的阶梯，停掉前台轮询，只保留屏幕状态检查
+void screen_suspend() {
+    screen_log_wakeups("Screen off, detection suspended / 熄屏，暂停检测", screen_state);
+    screen_state = SCREEN_OFF;
+    record_event('S', "0");
+    ramp_cancel();
+    verify_cancel();
+    timer_arm(idle_timer_fd, 0, 0);
+    timer_arm(thermal_timer_fd, 0, 0);
+    timer_arm(env_timer_fd, 0, 0);
+    timer_arm(energy_timer_fd, 0, 0);
+    content_reset();
+    timer_arm(poll_timer_fd, 0, 0);
+    screen_poll_cur_ms = screen_poll_ms;
+    screen_timer_update();
+    ctl_notify("{\"event\":\"screen\",\"on\":false}");
+}
+
+// 亮屏：恢复轮询，重新检测前台并立即下发模式
+void screen_resume() {
+    screen_log_wakeups("Screen on, re-applying / 亮屏，重新下发", screen_state);
+    screen_state = SCREEN_ON;
+    record_event('S', "1");
+    screen_reapply = 1;
+    settings_cache_reset();
+    if (input_count > 0) {
+        // 刚亮屏视为有操作
+        touch_idle = 0;
+        last_touch_us = now_us();
+        timer_arm(idle_timer_fd, idle_timeout_cur_ms, 0);
+    }
+    if (poll_timer_fd >= 0) timer_arm(poll_timer_fd, POLL_INTERVAL_MS, POLL_INTERVAL_MS);
+    screen_timer_update();
+    if (thermal_fd >= 0) {
+        timer_arm(thermal_timer_fd, thermal_poll_ms, thermal_poll_ms);
+        thermal_check();
+    }
+    if (energy_current_fd >= 0) {
+        timer_arm(energy_timer_fd, energy_sample_ms, energy_sample_ms);
+        energy_sample();
+    }
+    if (app_table && app_table->pred_count > 0) {
+        timer_arm(env_timer_fd, ENV_POLL_MS, ENV_POLL_MS);
+        env_read_battery();
+        env_bits = env_eval(app_table);
+    }
+    ctl_notify("{\"event\":\"screen\",\"on\":true}");
+    if (fg_backend == FG_BACKEND_CGROUP) update_foreground_from_cgroup();
+    evaluate_foreground();
+}
+
+// 屏幕状态发生变化时挂起或恢复；返回 1 表示刚刚亮屏 (已重新决策)
+int screen_apply(int state) {
+    if (state == SCREEN_UNKNOWN || state == screen_state) return 0;
+    if (state == SCREEN_OFF) {
+        screen_suspend();
+        return 0;
+    }
+    screen_resume();
+    return 1;
+}
+
+// dumpsys power 的 mWakefulness (Awake/Asleep/Dozing)
+void on_power_dump(DumpBuffer *buf, long len, long long start_us) {
+    (void)start_us;
+    const char *p = len > 0 ? strstr(buf->data, "mWakefulness=") : NULL;
+    if (p) screen_apply(strncmp(p + 13, "Awake", 5) == 0 ? SCREEN_ON : SCREEN_OFF);
+}
+
+// 检查屏幕状态：背光节点直接读取；回退路径异步执行 dumpsys power，结果在 on_power_dump 中处理
+int screen_check() {
+    if (backlight_fd >= 0) return screen_apply(read_screen_state());
+    static DumpBuffer power_buf;
+    char *const argv[] = { "dumpsys", "power", NULL };
+    if (!exec_running(on_power_dump)) exec_async(argv, &power_buf, "mWakefulness=", on_power_dump);
+    return 0;
+}
+
+void on_screen_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    screen_check();
+    if (screen_state != SCREEN_OFF || screen_push) return;
+    // 仍在熄屏：退避，熄屏越久唤醒越少
+    if (screen_poll_cur_ms < SCREEN_POLL_MAX_MS) {
+        screen_poll_cur_ms = screen_poll_cur_ms * 2 < SCREEN_POLL_MAX_MS ? screen_poll_cur_ms * 2 : SCREEN_POLL_MAX_MS;
+        log_debug("Screen poll backoff / 熄屏检查间隔: %d ms", screen_poll_cur_ms);
+    }
+    screen_timer_update();
+}
+
+// 第一次收到背光变化事件后改为完全由事件驱动
+// (sysfs 节点都能注册 EPOLLPRI，但只有调用 sysfs_notify 的驱动会真正触发，所以以实际收到事件为准)
+void screen_push_seen(const char *source) {
+    if (screen_push) return;
+    screen_push = 1;
+    log_msg("Screen events / 屏幕事件: %s, screen timer off / 停用屏幕定时器", source);
+    screen_timer_update();
+}
+
+// 支持 sysfs_notify 的背光驱动会在亮度变化时触发 EPOLLPRI
+void on_backlight(int fd, uint32_t events) {
+    (void)fd;
+    (void)events;
+    screen_push_seen("backlight EPOLLPRI");
+    screen_check();
+}
+
+// 内核 uevent："action@devpath\0KEY=VALUE\0..."，只关心背光设备 (backlight 子系统或 leds/lcd-backlight)
+void on_uevent(int fd, uint32_t events) {
+    (void)events;
+    char buf[2048];
+    int backlight = 0;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        if (strncmp(buf, "change@", 7) != 0) continue;
+        const char *dev = strrchr(buf, '/');
+        if (dev && strcmp(dev, "/lcd-backlight") == 0) backlight = 1;
+        for (const char *p = buf; p < buf + n; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=backlight") == 0) backlight = 1;
+        }
+    }
+    if (!backlight) return;
+    screen_push_seen("uevent");
+    screen_check();
+}
+
+// 订阅内核 uevent 广播 (组 1)；失败时 (SELinux 等) 返回 -1，继续用定时检查
+int uevent_open() {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) return -1;
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || loop_add(fd, on_uevent) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 初始化屏幕状态检测 (在前台检测和轮询定时器之后调用)
+void screen_init() {
+    if (backlight_path[0] || find_backlight(backlight_path, sizeof(backlight_path))) {
+        backlight_fd = open(backlight_path, O_RDONLY | O_CLOEXEC);
+    }
+    // 背光变化的通知来源依次为 EPOLLPRI、uevent；都没有触发过时由屏幕定时器检查 (背光节点或 dumpsys power)
+    int pri = -1;
+    if (backlight_fd >= 0) {
+        log_msg("Screen state / 屏幕状态: %s", backlight_path);
+        // 普通文件 (主机测试) 不支持 epoll，只靠 uevent 和定时检查
+        pri = loop_add_events(backlight_fd, EPOLLPRI, on_backlight);
+    } else {
+        backlight_path[0] = '\0';
+        log_msg("Screen state / 屏幕状态: dumpsys power (no backlight node)");
+    }
+    uevent_fd = uevent_open();
+    log_msg("Screen events / 屏幕事件: EPOLLPRI %s, uevent %s", pri == 0 ? "registered" : "unavailable",
+        uevent_fd >= 0 ? "registered" : "unavailable");
+
+    screen_timer_fd = timer_create_fd();
+    if (screen_timer_fd < 0 || loop_add(screen_timer_fd, on_screen_timer) < 0) {
+        log_msg("Error creating screen timer / 创建屏幕定时器失败: %s", strerror(errno));
+        return;
+    }
+    screen_changed_us = now_us();
+    wakeups_at_change = loop_wakeups;
+
+    screen_poll_cur_ms = screen_poll_ms;
+    screen_timer_update();
+    screen_check();
+}
+
+// 配置文件名过滤：只有 mode.txt / daemon.conf 的变化需要重载
+int is_config_file(const char *name) {
+    return strcmp(name, "mode.txt") == 0 || strcmp(name, "daemon.conf") == 0;
+}
+
+int is_fg_watch(int wd) {
+    for (int i = 0; i < fg_wd_count; i++) {
+        if (fg_wds[i] == wd) return 1;
+    }
+    return 0;
+}
+
+void on_inotify(int fd, uint32_t events) {
+    (void)events;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int len = read(fd, buffer, sizeof(buffer));
+    int fg_changed = 0;
+    for (int off = 0; off < len; ) {
+        struct inotify_event *ev = (struct inotify_event *)(buffer + off);
+        if (is_fg_watch(ev->wd)) {
+            fg_changed = 1;
+        } else if (ev->wd == config_wd) {
+            if (ev->len == 0 || !is_config_file(ev->name)) {
+                events_filtered++;
+            } else if (config_reload_armed) {
+                // 写入/重命名的一串事件合并为一次重载，每个事件都会重新计时
+                events_coalesced++;
+                timer_arm(config_timer_fd, CONFIG_DEBOUNCE_MS, 0);
+            } else {
+                config_reload_armed = 1;
+                timer_arm(config_timer_fd, CONFIG_DEBOUNCE_MS, 0);
+            }
+        }
+        off += sizeof(struct inotify_event) + ev->len;
+    }
+    if (fg_changed) {
+        // 亮屏时 top-app 通常也会变化，熄屏期间借这个事件检查一次屏幕状态
+        if (screen_state == SCREEN_OFF) {
+            screen_check();
+            return;
+        }
+        update_foreground_from_cgroup();
+        evaluate_foreground();
+    }
+}
+
+// 去抖窗口结束：文件已写完，重载一次
+void on_config_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    config_reload_armed = 0;
+    log_msg("Config change detected via inotify / 检测到配置变更.");
+    long long before = reloads_done;
+    load_config(module_path, 0);
+    input_sync();
+    env_sync();
+    energy_sync();
+    thermal_sync();
+    sched_sync();
+    log_msg("Config reloads / 配置重载: %lld done, %lld avoided (filtered %lld, coalesced %lld, unchanged %lld), %lld rejected",
+        reloads_done, events_filtered + events_coalesced + reloads_unchanged,
+        events_filtered, events_coalesced, reloads_unchanged, reloads_rejected);
+    if (reloads_done != before) evaluate_foreground();
+}
+
+// 1 秒轮询：dumpsys 前台检测，以及 inotify 不可用时的配置检查
+void on_poll_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    if (inotify_fd < 0) {
+        static long long last_config_check = 0;
+        long long now = now_us();
+        if (now - last_config_check > 5000000LL) {
+            load_config(module_path, 0);
+            input_sync();
+            env_sync();
+            energy_sync();
+            thermal_sync();
+            sched_sync();
+            last_config_check = now;
+        }
+    }
+    if (backlight_fd >= 0 && screen_check()) return;
+    if (fg_backend == FG_BACKEND_DUMPSYS) evaluate_foreground();
+}
+
+void on_ramp_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    ramp_step();
+}
+void on_verify_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    verify_check();
+}
+void on_stats_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    stats_save();
+    cpu_check();
+}
+
+// 校验用的 dumpsys 输出读完后解析：与缓存的模式表不一致时替换并重写缓存
+void on_validate_dump(DumpBuffer *buf, long len, long long start_us) {
+    (void)start_us;
+    static SfDump dump;
+    dump.mode_count = 0;
+    if (len > 0) parse_sf_dump(buf->data, buf->len, &dump);
+    if (dump.mode_count == 0) {
+        // dumpsys 暂时不可用，保留缓存结果
+        log_msg("Mode cache validation skipped / 模式缓存校验跳过: dumpsys failed");
+        return;
+    }
+
+    DisplayMode cached[MAX_MODES];
+    int cached_count = mode_count;
+    memcpy(cached, modes, cached_count * sizeof(DisplayMode));
+    install_modes(&dump);
+    if (mode_count == cached_count && memcmp(modes, cached, cached_count * sizeof(DisplayMode)) == 0) {
+        log_msg("Mode cache validated / 模式缓存校验通过");
+        return;
+    }
+
+    log_msg("Mode cache mismatch, refreshed / 模式缓存与实际不符，已更新 (%d modes)", mode_count);
+    for (int i = 0; i < mode_count; i++) {
+        log_msg("ID: %d, FPS: %d, Res: %dx%d", modes[i].id, modes[i].fps, modes[i].width, modes[i].height);
+    }
+    prev_mode_count = cached_count;
+    memcpy(prev_modes, cached, cached_count * sizeof(DisplayMode));
+    save_mode_cache();
+    if (!is_valid_mode(current_mode_id)) current_mode_id = -1;
+    // 配置中的模式键按新的模式表重新解析
+    load_config(module_path, 1);
+    evaluate_foreground();
+}
+
+// 后台校验缓存的模式表：dumpsys 在事件循环上异步读取，期间照常处理前台切换
+void on_validate_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    static DumpBuffer validate_buf;
+    char *const argv[] = { "dumpsys", "SurfaceFlinger", NULL };
+    if (exec_running(on_validate_dump)) return;
+    if (exec_async(argv, &validate_buf, NULL, on_validate_dump) < 0) on_validate_dump(&validate_buf, -1, 0);
+}
+
+// SIGTERM/SIGINT 退出，SIGHUP 重载配置
+void on_signal(int fd, uint32_t events) {
+    (void)events;
+    struct signalfd_siginfo si;
+    if (read(fd, &si, sizeof(si)) != sizeof(si)) return;
+    if (si.ssi_signo == SIGHUP) {
+        log_msg("SIGHUP: reloading config / 重载配置");
+        load_config(module_path, 1);
+        input_sync();
+        env_sync();
+        energy_sync();
+        thermal_sync();
+        sched_sync();
+        settings_cache_reset();
+        if (ramp_target == -1 && current_mode_id != -1) sync_android_settings(current_mode_id);
+        evaluate_foreground();
+    } else {
+        log_msg("Signal %d received, exiting / 收到信号，退出", (int)si.ssi_signo);
+        running = 0;
     }
+}
 
-    mode_count = 0;
-    while (fgets(line, sizeof(line), fp) != NULL && mode_count < MAX_MODES) {
-        // 查找关键字段: id=, resolution=, vsyncRate=
-        // 示例: 
-        // Display 0 HWC layers:
-        // ... id=0, ... resolution=1264x2780 ... vsyncRate=120.000000
-        // 注意：不同设备输出格式可能略有不同，但这些关键字通常存在
-        
-        char *p_id = strstr(line, "id=");
-        char *p_res = strstr(line, "resolution=");
-        char *p_fps = strstr(line, "vsyncRate=");
-        
-        if (p_id && p_res && p_fps) {
-            int id = atoi(p_id + 3);
-            
-            // 解析分辨率 resolution=WxH
-            int w = 0, h = 0;
-            sscanf(p_res + 11, "%dx%d", &w, &h);
-            
-            float fps_f = atof(p_fps + 10);
-            
-            if (w > 0 && h > 0 && fps_f > 0) {
-                // 查重
-                int exists = 0;
-                for(int k=0; k<mode_count; k++) {
-                    if(modes[k].id == id) { exists=1; break; }
-                }
-                if(!exists) {
-                    modes[mode_count].id = id;
-                    modes[mode_count].width = w;
-                    modes[mode_count].height = h;
-                    modes[mode_count].fps = (int)(fps_f + 0.5);
-                    mode_count++;
-                }
-            }
+// 向所有订阅连接推送一行事件 (发送失败或对端缓冲区已满的订阅者直接断开)
+void ctl_notify(const char *fmt, ...) {
+    if (ctl_fd < 0) return;
+    int any = 0;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctl_clients[i].fd >= 0 && ctl_clients[i].subscribed) any = 1;
+    }
+    if (!any) return;
+
+    char line[CTL_LINE_MAX * 2];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n > (int)sizeof(line) - 2) n = sizeof(line) - 2;
+    line[n++] = '\n';
+
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        CtlClient *c = &ctl_clients[i];
+        if (c->fd < 0 || !c->subscribed) continue;
+        if (send(c->fd, line, n, MSG_NOSIGNAL | MSG_DONTWAIT) != n) {
+            loop_del(c->fd);
+            close(c->fd);
+            c->fd = -1;
         }
     }
-    pclose(fp);
-    
-    // 按 ID 排序 (冒泡排序)
-    for (int i = 0; i < mode_count - 1; i++) {
-        for (int j = 0; j < mode_count - i - 1; j++) {
-            if (modes[j].id > modes[j+1].id) {
-                DisplayMode temp = modes[j];
-                modes[j] = modes[j+1];
-                modes[j+1] = temp;
-            }
+}
+
+void ctl_close(CtlClient *c) {
+    loop_del(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    c->subscribed = 0;
+    c->len = 0;
+}
+
+// 回复一行 JSON (自动追加换行)
+void ctl_reply(CtlClient *c, const char *fmt, ...) {
+    char line[4096];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n > (int)sizeof(line) - 2) n = sizeof(line) - 2;
+    line[n++] = '\n';
+    ssize_t w = send(c->fd, line, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)w;
+}
+
+// 发送较大的回复 (超过 ctl_reply 的单行缓冲)，socket 缓冲区满时最多等待 1 秒
+void ctl_send(CtlClient *c, const char *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = send(c->fd, data + off, len - off, MSG_NOSIGNAL);
+        if (w > 0) {
+            off += w;
+            continue;
         }
+        struct pollfd pfd = { c->fd, POLLOUT, 0 };
+        if (w < 0 && errno == EAGAIN && poll(&pfd, 1, 1000) > 0) continue;
+        return;
     }
+}
 
-    log_msg("Loaded %d display modes (HWC) / 已加载 %d 个显示模式 (HWC):", mode_count);
-    for(int i=0; i<mode_count; i++) {
-        log_msg("ID: %d, FPS: %d, Res: %dx%d", modes[i].id, modes[i].fps, modes[i].width, modes[i].height);
+// 把未写回的修改叠加到当前配置 (load_config 重新解析文件后也会调用)
+void ctl_apply_pending() {
+    if (ctl_pending_default != -1) default_mode_id = ctl_pending_default;
+    if (ctl_pending_count == 0) return;
+    if (!app_table) app_table = app_table_new(64);
+    if (!app_table) return;
+    for (int i = 0; i < ctl_pending_count; i++) {
+        app_table_set(app_table, ctl_pending[i].pkg, ctl_pending[i].mode_id);
     }
 }
 
-// 读取配置文件
-void load_config(const char* base_path) {
-    char config_path[512];
-    snprintf(config_path, sizeof(config_path), "%s/config/mode.txt", base_path);
-    
-    FILE *fp = fopen(config_path, "r");
-    if (fp == NULL) return;
+// 把控制 socket 的修改写回 mode.txt
+// 只改动涉及的行，注释和其他行原样保留；先写临时文件再 rename
+void persist_config() {
+    if (ctl_pending_default == -1 && ctl_pending_count == 0) return;
 
-    char line[256];
-    app_config_count = 0;
-    int line_num = 0;
+    char path[512], tmp[520];
+    snprintf(path, sizeof(path), "%s/config/mode.txt", module_path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
 
-    while (fgets(line, sizeof(line), fp) != NULL) {
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        log_msg("Cannot write / 无法写入 %s: %s", tmp, strerror(errno));
+        return;
+    }
+    FILE *in = fopen(path, "r");
+    // 新文件沿用原文件的权限和属主 (守护进程以 root 运行，不能让策略文件变成所有人可写)
+    struct stat st;
+    if (in && fstat(fileno(in), &st) == 0) {
+        fchmod(fileno(out), st.st_mode & 07777);
+        if (fchown(fileno(out), st.st_uid, st.st_gid) < 0) {}
+    } else {
+        fchmod(fileno(out), 0644);
+    }
+
+    int written[CTL_MAX_PENDING] = {0};
+    int line_num = 0;
+    char line[256];
+    char key[32];       // 写回 WxH@fps，重刷 DTBO 后仍有效
+    while (in && fgets(line, sizeof(line), in) != NULL) {
         char *trimmed = trim(line);
-        if (strlen(trimmed) == 0 || trimmed[0] == '#') continue;
+        if (strlen(trimmed) == 0 || trimmed[0] == '#') {
+            fprintf(out, "%s\n", trimmed);
+            continue;
+        }
 
         line_num++;
         if (line_num == 1) {
-            // 第一行：全局默认ID
-            default_mode_id = atoi(trimmed);
-        } else {
-            // 后续行：包名 模式ID
-            // 支持 pkg=id 或 pkg id 格式
-            char *eq = strchr(trimmed, '=');
-            if (eq) *eq = ' '; // 将等号替换为空格以便 sscanf 解析
-
-            char pkg[MAX_PKG_LEN];
-            int mid;
-            if (sscanf(trimmed, "%s %d", pkg, &mid) == 2) {
-                if (app_config_count < MAX_APPS) {
-                    strncpy(app_configs[app_config_count].package, pkg, MAX_PKG_LEN);
-                    app_configs[app_config_count].mode_id = mid;
-                    app_config_count++;
-                }
-            }
+            if (ctl_pending_default != -1) fprintf(out, "%s\n", mode_key_of(ctl_pending_default, key, sizeof(key)));
+            else fprintf(out, "%s\n", trimmed);
+            continue;
         }
-    }
-    fclose(fp);
-    log_msg("Config loaded / 配置已加载. Default: %d, Apps: %d", default_mode_id, app_config_count);
-}
 
-// 获取当前系统模式ID
-int get_current_system_mode() {
-    // 匹配 HWC 输出的当前活动配置
-    // HWC 通常不直接标记 "mActiveMode"，我们需要找到 config=... 或类似的
-    // 但 service call 需要的 ID 就是 HWC ID
-    // 简单起见，我们假设 dumpsys SurfaceFlinger 中 activeConfig=ID
-    // 或者直接返回 -1 让 smooth_switch 初始化
-    
-    // 尝试解析 dumpsys SurfaceFlinger | grep "activeConfig"
-    // 示例: activeConfig=0
-    FILE *fp = popen("dumpsys SurfaceFlinger | grep \"activeConfig=\"", "r");
-    if (fp) {
-        char line[64];
-        if (fgets(line, sizeof(line), fp)) {
-            int id;
-            if (sscanf(line, "activeConfig=%d", &id) == 1) {
-                pclose(fp);
-                // 此时获取的是 config ID (即 HWC ID)
-                // 我们的 modes[i].id 也是 HWC ID，所以直接返回
-                return id;
+        // 包名是第一个 '=' 或空白之前的部分
+        size_t len = strcspn(trimmed, "= \t");
+        int idx = -1;
+        for (int i = 0; i < ctl_pending_count; i++) {
+            if (strlen(ctl_pending[i].pkg) == len && strncmp(ctl_pending[i].pkg, trimmed, len) == 0) {
+                idx = i;
+                break;
             }
         }
-        pclose(fp);
+        // 条件规则行原样保留，set-app 只修改普通映射
+        if (idx < 0 || strstr(trimmed, " if ")) {
+            fprintf(out, "%s\n", trimmed);
+            continue;
+        }
+        // 删除，或同一包名的重复行
+        if (written[idx] || ctl_pending[idx].mode_id == -1) {
+            written[idx] = 1;
+            continue;
+        }
+        // 保留模式ID之后的内容
+        const char *rest = trimmed + len;
+        rest += strspn(rest, "= \t");
+        rest += strcspn(rest, " \t");
+        fprintf(out, "%s=%s%s\n", ctl_pending[idx].pkg, mode_key_of(ctl_pending[idx].mode_id, key, sizeof(key)), rest);
+        written[idx] = 1;
     }
-    
-    // 如果找不到 activeConfig，尝试旧方法或直接返回 -1
-    // 旧方法: dumpsys display | grep mActiveMode (针对 Android Framework 层 ID)
-    // 注意：Framework ID = HWC ID + 1 (通常)
-    // 如果我们现在全面转为 HWC ID，则需要小心
-    
-    return -1;
-}
+    if (in) fclose(in);
 
-// 平滑切换核心逻辑
-void smooth_switch(int target_id) {
-    if (current_mode_id == -1) {
-        // 首次启动，尝试获取当前系统状态
-        int actual = get_current_system_mode();
-        if (actual != -1) {
-            current_mode_id = actual;
-            log_msg("Initialized current mode from system / 从系统初始化当前模式: %d", current_mode_id);
-        } else {
-            // 获取失败，直接设置并假设成功
-            log_msg("First switch (unknown current) / 首次切换 (当前未知): -> %d", target_id);
-            set_surface_flinger(target_id);
-            sync_android_settings(target_id);
-            current_mode_id = target_id;
-            return;
+    if (line_num == 0) {
+        fprintf(out, "%s\n", mode_key_of(ctl_pending_default != -1 ? ctl_pending_default : default_mode_id, key, sizeof(key)));
+    }
+    for (int i = 0; i < ctl_pending_count; i++) {
+        if (!written[i] && ctl_pending[i].mode_id != -1) {
+            fprintf(out, "%s=%s\n", ctl_pending[i].pkg, mode_key_of(ctl_pending[i].mode_id, key, sizeof(key)));
         }
     }
 
-    if (current_mode_id == target_id) return;
-    
-    int current_width = get_mode_width(current_mode_id);
-    int target_width = get_mode_width(target_id);
-    
-    // 如果无法获取宽度（无效ID），直接切换
-    if (current_width == 0 || target_width == 0) {
-        log_msg("Invalid width / 无效宽度 (curr=%d, target=%d). Direct switch / 直接切换.", current_width, target_width);
-        set_surface_flinger(target_id);
-        sync_android_settings(target_id);
-        current_mode_id = target_id;
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        log_msg("Cannot save config / 配置写回失败: %s", strerror(errno));
+        unlink(tmp);
         return;
     }
+    // 内存中已是最新配置，记下文件哈希，随后的 inotify 事件不会再重新解析
+    mode_txt_hash = file_hash(path);
+    log_msg("Config persisted / 配置已写回: %d app changes%s", ctl_pending_count,
+        ctl_pending_default != -1 ? ", default" : "");
+    ctl_pending_count = 0;
+    ctl_pending_default = -1;
+}
 
-    if (current_width != target_width) {
-        log_msg("Resolution change / 分辨率变更: %d -> %d. Direct switch / 直接切换.", current_mode_id, target_id);
-        set_surface_flinger(target_id);
-        sync_android_settings(target_id);
-        current_mode_id = target_id;
-        return;
+// 记录一条应用配置修改，延迟 CONFIG_PERSIST_MS 批量写回 (期间的新修改会重新计时)
+void ctl_queue_change(const char *pkg, int mode_id) {
+    int idx = -1;
+    for (int i = 0; i < ctl_pending_count; i++) {
+        if (strcmp(ctl_pending[i].pkg, pkg) == 0) idx = i;
     }
+    if (idx < 0) {
+        if (ctl_pending_count == CTL_MAX_PENDING) persist_config();
+        idx = ctl_pending_count++;
+        strncpy(ctl_pending[idx].pkg, pkg, MAX_PKG_LEN - 1);
+        ctl_pending[idx].pkg[MAX_PKG_LEN - 1] = '\0';
+    }
+    ctl_pending[idx].mode_id = mode_id;
+    timer_arm(persist_timer_fd, CONFIG_PERSIST_MS, 0);
+}
 
-    log_msg("Smooth Switch / 平滑切换: %d -> %d", current_mode_id, target_id);
+void on_persist_timer(int fd, uint32_t events) {
+    (void)events;
+    timer_drain(fd);
+    persist_config();
+}
 
-    // 获取按 FPS 排序的模式列表
-    int sorted_ids[MAX_MODES];
-    int count = 0;
-    get_sorted_fps_modes(target_width, sorted_ids, &count);
-    
-    // 查找当前和目标在排序列表中的位置
-    int idx_curr = -1;
-    int idx_target = -1;
-    
-    for (int i=0; i<count; i++) {
-        if (sorted_ids[i] == current_mode_id) idx_curr = i;
-        if (sorted_ids[i] == target_id) idx_target = i;
-    }
-    
-    if (idx_curr == -1) {
-        log_msg("Current mode %d not in sorted list / 当前模式不在排序列表中. Direct switch / 直接切换.", current_mode_id);
-        set_surface_flinger(target_id);
-        sync_android_settings(target_id);
-        current_mode_id = target_id;
-        return;
-    }
-    
-    if (idx_target == -1) {
-        log_msg("Target mode %d not in sorted list / 目标模式不在排序列表中. Direct switch / 直接切换.", target_id);
-        set_surface_flinger(target_id);
-        sync_android_settings(target_id);
-        current_mode_id = target_id;
+// 配置或强制模式变化后按当前前台应用重新决策 (不重新检测前台)
+void ctl_reevaluate() {
+    if (last_pkg[0]) apply_package_mode(last_pkg, 0);
+}
+
+// 执行一行命令
+void ctl_handle(CtlClient *c, char *line) {
+    char cmd[32] = "", arg1[MAX_PKG_LEN] = "", arg2[32] = "";
+    int argn = sscanf(line, "%31s %127s %31s", cmd, arg1, arg2);
+    if (argn < 1) {
+        ctl_reply(c, "{\"ok\":false,\"error\":\"empty command\"}");
         return;
     }
-    
-    // 逐步切换
-    if (idx_target > idx_curr) {
-        // 升频: current -> target
-        for (int i = idx_curr + 1; i <= idx_target; i++) {
-            log_msg("Step UP / 升频: %d", sorted_ids[i]); 
-            set_surface_flinger(sorted_ids[i]);
-            usleep(50000); // 50ms
+
+    if (strcmp(cmd, "get-state") == 0) {
+        ctl_reply(c, "{\"ok\":true,\"mode\":%d,\"fps\":%d,\"target\":%d,\"ramping\":%s,"
+            "\"package\":\"%s\",\"default\":%d,\"forced\":%d,\"apps\":%d,\"fg_backend\":\"%s\","
+            "\"reloads\":%lld,\"reloads_avoided\":%lld,\"screen\":\"%s\",\"wakeups\":%lld,\"wakeups_per_hour\":%lld,"
+            "\"idle\":%s,\"idle_drops\":%lld,\"idle_boosts\":%lld,\"content_rate\":%.2f,"
+            "\"temp\":%.1f,\"thermal_cap\":%d,\"rules\":%d,\"conditions\":\"0x%x\",\"battery\":%d,\"charging\":%s,"
+            "\"verified\":%lld,\"verify_retries\":%lld,\"verify_resyncs\":%lld,\"settle_us\":%lld,\"settle_max_us\":%lld,"
+            "\"settle_avg_us\":%lld,\"ramp_step_ms\":%d,\"power_mw\":%lld,"
+            "\"exec_calls\":%lld,\"exec_avg_us\":%lld,\"exec_max_us\":%lld,\"exec_spawn_avg_us\":%lld,"
+            "\"cpu_ms\":%lld,\"cpu_main_ms\":%lld,\"cpu_children_ms\":%lld,\"cpu_pct\":%.3f,\"sched_boosts\":%lld}",
+            current_mode_id, get_mode_fps(current_mode_id),
+            ramp_target != -1 ? ramp_target : current_mode_id, ramp_target != -1 ? "true" : "false",
+            last_pkg, default_mode_id, forced_mode_id, app_table ? app_table->count : 0,
+            fg_backend == FG_BACKEND_CGROUP ? "cgroup" : "dumpsys",
+            reloads_done, events_filtered + events_coalesced + reloads_unchanged,
+            screen_state == SCREEN_OFF ? "off" : "on", loop_wakeups,
+            loop_wakeups * 3600000000LL / (now_us() - daemon_start_us + 1),
+            touch_idle ? "true" : "false", idle_drops, idle_boosts, content_rate,
+            thermal_temp_mc / 1000.0, thermal_cap_fps, app_table ? app_table->rule_count : 0,
+            env_bits, battery_level, battery_charging ? "true" : "false",
+            verify_ok, verify_retries, verify_resyncs, settle_last_us, settle_max_us, settle_ewma_us,
+            ramp_step_tuned_ms > ramp_step_ms ? ramp_step_tuned_ms : ramp_step_ms,
+            energy_power_uw > 0 ? energy_power_uw / 1000 : -1,
+            exec_stats.count, exec_stats.count ? exec_stats.total_us / exec_stats.count : 0, exec_stats.max_us,
+            exec_stats.count ? exec_spawn_us / exec_stats.count : 0,
+            cpu_time_us(RUSAGE_SELF) / 1000, cpu_time_us(RUSAGE_THREAD) / 1000, cpu_time_us(RUSAGE_CHILDREN) / 1000,
+            (cpu_time_us(RUSAGE_SELF) + cpu_time_us(RUSAGE_CHILDREN)) * 100.0 / (now_us() - daemon_start_us + 1),
+            sched_boosts);
+    } else if (strcmp(cmd, "list-modes") == 0) {
+        char buf[3584];
+        int off = snprintf(buf, sizeof(buf), "{\"ok\":true,\"modes\":[");
+        for (int i = 0; i < mode_count && off < (int)sizeof(buf) - 80; i++) {
+            off += snprintf(buf + off, sizeof(buf) - off, "%s{\"id\":%d,\"fps\":%d,\"width\":%d,\"height\":%d}",
+                i ? "," : "", modes[i].id, modes[i].fps, modes[i].width, modes[i].height);
         }
-    } else {
-        // 降频: current -> target
-        for (int i = idx_curr - 1; i >= idx_target; i--) {
-            log_msg("Step DOWN / 降频: %d", sorted_ids[i]); 
-            set_surface_flinger(sorted_ids[i]);
-            usleep(50000); // 50ms
+        snprintf(buf + off, sizeof(buf) - off, "]}");
+        ctl_reply(c, "%s", buf);
+    } else if (strcmp(cmd, "set-global") == 0 && argn >= 2) {
+        int exact;
+        int id = resolve_mode_key(arg1, &exact);
+        if (id == -1) {
+            ctl_reply(c, "{\"ok\":false,\"error\":\"invalid mode %s\"}", arg1);
+            return;
         }
+        default_mode_id = id;
+        ctl_pending_default = id;
+        timer_arm(persist_timer_fd, CONFIG_PERSIST_MS, 0);
+        log_msg("Control: global mode / 控制: 全局模式 -> %d", id);
+        ctl_reply(c, "{\"ok\":true}");
+        ctl_reevaluate();
+    } else if (strcmp(cmd, "set-app") == 0 && argn >= 3) {
+        int exact;
+        int id = strcmp(arg2, "-1") == 0 ? -1 : resolve_mode_key(arg2, &exact);
+        if (!is_valid_package(arg1) || (id == -1 && strcmp(arg2, "-1") != 0)) {
+            ctl_reply(c, "{\"ok\":false,\"error\":\"invalid package or mode\"}");
+            return;
+        }
+        ctl_queue_change(arg1, id);
+        ctl_apply_pending();
+        log_msg("Control: app mode / 控制: 应用模式 %s -> %d", arg1, id);
+        ctl_reply(c, "{\"ok\":true}");
+        ctl_reevaluate();
+    } else if (strcmp(cmd, "force-mode") == 0 && argn >= 2) {
+        int exact;
+        int id = strcmp(arg1, "-1") == 0 ? -1 : resolve_mode_key(arg1, &exact);
+        if (id == -1 && strcmp(arg1, "-1") != 0) {
+            ctl_reply(c, "{\"ok\":false,\"error\":\"invalid mode %s\"}", arg1);
+            return;
+        }
+        forced_mode_id = id;
+        log_msg("Control: force mode / 控制: 强制模式 %d", id);
+        ctl_reply(c, "{\"ok\":true}");
+        ctl_reevaluate();
+    } else if (strcmp(cmd, "get-stats") == 0) {
+        static DumpBuffer out;
+        stats_account();
+        stats_json(&out);
+        buf_append(&out, "\n");
+        if (out.data) ctl_send(c, out.data, out.len);
+    } else if (strcmp(cmd, "reset-stats") == 0) {
+        stats_account();
+        stats_app_count = 0;
+        stats_prev_app = -1;
+        memset(stats_mode_us, 0, sizeof(stats_mode_us));
+        memset(stats_mode_uj, 0, sizeof(stats_mode_uj));
+        memset(stats_hist, 0, sizeof(stats_hist));
+        stats_switches = 0;
+        stats_screen_off_us = 0;
+        energy_charging_us = 0;
+        energy_unknown_us = 0;
+        stats_since = time(NULL);
+        stats_dirty = 1;
+        stats_save();
+        log_msg("Control: stats reset / 控制: 统计已清零");
+        ctl_reply(c, "{\"ok\":true}");
+    } else if (strcmp(cmd, "subscribe") == 0) {
+        c->subscribed = 1;
+        ctl_reply(c, "{\"ok\":true}");
+    } else {
+        ctl_reply(c, "{\"ok\":false,\"error\":\"unknown command\"}");
     }
-    
-    current_mode_id = target_id;
-    sync_android_settings(target_id);
 }
 
-// 获取前台应用 (使用用户提供的优化逻辑)
-void get_foreground_app(char *buffer, int size) {
-    // 优先尝试 dumpsys window | grep mCurrentFocus
-    FILE* fp = popen("dumpsys window | grep mCurrentFocus", "r");
-    if (!fp) {
-        log_msg("get_foreground_app: popen failed / popen 失败");
-        strncpy(buffer, "unknown", size);
+// 客户端连接可读：凑齐一行后执行，非订阅连接回复后立即关闭
+void on_ctl_client(int fd, uint32_t events) {
+    (void)events;
+    CtlClient *c = NULL;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctl_clients[i].fd == fd) c = &ctl_clients[i];
+    }
+    if (!c) return;
+
+    ssize_t n = read(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        ctl_close(c);
         return;
     }
+    if (c->subscribed) return;  // 订阅后忽略输入
 
-    char line[1024];
-    char* last_valid = NULL;
+    c->len += n;
+    c->buf[c->len] = '\0';
+    char *nl = strchr(c->buf, '\n');
+    if (!nl) {
+        if (c->len >= (int)sizeof(c->buf) - 1) {
+            ctl_reply(c, "{\"ok\":false,\"error\":\"line too long\"}");
+            ctl_close(c);
+        }
+        return;
+    }
+    *nl = '\0';
+    ctl_handle(c, trim(c->buf));
+    if (c->subscribed) c->len = 0;
+    else ctl_close(c);
+}
 
-    while (fgets(line, sizeof(line), fp)) {
-        // 确保字符串以null结尾
-        line[sizeof(line) - 1] = '\0';
-        
-        char* start = strchr(line, '{');
-        char* end = strrchr(line, '}');  // 使用最后一个 } 作为结束点
+void on_ctl_accept(int fd, uint32_t events) {
+    (void)events;
+    while (1) {
+        int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) return;
 
-        if (start && end && end > start) {
-            // 提取 {} 之间的内容
-            size_t len = end - start - 1;
-            char inner[256];
-            if (len > 0 && len < sizeof(inner) - 1) {  // 预留null终止符空间
-                strncpy(inner, start + 1, len);
-                inner[len] = '\0';
+        CtlClient *c = NULL;
+        for (int i = 0; i < CTL_MAX_CLIENTS && !c; i++) {
+            if (ctl_clients[i].fd < 0) c = &ctl_clients[i];
+        }
+        if (!c || loop_add(cfd, on_ctl_client) < 0) {
+            const char *busy = "{\"ok\":false,\"error\":\"busy\"}\n";
+            ssize_t w = send(cfd, busy, strlen(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+            (void)w;
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        c->subscribed = 0;
+        c->len = 0;
+    }
+}
 
-                // 提取最后一个空格后的内容
-                char* last_space = strrchr(inner, ' ');
-                char* candidate = last_space ? last_space + 1 : inner;
+// 控制 socket 路径 <module>/daemon.sock
+int ctl_socket_path(const char *base, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/daemon.sock", base);
+    return n > 0 && n < (int)sizeof(addr->sun_path) ? 0 : -1;
+}
 
-                // 处理 PopupWindow: 前缀
-                char* popup_prefix = strstr(candidate, "PopupWindow:");
-                if (popup_prefix) {
-                    candidate = popup_prefix + 12;  // 跳过 "PopupWindow:"
-                }
+// 创建控制 socket 并加入事件循环，失败时只记录日志 (WebUI 回退为改写配置文件)
+void ctl_init() {
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) ctl_clients[i].fd = -1;
 
-                // 处理斜杠后的 activity 名
-                char* slash = strchr(candidate, '/');
-                if (slash) *slash = '\0';
+    struct sockaddr_un addr;
+    if (ctl_socket_path(module_path, &addr) < 0) {
+        log_msg("Control socket path too long / 控制 socket 路径过长");
+        return;
+    }
 
-                // 验证包名格式 - 必须包含点号且长度合理
-                size_t candidate_len = strlen(candidate);
-                if (candidate_len > 0 && candidate_len < MAX_PKG_LEN) {
-                    // 检查是否包含点号（有效包名特征）
-                    int has_dot = 0;
-                    int has_valid_chars = 1;
-
-                    for (char* p = candidate; *p; p++) {
-                        if (*p == '.') has_dot = 1;
-                        // 检查是否只包含合法字符（字母、数字、点、下划线）
-                        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '_') {
-                            has_valid_chars = 0;
-                            break;
-                        }
-                    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
 
-                    // 有效包名必须包含点号，长度至少为3，且包含合法字符
-                    if (has_dot && has_valid_chars && candidate_len >= 3) {
-                        // 安全地分配新内存
-                        char* new_valid = strdup(candidate);
-                        if (new_valid) {
-                            // 释放之前的内存
-                            if (last_valid) free(last_valid);
-                            last_valid = new_valid;
-                        }
-                    }
-                }
-            }
-        }
+    // 能连上说明另一个实例还在运行，不抢占它的 socket
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        log_msg("Control socket in use by another instance / 控制 socket 已被占用: %s", addr.sun_path);
+        close(probe);
+        close(fd);
+        return;
     }
-    pclose(fp);
+    if (probe >= 0) close(probe);
 
-    // 返回最后一个有效包名或 unknown
-    if (last_valid) {
-        strncpy(buffer, last_valid, size);
-        buffer[size - 1] = '\0';
-        free(last_valid);
-    } else {
-        strncpy(buffer, "unknown", size);
-        buffer[size - 1] = '\0';
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, CTL_MAX_CLIENTS) < 0) {
+        log_msg("Control socket bind failed / 控制 socket 创建失败: %s", strerror(errno));
+        close(fd);
+        return;
     }
-}
+    chmod(addr.sun_path, 0660);
 
-// 检查模式是否有效
-int is_valid_mode(int id) {
-    for (int i=0; i<mode_count; i++) {
-        if (modes[i].id == id) return 1;
+    persist_timer_fd = timer_create_fd();
+    if (persist_timer_fd < 0 || loop_add(persist_timer_fd, on_persist_timer) < 0 || loop_add(fd, on_ctl_accept) < 0) {
+        log_msg("Control socket disabled / 控制 socket 不可用");
+        if (persist_timer_fd >= 0) close(persist_timer_fd);
+        persist_timer_fd = -1;
+        close(fd);
+        unlink(addr.sun_path);
+        return;
     }
-    return 0;
+    ctl_fd = fd;
+    strncpy(ctl_path, addr.sun_path, sizeof(ctl_path) - 1);
+    log_msg("Control socket / 控制 socket: %s", ctl_path);
 }
 
-// 获取模式的宽度
-int get_mode_width(int id) {
-    for (int i=0; i<mode_count; i++) {
-        if (modes[i].id == id) return modes[i].width;
+// 退出前写回未保存的修改并删除 socket
+void ctl_shutdown() {
+    persist_config();
+    if (ctl_fd < 0) return;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        if (ctl_clients[i].fd >= 0) close(ctl_clients[i].fd);
     }
-    return 0;
+    close(ctl_fd);
+    if (persist_timer_fd >= 0) close(persist_timer_fd);
+    unlink(ctl_path);
 }
 
-// 执行 SurfaceFlinger 调用
-void set_surface_flinger(int id) {
-    char cmd[64];
-    // 现在的 ID 直接来自 HWC (dumpsys SurfaceFlinger)，不需要 -1
-    // service call SurfaceFlinger 1035 i32 <HWC_ID>
-    int sf_id = id; 
-    
-    snprintf(cmd, sizeof(cmd), "service call SurfaceFlinger 1035 i32 %d > /dev/null", sf_id);
-    system(cmd);
-}
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "bench-parse") == 0) {
+        return bench_parse(argv[2], argc >= 4 ? atoi(argv[3]) : 100);
+    }
+    if (argc >= 4 && strcmp(argv[1], "content-match") == 0) {
+        return content_match_file(argv[2], argv[3], argc >= 5 ? atoi(argv[4]) : -1);
+    }
+    if (argc >= 3 && strcmp(argv[1], "bench-log") == 0) {
+        return bench_log(argv[2], argc >= 4 ? atoi(argv[3]) : 10000);
+    }
+    if (argc >= 4 && strcmp(argv[1], "ctl") == 0) {
+        return ctl_client(argv[2], argc - 3, argv + 3);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench-index") == 0) {
+        return bench_index(argc >= 3 ? atoi(argv[2]) : 5000, argc >= 4 ? atoi(argv[3]) : 100000);
+    }
+    if (argc >= 3 && strcmp(argv[1], "stats") == 0) {
+        return stats_dump(argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench-exec") == 0) {
+        return bench_exec(argc >= 3 ? atoi(argv[2]) : 20, argc > 3 ? argc - 3 : 0, argv + 3);
+    }
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+        return replay_run(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench-rules") == 0) {
+        return bench_rules(argc >= 3 ? atoi(argv[2]) : 10000, argc >= 4 ? atoi(argv[3]) : 100000);
+    }
 
-// 同步 Android 系统设置 (User Request)
-void sync_android_settings(int id) {
-    int fps = 0;
-    for(int i=0; i<mode_count; i++) {
-        if(modes[i].id == id) {
-            fps = modes[i].fps;
-            break;
-        }
+    if (argc < 2) {
+        printf("Usage: %s <module_path> [options]\n", argv[0]);
+        printf("       %s ctl <module_path> get-state|get-stats|reset-stats|list-modes|set-global <id>|set-app <pkg> <id>|force-mode <id>|subscribe\n", argv[0]);
+        printf("       %s stats <module_path>\n", argv[0]);
+        printf("       %s replay <record_file> [--config=DIR] [--calls=PATH] [--json] [--verbose]\n", argv[0]);
+        printf("       %s content-match <dump_file> <package> [app_mode_id]\n", argv[0]);
+        printf("       %s bench-parse <dump_file> [iterations]\n", argv[0]);
+        printf("       %s bench-index [apps] [lookups]\n", argv[0]);
+        printf("       %s bench-rules [rules] [lookups]\n", argv[0]);
+        printf("       %s bench-log <dir> [messages]\n", argv[0]);
+        printf("       %s bench-exec [iterations] [program args...]\n", argv[0]);
+        printf("  --fg-backend=auto|cgroup|dumpsys   前台应用检测方式\n");
+        printf("  --top-app=PATH                     top-app cgroup.procs 路径\n");
+        printf("  --proc-root=PATH                   /proc 根目录 (测试用)\n");
+        printf("  --sf-backend=shell|system|fake:PATH  模式切换方式\n");
+        printf("  --dtbo=PATH                        DTBO 分区路径 (模式缓存键)\n");
+        printf("  --wait-boot                        等待 sys.boot_completed=1 后再开始\n");
+        printf("  --prop-dir=PATH                    属性目录 (测试用，代替属性服务)\n");
+        printf("  --sys-root=PATH                    sysfs 根目录 (测试用)\n");
+        printf("  --backlight=PATH                   背光亮度节点 (屏幕状态)\n");
+        printf("  --input=PATH                       触摸输入设备或录制的事件流 (空闲降频)\n");
+        printf("  --power-supply=PATH                电池 power_supply 目录 (能耗统计)\n");
+        printf("  --trace=PATH                       输出 Chrome trace-event JSON (Perfetto 可打开)\n");
+        printf("  --record=PATH                      录制前台应用/配置/模式表，供 replay 回放\n");
+        return 1;
     }
     
-    if(fps > 0) {
-        char cmd[1024];
-        snprintf(cmd, sizeof(cmd), 
-            "settings put secure support_highfps 1;"
-            "settings put system peak_refresh_rate %d;"
-            "settings put system user_refresh_rate %d;"
-            "settings put system min_refresh_rate %d;"
-            "settings put system default_refresh_rate %d;"
-            "settings put global debug.cpurend.vsync true;"
-            "settings put global hwui.disable_vsync false",
-            fps, fps, fps, fps);
-        system(cmd);
-        log_msg("Synced system settings to %dHz / 已同步系统设置到 %dHz", fps, fps);
-    }
-}
-
-// 获取指定分辨率下按FPS排序的模式列表
-void get_sorted_fps_modes(int width, int *out_ids, int *out_count) {
-    typedef struct {
-        int id;
-        int fps;
-    } ModeInfo;
-    
-    ModeInfo temp_modes[MAX_MODES];
-    int count = 0;
-    
-    // 1. 筛选符合分辨率的模式
-    for (int i=0; i<mode_count; i++) {
-        if (modes[i].width == width) {
-            temp_modes[count].id = modes[i].id;
-            temp_modes[count].fps = modes[i].fps;
-            count++;
+    module_path = argv[1];
+    int wait_boot = 0;
+    const char *trace_path = NULL;
+    const char *record_path = NULL;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--fg-backend=cgroup") == 0) {
+            fg_backend = FG_BACKEND_CGROUP;
+        } else if (strcmp(argv[i], "--fg-backend=dumpsys") == 0) {
+            fg_backend = FG_BACKEND_DUMPSYS;
+        } else if (strcmp(argv[i], "--fg-backend=auto") == 0) {
+            fg_backend = FG_BACKEND_AUTO;
+        } else if (strncmp(argv[i], "--top-app=", 10) == 0) {
+            strncpy(top_app_path, argv[i] + 10, sizeof(top_app_path) - 1);
+        } else if (strncmp(argv[i], "--proc-root=", 12) == 0) {
+            strncpy(proc_root, argv[i] + 12, sizeof(proc_root) - 1);
+        } else if (strcmp(argv[i], "--wait-boot") == 0) {
+            wait_boot = 1;
+        } else if (strncmp(argv[i], "--prop-dir=", 11) == 0) {
+            strncpy(prop_dir, argv[i] + 11, sizeof(prop_dir) - 1);
+        } else if (strncmp(argv[i], "--sys-root=", 11) == 0) {
+            strncpy(sys_root, argv[i] + 11, sizeof(sys_root) - 1);
+        } else if (strncmp(argv[i], "--backlight=", 12) == 0) {
+            strncpy(backlight_path, argv[i] + 12, sizeof(backlight_path) - 1);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            record_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--power-supply=", 15) == 0) {
+            strncpy(power_supply_path, argv[i] + 15, sizeof(power_supply_path) - 1);
+        } else if (strncmp(argv[i], "--input=", 8) == 0) {
+            strncpy(input_path, argv[i] + 8, sizeof(input_path) - 1);
+        } else if (strncmp(argv[i], "--dtbo=", 7) == 0) {
+            strncpy(dtbo_path, argv[i] + 7, sizeof(dtbo_path) - 1);
+        } else if (strcmp(argv[i], "--sf-backend=shell") == 0) {
+            sf_backend = SF_BACKEND_SHELL;
+        } else if (strcmp(argv[i], "--sf-backend=system") == 0) {
+            sf_backend = SF_BACKEND_SYSTEM;
+        } else if (strncmp(argv[i], "--sf-backend=fake:", 18) == 0) {
+            sf_backend = SF_BACKEND_FAKE;
+            strncpy(sf_fake_path, argv[i] + 18, sizeof(sf_fake_path) - 1);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
         }
     }
-    
-    // 2. 按 FPS 升序排序
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = 0; j < count - i - 1; j++) {
-            if (temp_modes[j].fps > temp_modes[j+1].fps) {
-                ModeInfo temp = temp_modes[j];
-                temp_modes[j] = temp_modes[j+1];
-                temp_modes[j+1] = temp;
-            }
+#ifndef __ANDROID__
+    // 主机构建没有属性服务，只能等待 --prop-dir 目录中的替身属性
+    if (wait_boot && !prop_dir[0]) {
+        printf("Error: --wait-boot requires --prop-dir on non-Android builds / 非 Android 构建使用 --wait-boot 需要指定 --prop-dir\n");
+        return 1;
+    }
+#endif
+    printf("Rate Daemon started. Path: %s\n", module_path);
+
+    // 信号改由 signalfd 接收；必须在创建日志线程之前屏蔽，线程会继承信号屏蔽字
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);   // 常驻 shell 退出时 write 返回 EPIPE 而不是终止进程
+
+    daemon_start_us = now_us();
+    char log_path[512];
+    if (snprintf(log_path, sizeof(log_path), "%s/daemon.log", module_path) >= (int)sizeof(log_path) ||
+        log_init(log_path) < 0) {
+        printf("Error: cannot start logging / 无法启动日志: %s\n", strerror(errno ? errno : ENAMETOOLONG));
+        return 1;
+    }
+    if (trace_path) trace_open(trace_path);
+
+    // 等待开机完成 (代替 service.sh 中每秒一次的 getprop 轮询)
+    if (wait_boot) {
+        long long wait_start = now_us();
+        if (prop_wait("sys.boot_completed", "1") < 0) {
+            printf("Error: cannot wait for sys.boot_completed\n");
+            log_shutdown();
+            return 1;
         }
+        log_msg("Boot completed / 开机完成 (waited %lld ms)", (now_us() - wait_start) / 1000);
     }
     
-    // 3. 输出 ID
-    *out_count = count;
-    for (int i=0; i<count; i++) {
-        out_ids[i] = temp_modes[i].id;
+    // 1. 初始化：优先使用模式缓存，未命中时解析 dumpsys 并写入缓存
+    modes_from_cache = load_mode_cache();
+    if (!modes_from_cache) {
+        init_display_modes();
+        if (mode_count == 0) {
+            printf("Error: No display modes found.\n");
+            // 如果失败，尝试稍后重试或退出
+            log_shutdown();
+            return 1;
+        }
+        save_mode_cache();
     }
-}
-
 
+    // 2. 初始加载配置
+    if (record_path) record_open(record_path);
+    load_config(module_path, 1);
+    stats_load(module_path);
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <module_path>\n", argv[0]);
+    // 事件循环
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        log_msg("epoll_create1 failed / 创建 epoll 失败: %s", strerror(errno));
+        log_shutdown();
         return 1;
     }
-    
-    char *base_path = argv[1];
-    printf("Rate Daemon started. Path: %s\n", base_path);
-    
-    // 1. 初始化
-    init_display_modes();
-    if (mode_count == 0) {
-        printf("Error: No display modes found.\n");
-        // 如果失败，尝试稍后重试或退出
+
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd >= 0) loop_add(signal_fd, on_signal);
+
+    ramp_timer_fd = timer_create_fd();
+    if (ramp_timer_fd < 0 || loop_add(ramp_timer_fd, on_ramp_timer) < 0) {
+        log_msg("Error creating ramp timer / 创建阶梯定时器失败: %s", strerror(errno));
+        log_shutdown();
         return 1;
     }
-
-    // 2. 初始加载配置
-    load_config(base_path);
+    stats_timer_fd = timer_create_fd();
+    if (stats_timer_fd >= 0 && loop_add(stats_timer_fd, on_stats_timer) == 0) {
+        timer_arm(stats_timer_fd, STATS_FLUSH_MS, STATS_FLUSH_MS);
+    }
+    // 校验定时器创建失败时不做校验，不影响切换
+    verify_timer_fd = timer_create_fd();
+    if (verify_timer_fd >= 0 && loop_add(verify_timer_fd, on_verify_timer) < 0) {
+        close(verify_timer_fd);
+        verify_timer_fd = -1;
+    }
     
+    // 控制 socket (WebUI 通过 rate_daemon ctl 访问)
+    ctl_init();
+
     // 3. 初始设置
-    if (is_valid_mode(default_mode_id)) {
-        smooth_switch(default_mode_id);
-    } else {
-        if (mode_count > 0) {
-            default_mode_id = modes[0].id;
-            smooth_switch(default_mode_id);
+    if (!is_valid_mode(default_mode_id)) default_mode_id = modes[0].id;
+    record_event('I', "%d", modes_from_cache);
+    if (modes_from_cache) {
+        // 模式来自缓存：不读取当前模式，直接切换，避免启动时执行 dumpsys
+        log_msg("First switch (cached modes) / 首次切换 (缓存模式): -> %d", default_mode_id);
+        direct_switch(default_mode_id);
+
+        validate_timer_fd = timer_create_fd();
+        if (validate_timer_fd >= 0 && loop_add(validate_timer_fd, on_validate_timer) == 0) {
+            timer_arm(validate_timer_fd, MODE_VALIDATE_DELAY_MS, 0);
         }
+    } else {
+        smooth_switch(default_mode_id);
     }
 
-    char last_pkg[MAX_PKG_LEN] = "";
-    
     // 初始化 inotify
-    int inotify_fd = inotify_init();
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (inotify_fd < 0) {
         log_msg("Error initializing inotify / 初始化 inotify 失败: %s", strerror(errno));
         // 降级为纯轮询模式，不退出
@@ -535,15 +5141,17 @@ int main(int argc, char *argv[]) {
 
     // 监听 config 目录 (监听目录可以捕获文件被重命名/移动覆盖的情况)
     // 很多编辑器保存文件时是 "写新文件 -> 移动覆盖"，这会改变 inode
-    // 监听目录的 MOVED_TO 和 CREATE 事件能更好处理这种情况
-    // 同时也监听 MODIFY 以防直接写入
-    int wd = -1;
+    // 监听目录的 MOVED_TO 事件能更好处理这种情况
+    // 直接写入用 CLOSE_WRITE (写完关闭时触发一次，而不是每次 write 都触发 MODIFY)
+    // 事件按文件名过滤后进入去抖窗口，见 on_inotify
     char config_dir[512];
-    snprintf(config_dir, sizeof(config_dir), "%s/config", base_path);
+    snprintf(config_dir, sizeof(config_dir), "%s/config", module_path);
     
     if (inotify_fd >= 0) {
-        wd = inotify_add_watch(inotify_fd, config_dir, IN_MODIFY | IN_MOVED_TO | IN_CREATE);
-        if (wd < 0) {
+        config_timer_fd = timer_create_fd();
+        if (config_timer_fd >= 0) loop_add(config_timer_fd, on_config_timer);
+        config_wd = inotify_add_watch(inotify_fd, config_dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (config_wd < 0 || config_timer_fd < 0 || loop_add(inotify_fd, on_inotify) < 0) {
             log_msg("Error adding watch for / 添加监听失败 %s: %s", config_dir, strerror(errno));
             close(inotify_fd);
             inotify_fd = -1;
@@ -552,78 +5160,86 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // 4. 主循环
-    while (1) {
-        // 使用 select 实现 "等待事件 或 超时"
-        if (inotify_fd >= 0) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(inotify_fd, &fds);
-
-            struct timeval timeout;
-            timeout.tv_sec = 1;  // 1秒超时，用于检查前台应用
-            timeout.tv_usec = 0;
-
-            int ret = select(inotify_fd + 1, &fds, NULL, NULL, &timeout);
-
-            if (ret > 0 && FD_ISSET(inotify_fd, &fds)) {
-                // 有文件变化事件
-                char buffer[1024];
-                // 读取事件以清空缓冲区
-                int len = read(inotify_fd, buffer, sizeof(buffer));
-                // 只要有变动就重载配置 (简单粗暴但有效)
-                // 实际生产中可以解析 buffer 里的 struct inotify_event 检查是否是 mode.txt
-                // 但这里目录里没别的东西，直接重载也没问题
-                if (len > 0) {
-                    log_msg("Config change detected via inotify / 检测到配置变更.");
-                    load_config(base_path);
-                    // 稍微延时一点点，防止文件写入未完成
-                    usleep(10000); 
-                }
-            }
-            // 如果 ret == 0 (超时)，则继续执行下方的应用检查
-        } else {
-            // 降级模式：简单的 sleep
-            sleep(1);
-            // 只有在轮询模式下才需要定时检查配置
-            static time_t last_config_check = 0;
-            time_t now = time(NULL);
-            if (now - last_config_check > 5) {
-                load_config(base_path);
-                last_config_check = now;
-            }
+    // 前台检测：优先监听 top-app cgroup (进程移入/移出时触发 IN_MODIFY，见 watch_foreground_cgroup)，失败则回退 dumpsys 轮询
+    int want_cgroup = fg_backend != FG_BACKEND_DUMPSYS;
+    fg_backend = FG_BACKEND_DUMPSYS;
+    if (want_cgroup && inotify_fd >= 0 && init_foreground_cgroup()) {
+        if (watch_foreground_cgroup() == 0) {
+            fg_backend = FG_BACKEND_CGROUP;
+            log_msg("Foreground backend / 前台检测: cgroup (%s, %d watches)", top_app_path, fg_wd_count);
         }
+    }
+    if (fg_backend == FG_BACKEND_DUMPSYS) {
+        log_msg("Foreground backend / 前台检测: dumpsys");
+    }
 
-        // 获取前台应用
-        char current_pkg[MAX_PKG_LEN] = "";
-        get_foreground_app(current_pkg, sizeof(current_pkg));
+    // 轮询定时器：cgroup 后端且 inotify 正常时完全由事件驱动，不需要
+    if (fg_backend == FG_BACKEND_DUMPSYS || inotify_fd < 0) {
+        poll_timer_fd = timer_create_fd();
+        if (poll_timer_fd >= 0 && loop_add(poll_timer_fd, on_poll_timer) == 0) {
+            timer_arm(poll_timer_fd, POLL_INTERVAL_MS, POLL_INTERVAL_MS);
+        }
+    }
 
-        if (strlen(current_pkg) > 0) {
-            // 记录应用切换
-            if (strcmp(current_pkg, last_pkg) != 0) {
-                 log_msg("Detected App Change / 检测到应用切换: %s", current_pkg);
-                 strncpy(last_pkg, current_pkg, MAX_PKG_LEN);
-            }
+    screen_init();
+    input_sync();
+    env_sync();
+    energy_sync();
+    thermal_sync();
+    sched_sync();
+    evaluate_foreground();
 
-            // 总是检查是否需要切换，因为可能配置变了但应用没变
-            int target_id = default_mode_id;
-            for (int i=0; i<app_config_count; i++) {
-                if (strcmp(app_configs[i].package, current_pkg) == 0) {
-                    target_id = app_configs[i].mode_id;
-                    break;
-                }
-            }
-            
-                if (is_valid_mode(target_id) && target_id != current_mode_id) {
-                     smooth_switch(target_id);
-                }
-            
+    // 4. 主循环
+    struct epoll_event events[MAX_EVENT_SOURCES];
+    stats_account();
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENT_SOURCES, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_msg("epoll_wait failed / 等待事件失败: %s", strerror(errno));
+            break;
+        }
+        event_time_us = now_us();
+        loop_wakeups++;
+        for (int i = 0; i < n; i++) {
+            EventSource *src = (EventSource *)events[i].data.ptr;
+            if (src->handler) src->handler(src->fd, events[i].events);
         }
+        stats_account();
+        trace_flush();
+        if (sched_boosted && ramp_target == -1 && shell_queue_len == 0) sched_boost(0);
     }
-    // while loop end
     
-    // Cleanup (unreachable usually)
+    // Cleanup
+    ctl_shutdown();
+    stats_account();
+    stats_save();
+    if (stats_timer_fd >= 0) close(stats_timer_fd);
+    helper_stop();
     if (inotify_fd >= 0) close(inotify_fd);
+    if (poll_timer_fd >= 0) close(poll_timer_fd);
+    if (ramp_timer_fd >= 0) close(ramp_timer_fd);
+    exec_cancel(NULL);
+    if (verify_timer_fd >= 0) close(verify_timer_fd);
+    if (env_timer_fd >= 0) close(env_timer_fd);
+    energy_close();
+    if (energy_timer_fd >= 0) close(energy_timer_fd);
+    if (validate_timer_fd >= 0) close(validate_timer_fd);
+    if (config_timer_fd >= 0) close(config_timer_fd);
+    if (screen_timer_fd >= 0) close(screen_timer_fd);
+    if (backlight_fd >= 0) close(backlight_fd);
+    if (uevent_fd >= 0) close(uevent_fd);
+    input_close();
+    if (idle_timer_fd >= 0) close(idle_timer_fd);
+    if (content_timer_fd >= 0) close(content_timer_fd);
+    if (thermal_timer_fd >= 0) close(thermal_timer_fd);
+    if (thermal_fd >= 0) close(thermal_fd);
+    if (signal_fd >= 0) close(signal_fd);
+    close(epoll_fd);
+    trace_close();
+    record_close();
+    log_msg("Rate Daemon stopped / 守护进程已退出");
+    log_shutdown();
     
     return 0;
 }
@@ -0,0 +1,348 @@
+#ifndef RATE_DAEMON_H
+#define RATE_DAEMON_H
+
+// rate_daemon 各源文件共用的类型、全局变量和函数声明
+// rate_daemon.c: 守护进程 (事件循环、前台检测、模式切换)
+// ctl_client.c: ctl / stats 客户端命令
+// replay.c: 录制文件的离线回放
+// bench.c: content-match 和各项基准测试
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+#include <spawn.h>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+#define MAX_MODES 50
+#define MAX_MODE_ID 256
+#define MAX_PKG_LEN 128
+#define MAX_TOP_PIDS 256
+#define MAX_FG_WATCHES 4
+#define MAX_EVENT_SOURCES 48
+#define MAX_LAYERS 64
+#define MAX_LAYER_NAME 256
+#define PROP_VALUE_MAX_LEN 92
+#define MODE_CACHE_MAGIC 0x434D4452  // "RDMC"
+#define MODE_CACHE_VERSION 2        // 2: 附带上一份模式表
+#define MODE_VALIDATE_DELAY_MS 5000
+#define POLL_INTERVAL_MS 1000
+
+typedef struct {
+    int id;
+    int fps;
+    int width;
+    int height;
+} DisplayMode;
+
+// 模式索引：由 modes[] 一次性构建，之后只读
+// id -> 模式 / 所属阶梯 / 阶梯中的位置都是直接查表
+typedef struct {
+    int width;
+    int count;
+    int ids[MAX_MODES];         // 同一分辨率下按 FPS 升序
+} Ladder;
+
+typedef struct {
+    signed char by_id[MAX_MODE_ID];     // id -> modes[] 下标，-1 表示无此模式
+    signed char ladder_of[MAX_MODE_ID]; // id -> ladders[] 下标
+    signed char rung[MAX_MODE_ID];      // id -> 在阶梯中的位置
+    Ladder ladders[MAX_MODES];
+    int ladder_count;
+} ModeIndex;
+
+// 应用配置：包名 -> 模式ID 的开放寻址哈希表，包名统一存放在 names 中
+typedef struct {
+    uint32_t hash;
+    int mode_id;
+    int name_off;               // -1 表示空槽
+    int flags;                  // APP_FLAG_*，mode.txt 中模式ID之后的关键字
+    int rule_off;               // 条件规则在 rules[] 中的起始位置
+    int rule_count;
+} AppEntry;
+
+#define APP_FLAG_CONTENT 0x01   // "content": 按内容帧率匹配模式
+#define APP_FLAG_ACTIVITY 0x02  // 存在 pkg/activity 规则，决策时需要当前 activity
+
+// 条件规则: <键>=<模式ID> [content] if <条件>...，键为包名、包名/activity 或 *
+// 每个不同的条件谓词占 env_bits 的一位，规则编译成 (mask, want)，命中条件为 (env_bits & mask) == want
+// 同一个键的规则按文件顺序连续存放，决策时只扫描该键自己的几条，与规则总数无关
+#define MAX_RULE_PREDS 32
+
+enum {
+    PRED_CHARGING = 0,          // 正在充电 (Charging / Full)
+    PRED_BATTERY_LT,            // 电量 < a
+    PRED_TIME                   // 当天时间 (分钟) 在 [a, b) 内，a > b 表示跨越午夜
+};
+
+typedef struct {
+    int type;
+    int a;
+    int b;
+} RulePred;
+
+typedef struct {
+    uint32_t mask;
+    uint32_t want;
+    int mode_id;
+} Rule;
+
+typedef struct {
+    AppEntry *slots;
+    int cap;                    // 2 的幂
+    int count;
+    char *names;
+    int names_len;
+    int names_cap;
+    Rule *rules;                // 按键分段的条件规则
+    int rule_count;
+    RulePred preds[MAX_RULE_PREDS];
+    int pred_count;
+} AppTable;
+
+// dumpsys SurfaceFlinger 解析结果
+typedef struct {
+    char name[MAX_LAYER_NAME];  // 例如 com.foo/com.foo.MainActivity#123
+    float frame_rate;           // 图层的帧率投票，0 表示无投票
+} LayerInfo;
+
+typedef struct {
+    DisplayMode modes[MAX_MODES];
+    int mode_count;
+    int active_config;          // activeConfig=，-1 表示未找到
+    LayerInfo layers[MAX_LAYERS];
+    int layer_count;
+} SfDump;
+
+// 命令输出缓冲区，整块读取，跨调用复用
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} DumpBuffer;
+
+// 前台应用检测后端
+// cgroup: inotify 监听 top-app 的 cgroup.procs，pid -> /proc/<pid>/cmdline 得到包名 (事件驱动)
+// dumpsys: 每秒 dumpsys window | grep mCurrentFocus (兜底)
+enum {
+    FG_BACKEND_AUTO = 0,
+    FG_BACKEND_CGROUP,
+    FG_BACKEND_DUMPSYS,
+    FG_BACKEND_REPLAY           // 回放：前台应用来自录制文件
+};
+
+typedef void (*event_handler)(int fd, uint32_t events);
+
+// 屏幕状态：背光亮度节点为 0 视为熄屏，找不到节点时回退 dumpsys power
+// 熄屏期间暂停前台检测和模式切换，亮屏后立即重新下发当前应用的模式
+enum {
+    SCREEN_UNKNOWN = -1,
+    SCREEN_OFF = 0,
+    SCREEN_ON = 1
+};
+
+// SurfaceFlinger 模式切换后端
+// shell: 常驻 sh 协进程，每次切换只写一行命令 (默认)
+// system: 每次切换 system("service call ...")，旧实现
+// fake: 只把调用记录到文件，用于主机测试
+enum {
+    SF_BACKEND_SHELL = 0,
+    SF_BACKEND_SYSTEM,
+    SF_BACKEND_FAKE
+};
+
+// 每次切换调用的耗时统计 (微秒)
+typedef struct {
+    long long count;
+    long long total_us;
+    long long max_us;
+    long long last_us;
+} CallStats;
+
+#define LOG_FILE "/data/adb/modules/murongchaopin/daemon.log"
+#define LOG_RING_SIZE 65536
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 1000
+
+// 日志级别：低于 log_level 的消息直接丢弃 (log_debug 在格式化之前就判断，关闭时几乎没有开销)
+enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+// 异步日志：主线程格式化到环形缓冲区，后台线程定期批量写入文件
+typedef struct {
+    char buf[LOG_RING_SIZE];
+    size_t head;                // 写入位置 (单调递增，取模使用)
+    size_t tail;                // 已写出位置
+    long long dropped;          // 缓冲区满时丢弃的消息数
+    long long messages;
+    long long writes;           // write() 调用次数
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int fd;
+    char path[512];
+    int to_stdout;              // 手动运行 (终端) 时同时输出到 stdout
+    time_t stamp_sec;           // 时间戳缓存，同一秒内不再调用 localtime
+    char stamp[32];
+} AsyncLog;
+
+#define log_debug(...) do { if (log_level <= LOG_LEVEL_DEBUG) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+
+// mode.txt 的解析结果
+typedef struct {
+    int line_num;               // 非注释行数，0 表示空文件
+    int bad_lines;
+    int default_id;
+    int default_ok;
+    int nearest_keys;           // 就近匹配的 WxH@fps 键 (含按上一份模式表换算的失效 ID)
+    char default_key[32];       // 第一行原文，全局默认无效时用于日志
+} ConfigParse;
+
+// 控制 socket (<module>/daemon.sock) 一行命令的最大长度
+#define CTL_LINE_MAX 256
+
+// ---- rate_daemon.c 中定义，其他源文件使用 ----
+
+// 模式表与配置
+extern DisplayMode modes[MAX_MODES];
+extern int mode_count;
+extern int default_mode_id;
+extern char *module_path;
+extern long long reloads_done;
+extern int verify_switch;
+
+// 前台应用、屏幕与事件循环
+extern int fg_backend;
+extern char fg_pkg[MAX_PKG_LEN];
+extern char fg_focus[MAX_LAYER_NAME];
+extern int screen_state;
+extern long long event_time_us;
+extern long long loop_wakeups;
+extern int ramp_target;
+extern int ramp_timer_fd;
+
+// 条件规则环境与能耗
+extern int battery_level;
+extern int battery_charging;
+extern int energy_active;
+extern int energy_charging;
+extern long long energy_power_uw;
+extern long long energy_samples;
+extern long long energy_charging_us;
+extern long long energy_unknown_us;
+
+// 模式切换后端与调用统计
+extern int sf_backend;
+extern char sf_fake_path[256];
+extern CallStats sf_stats;
+extern CallStats exec_stats;
+extern long long exec_spawn_us;
+extern long long settings_batches;
+
+// 使用统计
+extern long long stats_mode_us[MAX_MODE_ID];
+extern long long stats_mode_uj[MAX_MODE_ID];
+extern long long stats_switches;
+extern long long stats_screen_off_us;
+
+// 日志
+extern int log_level;
+extern int log_max_kb;
+extern AsyncLog async_log;
+
+// 回放：虚拟时钟，>= 0 时 now_us() 返回它
+extern long long replay_clock_us;
+extern time_t replay_wall_base;
+
+long long now_us();
+int timer_create_fd();
+char *read_small_file(const char *path, size_t *len);
+int dump_buffer_reserve(DumpBuffer *buf, size_t room);
+long exec_read(char *const argv[], DumpBuffer *buf, const char *until);
+void parse_sf_dump(const char *data, size_t len, SfDump *out);
+void install_modes(const SfDump *dump);
+int load_mode_cache();
+void build_mode_index();
+int is_valid_mode(int id);
+int get_mode_fps(int id);
+const Ladder *get_mode_ladder(int id);
+int get_mode_rung(int id);
+const char *mode_key_of(int id, char *buf, int size);
+AppTable *app_table_new(int cap);
+void app_table_free(AppTable *t);
+int app_table_put(AppTable *t, const char *pkg, int mode_id);
+int app_table_get(const AppTable *t, const char *pkg);
+AppTable *parse_mode_config(char *content, size_t len, ConfigParse *res);
+int parse_rule_conds(AppTable *t, char *conds, Rule *r);
+int rule_lookup(const AppTable *t, const char *pkg, const char *focus, uint32_t env);
+void load_config(const char *base_path, int force);
+float content_rate_of(const SfDump *dump, const char *pkg);
+int content_mode_for(int app_mode, float rate);
+void env_sync();
+void env_check();
+void evaluate_foreground();
+void smooth_switch(int target_id);
+void direct_switch(int target_id);
+void on_ramp_timer(int fd, uint32_t events);
+void screen_suspend();
+void screen_resume();
+void stats_account();
+int stats_load(const char *base);
+void stats_json(DumpBuffer *out);
+int ctl_socket_path(const char *base, struct sockaddr_un *addr);
+int log_init(const char *path);
+void log_at(int level, const char *fmt, ...);
+void log_msg(const char *fmt, ...);
+void log_shutdown();
+
+// ---- ctl_client.c ----
+int ctl_client(const char *base, int argc, char **argv);
+int stats_dump(const char *base);
+
+// ---- replay.c ----
+int replay_run(int argc, char **argv);
+int replay_active_mode();
+void replay_timer_set(int fd, int delay_ms, int interval_ms);
+
+// ---- bench.c ----
+int content_match_file(const char *path, const char *pkg, int app_mode);
+int bench_parse(const char *path, int iterations);
+int bench_index(int apps, int lookups);
+int bench_rules(int rules, int lookups);
+int bench_exec(int iterations, int argc, char **argv);
+int bench_log(const char *dir, int messages);
+
+#endif
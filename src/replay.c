@@ -0,0 +1,304 @@
+#include "rate_daemon.h"
+
+// 回放: rate_daemon replay <录制文件> [--config=DIR] [--calls=PATH] [--json] [--verbose]
+// 用虚拟时钟按录制顺序重放输入，走与守护进程相同的决策、阶梯和记账代码，不调用任何系统命令
+// 条件规则的电量/充电和能耗统计的电池功率来自录制；内容帧率、触摸空闲、温控和切换校验不参与回放
+#define REPLAY_EPOCH_US 1000000LL   // 虚拟时钟起点，避免 "时间 > 0 才有效" 的判断失效
+#define REPLAY_MAX_TIMERS 8
+
+typedef struct {
+    char tag;
+    long long t;
+    int a;
+    int b;
+    long long v;                // P 的功率
+    char pkg[MAX_PKG_LEN];
+    char focus[MAX_LAYER_NAME];
+    char *blob;                 // C/D 快照内容
+    size_t blob_len;
+} ReplayEvent;
+
+typedef struct {
+    int fd;
+    long long due_us;           // 0 为未启动
+    long long interval_us;
+    event_handler handler;
+} ReplayTimer;
+
+ReplayTimer replay_timers[REPLAY_MAX_TIMERS];
+int replay_timer_count = 0;
+int replay_actives[64];         // 录制时 system_mode_query 读到的结果，按顺序取用
+int replay_active_count = 0;
+int replay_active_pos = 0;
+
+int replay_active_mode() {
+    if (replay_active_pos >= replay_active_count) return -1;
+    return replay_actives[replay_active_pos++];
+}
+
+void replay_timer_add(int fd, event_handler handler) {
+    if (fd < 0 || replay_timer_count >= REPLAY_MAX_TIMERS) return;
+    replay_timers[replay_timer_count].fd = fd;
+    replay_timers[replay_timer_count].due_us = 0;
+    replay_timers[replay_timer_count].handler = handler;
+    replay_timer_count++;
+}
+
+void replay_timer_set(int fd, int delay_ms, int interval_ms) {
+    for (int i = 0; i < replay_timer_count; i++) {
+        if (replay_timers[i].fd != fd) continue;
+        replay_timers[i].due_us = delay_ms > 0 ? replay_clock_us + delay_ms * 1000LL : 0;
+        replay_timers[i].interval_us = interval_ms * 1000LL;
+        return;
+    }
+}
+
+// 推进虚拟时钟到 until，按到期顺序触发定时器 (与主循环一样，每次处理后记账)
+void replay_advance(long long until) {
+    while (1) {
+        ReplayTimer *next = NULL;
+        for (int i = 0; i < replay_timer_count; i++) {
+            ReplayTimer *rt = &replay_timers[i];
+            if (rt->due_us > 0 && rt->due_us <= until && (!next || rt->due_us < next->due_us)) next = rt;
+        }
+        if (!next) break;
+        replay_clock_us = next->due_us;
+        event_time_us = replay_clock_us;
+        next->due_us = next->interval_us > 0 ? next->due_us + next->interval_us : 0;
+        next->handler(next->fd, EPOLLIN);
+        loop_wakeups++;
+        stats_account();
+    }
+    if (until > replay_clock_us) replay_clock_us = until;
+}
+
+// 读入整个录制文件，模式表 (M) 直接装入 modes[]
+ReplayEvent *replay_load(const char *path, int *count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+    int cap = 256, n = 0;
+    ReplayEvent *ev = malloc(cap * sizeof(ReplayEvent));
+    char line[640];
+    while (ev && fgets(line, sizeof(line), fp)) {
+        if (n == cap) {
+            ReplayEvent *bigger = realloc(ev, (size_t)cap * 2 * sizeof(ReplayEvent));
+            if (!bigger) break;
+            ev = bigger;
+            cap *= 2;
+        }
+        ReplayEvent *e = &ev[n];
+        memset(e, 0, sizeof(*e));
+        int off = 0;
+        if (sscanf(line, "%c %lld%n", &e->tag, &e->t, &off) < 2) continue;
+        const char *rest = line + off;
+        if (e->tag == 'F') {
+            if (sscanf(rest, "%127s %255s", e->pkg, e->focus) < 1) continue;
+            if (strcmp(e->focus, "-") == 0) e->focus[0] = '\0';
+        } else if (e->tag == 'C' || e->tag == 'D') {
+            size_t len = 0;
+            if (sscanf(rest, "%zu", &len) != 1 || (e->blob = malloc(len + 1)) == NULL) break;
+            if (fread(e->blob, 1, len, fp) != len) {
+                free(e->blob);
+                break;
+            }
+            e->blob[len] = '\0';
+            e->blob_len = len;
+            fgetc(fp);      // 快照后的换行
+        } else if (e->tag == 'R') {
+            long long wall = 0;
+            sscanf(rest, "%d %lld", &e->a, &wall);
+            replay_wall_base = (time_t)wall;
+        } else if (e->tag == 'P') {
+            sscanf(rest, "%lld %d", &e->v, &e->b);
+        } else if (e->tag == 'M') {
+            DisplayMode *m = &modes[mode_count];
+            if (mode_count >= MAX_MODES || sscanf(rest, "%d %d %d %d", &m->id, &m->width, &m->height, &m->fps) != 4) continue;
+            mode_count++;
+        } else {
+            sscanf(rest, "%d %d", &e->a, &e->b);
+            if (e->tag == 'A' && replay_active_count < (int)(sizeof(replay_actives) / sizeof(replay_actives[0]))) {
+                replay_actives[replay_active_count++] = e->a;
+            }
+        }
+        n++;
+    }
+    fclose(fp);
+    *count = n;
+    return ev;
+}
+
+// 配置快照写入临时目录后按正常路径加载，与 on_config_timer 一样在生效后重新决策
+void replay_config(const char *dir, const ReplayEvent *e, int verbose) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/config/%s", dir, e->tag == 'C' ? "mode.txt" : "daemon.conf");
+    FILE *fp = fopen(path, "w");
+    if (!fp) return;
+    fwrite(e->blob, 1, e->blob_len, fp);
+    // 录制的 log_level 不影响回放输出 (后出现的键覆盖前面的)
+    if (e->tag == 'D' && !verbose) fputs("\nlog_level=warn\n", fp);
+    fclose(fp);
+    long long before = reloads_done;
+    load_config(dir, 0);
+    verify_switch = 0;
+    env_sync();
+    // 启动时的首次加载之后还没有前台应用，与 main 一样不决策
+    if (reloads_done != before && fg_pkg[0]) evaluate_foreground();
+}
+
+int replay_run(int argc, char **argv) {
+    const char *config_dir = NULL;
+    const char *calls_path = "/dev/null";
+    int json = 0, verbose = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--config=", 9) == 0) config_dir = argv[i] + 9;
+        else if (strncmp(argv[i], "--calls=", 8) == 0) calls_path = argv[i] + 8;
+        else if (strcmp(argv[i], "--json") == 0) json = 1;
+        else if (strcmp(argv[i], "--verbose") == 0) verbose = 1;
+    }
+    // 日志只输出到终端，不能追加到设备上正在使用的 daemon.log
+    snprintf(async_log.path, sizeof(async_log.path), "/dev/null");
+    log_level = verbose ? LOG_LEVEL_INFO : LOG_LEVEL_WARN;
+
+    int count = 0;
+    mode_count = 0;
+    ReplayEvent *ev = replay_load(argv[0], &count);
+    if (!ev || mode_count == 0) {
+        printf("Error: cannot read record / 无法读取录制文件: %s\n", argv[0]);
+        free(ev);
+        return 1;
+    }
+    build_mode_index();
+
+    // 配置写入临时目录后走正常加载路径；--config 指定时改用该目录的配置 (评估新策略)，忽略录制的快照
+#ifdef __ANDROID__
+    char tmp_dir[64] = "/data/local/tmp/rd_replay.XXXXXX";
+#else
+    char tmp_dir[64] = "/tmp/rd_replay.XXXXXX";
+#endif
+    char sub[128];
+    if (!mkdtemp(tmp_dir)) {
+        printf("Error: mkdtemp failed / 创建临时目录失败: %s\n", strerror(errno));
+        free(ev);
+        return 1;
+    }
+    snprintf(sub, sizeof(sub), "%s/config", tmp_dir);
+    mkdir(sub, 0700);
+
+    long long wall_start = now_us();
+    fg_backend = FG_BACKEND_REPLAY;
+    // 模式切换和设置同步只写入调用记录 (--calls 指定时可与另一次回放逐行对比)
+    sf_backend = SF_BACKEND_FAKE;
+    snprintf(sf_fake_path, sizeof(sf_fake_path), "%s", calls_path);
+    FILE *calls = fopen(calls_path, "w");
+    if (calls) fclose(calls);
+    replay_clock_us = REPLAY_EPOCH_US;
+    ramp_timer_fd = timer_create_fd();
+    replay_timer_add(ramp_timer_fd, on_ramp_timer);
+    if (config_dir) {
+        // 先写 daemon.conf 再写 mode.txt，第二次加载时两者都已就位
+        const char *names[2] = { "daemon.conf", "mode.txt" };
+        for (int k = 0; k < 2; k++) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/config/%s", config_dir, names[k]);
+            ReplayEvent cfg = { .tag = k ? 'C' : 'D' };
+            cfg.blob = read_small_file(path, &cfg.blob_len);
+            if (cfg.blob) replay_config(tmp_dir, &cfg, verbose);
+            free(cfg.blob);
+        }
+    }
+
+    stats_account();
+    long long end_us = 0;
+    int fg_events = 0;
+    for (int i = 0; i < count; i++) {
+        ReplayEvent *e = &ev[i];
+        replay_advance(REPLAY_EPOCH_US + e->t);
+        event_time_us = replay_clock_us;
+        if (e->tag != 'F') {
+            // 亮屏、配置重载等处理过程中检测到的前台应用记录在其后 (时间相同)，处理时就应可见
+            for (int k = i + 1; k < count && ev[k].t == e->t; k++) {
+                if (ev[k].tag != 'F') continue;
+                snprintf(fg_pkg, sizeof(fg_pkg), "%s", ev[k].pkg);
+                snprintf(fg_focus, sizeof(fg_focus), "%s", ev[k].focus);
+            }
+        }
+        if (e->tag == 'I') {
+            // 与 main 中的启动切换相同
+            if (!is_valid_mode(default_mode_id)) default_mode_id = modes[0].id;
+            if (e->a) direct_switch(default_mode_id);
+            else smooth_switch(default_mode_id);
+        } else if (e->tag == 'F') {
+            snprintf(fg_pkg, sizeof(fg_pkg), "%s", e->pkg);
+            snprintf(fg_focus, sizeof(fg_focus), "%s", e->focus);
+            fg_events++;
+            evaluate_foreground();
+        } else if (e->tag == 'S') {
+            if (e->a && screen_state == SCREEN_OFF) screen_resume();
+            else if (!e->a && screen_state != SCREEN_OFF) screen_suspend();
+        } else if (e->tag == 'B') {
+            battery_level = e->a;
+            battery_charging = e->b;
+            env_check();
+        } else if (e->tag == 'P') {
+            // 与 on_energy_timer 相同：先按旧功率记账到此刻，再换成录制的采样
+            stats_account();
+            energy_active = 1;
+            energy_power_uw = e->v;
+            energy_charging = e->b;
+            energy_samples++;
+        } else if ((e->tag == 'C' || e->tag == 'D') && !config_dir) {
+            replay_config(tmp_dir, e, verbose);
+        }
+        if (e->tag == 'E' || e->t > end_us) end_us = e->t;
+        loop_wakeups++;
+        stats_account();
+    }
+    // 没有结束记录 (录制被强杀) 时让进行中的阶梯走完
+    replay_advance(REPLAY_EPOCH_US + end_us + (ramp_target != -1 ? 10000000LL : 0));
+    stats_account();
+
+    long long sim_us = replay_clock_us - REPLAY_EPOCH_US;
+    replay_clock_us = -1;
+    long long wall_us = now_us() - wall_start;
+
+    if (json) {
+        DumpBuffer out = {0};
+        stats_json(&out);
+        if (out.data) printf("%s\n", out.data);
+        free(out.data);
+    } else {
+        printf("Replay / 回放: %d events (%d foreground), %.1f s simulated in %.1f ms\n",
+            count, fg_events, sim_us / 1e6, wall_us / 1e3);
+        printf("Switches / 切换: %lld, ramp steps / 阶梯下发: %lld, settings batches / 设置同步: %lld\n",
+            stats_switches, sf_stats.count, settings_batches);
+        printf("Screen off / 熄屏: %.1f s\n", stats_screen_off_us / 1e6);
+        if (energy_samples > 0) {
+            long long uj = 0;
+            for (int id = 0; id < MAX_MODE_ID; id++) uj += stats_mode_uj[id];
+            printf("Energy / 能耗: %.1f J (%lld samples), charging / 充电: %.1f s, unknown power / 功率未知: %.1f s\n",
+                uj / 1e6, energy_samples, energy_charging_us / 1e6, energy_unknown_us / 1e6);
+        }
+        printf("Time in mode / 各模式时长:\n");
+        long long on_us = 0;
+        for (int id = 0; id < MAX_MODE_ID; id++) on_us += stats_mode_us[id];
+        for (int id = 0; id < MAX_MODE_ID; id++) {
+            if (stats_mode_us[id] == 0) continue;
+            char key[32];
+            printf("  %-16s %5dHz %10.1f s %5.1f%%\n", mode_key_of(id, key, sizeof(key)), get_mode_fps(id),
+                stats_mode_us[id] / 1e6, on_us ? stats_mode_us[id] * 100.0 / on_us : 0);
+        }
+    }
+
+    for (int i = 0; i < count; i++) free(ev[i].blob);
+    free(ev);
+    if (ramp_timer_fd >= 0) close(ramp_timer_fd);
+    char path[160];
+    snprintf(path, sizeof(path), "%s/mode.txt", sub);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/daemon.conf", sub);
+    unlink(path);
+    rmdir(sub);
+    rmdir(tmp_dir);
+    return 0;
+}
+
@@ -0,0 +1,23 @@
+#!/bin/sh
+# 生成 bench-parse 使用的合成 dumpsys SurfaceFlinger 输出 (约 650KB)
+# 用法: tests/gen_sf_dump.sh [图层数] > sfdump.txt
+#       rate_daemon bench-parse sfdump.txt 500
+# 6 个模式 + activeConfig + N 个图层块，每块 20 行属性和一条 frameRate 投票 (0/24/30/60 轮换)
+LAYERS=${1:-200}
+awk -v layers="$LAYERS" 'BEGIN {
+    print "Display 0 (HWC display 0):"
+    print "   supportedModes="
+    split("120 60 90 144 165 180", fps, " ")
+    for (i = 0; i < 6; i++) {
+        printf "     {id=%d, hwcId=%d, resolution=1264x2780, vsyncRate=%d.000000 Hz, dpi=510.00x510.00, group=0}\n", i, i, fps[i + 1]
+    }
+    print "activeConfig=2"
+    split("60 24 30 0", votes, " ")
+    for (n = 0; n < layers; n++) {
+        printf "+ BufferStateLayer (com.app%d/com.app%d.Main#%d) uid=%d\n", n, n, n, 10000 + n
+        for (k = 0; k < 20; k++) {
+            print "      isOpaque=0, invalidate=1, dataspace=Default, defaultPixelFormat=RGBA_8888, color=(0.000,0.000,0.000,1.000), flags=0x00000002, tr=[0.00, 0.00][0.00, 0.00]"
+        }
+        printf "      frameRate={%d.00, default, changeFrameRateOnlyIfSeamless}\n", votes[(n * 7) % 4 + 1]
+    }
+}'
@@ -0,0 +1,110 @@
+#!/bin/sh
+# 主机测试公共函数：编译 rate_daemon，搭建伪造的 dumpsys、模块目录和 sysfs，启动/停止守护进程
+# 用法: 测试脚本中 . "$(dirname "$0")/lib.sh"
+#       RD=/path/to/rate_daemon 可跳过编译
+set -e
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$TESTS_DIR")
+TEST_NAME=$(basename "$0" .sh)
+T=$(mktemp -d "${TMPDIR:-/tmp}/rd_test.XXXXXX")
+RD_PID=
+
+cleanup() {
+    if [ -n "$RD_PID" ]; then kill -TERM "$RD_PID" 2>/dev/null || true; wait "$RD_PID" 2>/dev/null || true; fi
+    rm -rf "$T"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $TEST_NAME: $*"
+    if [ -f "$T/mod/daemon.log" ]; then echo "--- daemon.log (tail)"; tail -n 30 "$T/mod/daemon.log"; fi
+    exit 1
+}
+
+pass() {
+    echo "PASS: $TEST_NAME"
+}
+
+if [ -z "$RD" ]; then
+    RD=$T/rate_daemon
+    ${CC:-gcc} -Wall -O2 -o "$RD" "$REPO/src/rate_daemon.c" "$REPO/src/ctl_client.c" \
+        "$REPO/src/replay.c" "$REPO/src/bench.c" -lpthread || fail "build"
+fi
+
+# 伪造的 dumpsys：模式表固定 (同 tests/gen_sf_dump.sh)，activeConfig 取最后一次 set_mode
+# 前台窗口、activity、wakefulness 和图层分别来自 $T/fb 下的 fg / act / power / layers
+# $T/fb/slow 存在时 dumpsys SurfaceFlinger 先等待其中的秒数 (模拟卡顿的 dumpsys)
+mkdir -p "$T/bin" "$T/fb" "$T/mod/config" "$T/sys/class/backlight/panel0-backlight"
+cat > "$T/bin/dumpsys" <<X
+#!/bin/sh
+FB=$T/fb
+case "\$1" in
+SurfaceFlinger)
+    [ -f "\$FB/slow" ] && sleep "\$(cat "\$FB/slow")"
+    echo "Display 0 (HWC display 0):"
+    echo "   supportedModes="
+    i=0
+    for fps in 120 60 90 144 165; do
+        echo "     {id=\$i, hwcId=\$i, resolution=1264x2780, vsyncRate=\$fps.000000 Hz, dpi=510.00x510.00, group=0}"
+        i=\$((i + 1))
+    done
+    a=\$(grep -o 'set_mode [0-9]*' "$T/calls" 2>/dev/null | tail -n 1 | cut -d' ' -f2)
+    echo "activeConfig=\${a:-0}"
+    cat "\$FB/layers" 2>/dev/null
+    ;;
+window)
+    echo x >> "\$FB/window.count"
+    echo "  mCurrentFocus=Window{abc u0 \$(cat "\$FB/fg" 2>/dev/null || echo com.android.launcher3)/\$(cat "\$FB/act" 2>/dev/null || echo .Main)}"
+    ;;
+power)
+    echo "  mWakefulness=\$(cat "\$FB/power" 2>/dev/null || echo Awake)"
+    ;;
+esac
+X
+chmod +x "$T/bin/dumpsys"
+cp "$REPO/config/daemon.conf" "$T/mod/config/daemon.conf"
+printf '4\n' > "$T/mod/config/mode.txt"
+echo 100 > "$T/sys/class/backlight/panel0-backlight/brightness"
+
+# 修改 daemon.conf 的一项 (后出现的键覆盖前面的)
+conf() {
+    echo "$1=$2" >> "$T/mod/config/daemon.conf"
+}
+
+# 启动守护进程 (模式切换写入 $T/calls)，参数追加在默认参数之后
+start_daemon() {
+    PATH="$T/bin:$PATH" "$RD" "$T/mod" --sf-backend=fake:"$T/calls" --sys-root="$T/sys" "$@" > "$T/stdout" 2>&1 &
+    RD_PID=$!
+}
+
+stop_daemon() {
+    kill -TERM "$RD_PID"
+    wait "$RD_PID" || fail "daemon exited with status $?"
+    RD_PID=
+}
+
+# 等待 daemon.log 中出现匹配行 (grep -E)，默认 5 秒
+wait_log() {
+    n=$(( ${2:-5} * 10 ))
+    while [ "$n" -gt 0 ]; do
+        grep -qE "$1" "$T/mod/daemon.log" 2>/dev/null && return 0
+        sleep 0.1
+        n=$((n - 1))
+    done
+    fail "timed out waiting for log: $1"
+}
+
+last_mode() {
+    grep -o 'set_mode [0-9]*' "$T/calls" 2>/dev/null | tail -n 1 | cut -d' ' -f2
+}
+
+# 等待最后一次下发的模式变为 $1，默认 5 秒
+wait_mode() {
+    n=$(( ${2:-5} * 10 ))
+    while [ "$n" -gt 0 ]; do
+        [ "$(last_mode)" = "$1" ] && return 0
+        sleep 0.1
+        n=$((n - 1))
+    done
+    fail "timed out waiting for mode $1 (last $(last_mode))"
+}
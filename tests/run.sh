@@ -0,0 +1,28 @@
+#!/bin/sh
+# 运行全部主机测试: tests/run.sh [测试名...]
+# 先编译一次 rate_daemon (CC 可指定编译器，如 CC="gcc -fsanitize=address,undefined")，
+# 再依次运行 tests/test_*.sh；每个测试在自己的临时目录中搭建伪造的 dumpsys / sysfs / cgroup 树
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$TESTS_DIR")
+BUILD=$(mktemp -d "${TMPDIR:-/tmp}/rd_build.XXXXXX")
+trap 'rm -rf "$BUILD"' EXIT
+
+RD=$BUILD/rate_daemon
+${CC:-gcc} -Wall -Wextra -O2 -o "$RD" "$REPO/src/rate_daemon.c" "$REPO/src/ctl_client.c" \
+    "$REPO/src/replay.c" "$REPO/src/bench.c" -lpthread || exit 1
+export RD
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$TESTS_DIR" && ls test_*.sh | sed 's/\.sh$//')
+fi
+passed=0
+failed=""
+for t in "$@"; do
+    if sh "$TESTS_DIR/$t.sh"; then
+        passed=$((passed + 1))
+    else
+        failed="$failed $t"
+    fi
+done
+echo "$passed passed${failed:+, failed:$failed}"
+[ -z "$failed" ]
@@ -0,0 +1,20 @@
+#!/bin/sh
+# 等待开机 (user-008)：--wait-boot 在 sys.boot_completed=1 之前不加载配置、不切换
+. "$(dirname "$0")/lib.sh"
+
+# 主机构建没有属性服务，必须指定 --prop-dir
+if "$RD" "$T/mod" --wait-boot > /dev/null 2>&1; then fail "--wait-boot without --prop-dir should fail"; fi
+
+mkdir -p "$T/prop"
+echo 0 > "$T/prop/sys.boot_completed"
+start_daemon --wait-boot --prop-dir="$T/prop"
+sleep 0.5
+if grep -q "Config loaded" "$T/mod/daemon.log" 2>/dev/null; then fail "config loaded before boot completed"; fi
+[ ! -f "$T/calls" ] || fail "switched before boot completed"
+
+echo 1 > "$T/prop/sys.boot_completed"
+wait_log "Boot completed / 开机完成"
+wait_log "Config loaded"
+wait_mode 4
+stop_daemon
+pass
@@ -0,0 +1,45 @@
+#!/bin/sh
+# cgroup 前台检测 (user-001)：伪造 top-app / foreground / background cgroup 和 /proc
+# top-app/cgroup.procs 是指向 procs.* 的符号链接：改链接即可改变读到的 pid 集合而不产生 inotify 事件，
+# 用来模拟 "进程移出 top-app 时只有目标 cgroup 被写入" 和 "只写 tasks" 的情况
+. "$(dirname "$0")/lib.sh"
+
+CG=$T/cg
+mkdir -p "$CG/top-app" "$CG/foreground" "$CG/background" "$T/proc/100" "$T/proc/200"
+printf 'com.foo.bar\0' > "$T/proc/100/cmdline"
+printf 'com.baz.x:remote\0--flag\0' > "$T/proc/200/cmdline"
+echo 100 > "$CG/top-app/procs.a"
+echo 100 > "$CG/top-app/procs.c"
+printf '100\n200\n' > "$CG/top-app/procs.b"
+ln -s procs.a "$CG/top-app/cgroup.procs"
+: > "$CG/top-app/tasks"
+: > "$CG/foreground/cgroup.procs"
+: > "$CG/background/cgroup.procs"
+printf '4\ncom.foo.bar 1\ncom.baz.x 2\n' > "$T/mod/config/mode.txt"
+echo com.foo.bar > "$T/fb/fg"
+
+start_daemon --fg-backend=cgroup --top-app="$CG/top-app/cgroup.procs" --proc-root="$T/proc"
+wait_log "Foreground backend / 前台检测: cgroup \(.*, 4 watches\)"
+wait_mode 1
+
+# 直接写入 top-app：新进程即为前台应用
+printf '100\n200\n' > "$CG/top-app/procs.a"
+wait_mode 2
+wait_log "Decision latency / 决策延迟: [0-9]+ us \(target 2\)"
+
+# 前台应用退到后台：只有 background 被写入，top-app 中已没有它，交给 dumpsys 判定
+echo com.foo.bar > "$T/fb/fg"
+ln -sfn procs.c "$CG/top-app/cgroup.procs"
+echo 200 >> "$CG/background/cgroup.procs"
+wait_mode 1
+[ -f "$T/fb/window.count" ] || fail "departed foreground app should fall back to dumpsys"
+
+# 新进程只写入 tasks：由 tasks 的监听发现，不需要 dumpsys
+rm -f "$T/fb/window.count"
+ln -sfn procs.b "$CG/top-app/cgroup.procs"
+echo 2001 >> "$CG/top-app/tasks"
+wait_mode 2
+[ ! -f "$T/fb/window.count" ] || fail "new top-app pid should not need dumpsys"
+
+stop_daemon
+pass
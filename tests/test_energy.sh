@@ -0,0 +1,38 @@
+#!/bin/sh
+# 能耗统计 (user-021)：伪造 power_supply，放电功率 = |current_now| × voltage_now
+# Charging / Full 不计能耗；其余状态 (含 Unknown) 按放电计
+. "$(dirname "$0")/lib.sh"
+
+BAT=$T/sys/class/power_supply/battery
+mkdir -p "$BAT"
+echo 50 > "$BAT/capacity"
+echo -1000000 > "$BAT/current_now"
+echo 4000000 > "$BAT/voltage_now"
+echo Discharging > "$BAT/status"
+conf energy_sample_ms 1000
+
+state() {
+    "$RD" ctl "$T/mod" get-state 2> /dev/null
+}
+
+# 等待 get-state 中出现 $1，默认 5 秒
+wait_state() {
+    n=50
+    while [ "$n" -gt 0 ]; do
+        state | grep -q "$1" && return 0
+        sleep 0.1
+        n=$((n - 1))
+    done
+    fail "timed out waiting for state $1: $(state)"
+}
+
+start_daemon
+wait_log "Energy sampling / 能耗采样: .* every 1000 ms"
+wait_state '"power_mw":4000,'
+echo Charging > "$BAT/status"
+wait_state '"power_mw":-1,'
+echo Unknown > "$BAT/status"
+wait_state '"power_mw":4000,'
+"$RD" ctl "$T/mod" get-stats | grep -q '"charging_ms":[1-9]' || fail "charging time not counted"
+stop_daemon
+pass
@@ -0,0 +1,17 @@
+#!/bin/sh
+# 触摸空闲降频 (user-014)：--input 指向 FIFO，写入事件即为触摸
+. "$(dirname "$0")/lib.sh"
+
+mkfifo "$T/input"
+conf idle_fps 60
+conf idle_timeout_ms 300
+
+start_daemon --input="$T/input"
+wait_log "Idle downclock / 空闲降频: 60 fps after 300 ms"
+wait_mode 1
+# struct input_event 在 64 位上为 24 字节，内容不解析
+head -c 24 /dev/zero > "$T/input"
+wait_mode 4
+wait_mode 1
+stop_daemon
+pass
@@ -0,0 +1,31 @@
+#!/bin/sh
+# 决策延迟 (user-002)：内容采样的 dumpsys SurfaceFlinger 卡住 2 秒时，
+# cgroup 事件触发的切换不应排在它后面 (dumpsys 和常驻 shell 都挂在事件循环上异步执行)
+. "$(dirname "$0")/lib.sh"
+
+CG=$T/cg/top-app
+mkdir -p "$CG" "$T/proc/100" "$T/proc/200"
+printf 'com.foo.bar\0' > "$T/proc/100/cmdline"
+printf 'com.baz.x\0' > "$T/proc/200/cmdline"
+echo 100 > "$CG/cgroup.procs"
+printf '4\ncom.foo.bar 1 content\ncom.baz.x 2\n' > "$T/mod/config/mode.txt"
+echo com.foo.bar > "$T/fb/fg"
+conf content_sample_ms 250
+
+start_daemon --fg-backend=cgroup --top-app="$CG/cgroup.procs" --proc-root="$T/proc"
+wait_mode 1
+echo 2 > "$T/fb/slow"
+sleep 0.6
+
+start=$(date +%s%N)
+printf '100\n200\n' > "$CG/cgroup.procs"
+wait_mode 2
+elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+[ "$elapsed_ms" -lt 1000 ] || fail "switch took $elapsed_ms ms behind a slow dumpsys"
+wait_log "Decision latency / 决策延迟: [0-9]+ us \(target 2\)"
+us=$(grep -o "决策延迟: [0-9]* us (target 2)" "$T/mod/daemon.log" | tail -n 1 | grep -o "[0-9]* us" | cut -d' ' -f1)
+[ "$us" -lt 50000 ] || fail "decision latency $us us"
+
+rm -f "$T/fb/slow"
+stop_daemon
+pass
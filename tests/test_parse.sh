@@ -0,0 +1,14 @@
+#!/bin/sh
+# dumpsys SurfaceFlinger 解析 (user-006)：tests/gen_sf_dump.sh 生成的输入，解析结果和内容帧率匹配
+. "$(dirname "$0")/lib.sh"
+
+sh "$TESTS_DIR/gen_sf_dump.sh" 200 > "$T/sfdump.txt"
+"$RD" bench-parse "$T/sfdump.txt" 3 > "$T/out" || fail "bench-parse"
+grep -q "Parsed: 6 modes, activeConfig=2, 64 layers" "$T/out" || fail "parse result: $(grep Parsed "$T/out")"
+grep -q "(6 mode lines)" "$T/out" || fail "legacy parser disagrees"
+grep -q "mode id=5 1264x2780@180" "$T/out" || fail "mode table"
+
+# 30 fps 内容在 120 Hz 阶梯中选 60 Hz；24 fps 没有更低的整数倍档位
+"$RD" content-match "$T/sfdump.txt" com.app2 0 | grep -q "content 30.00 fps, .* -> mode 1 (60Hz)" || fail "content-match 30 fps"
+"$RD" content-match "$T/sfdump.txt" com.app3 0 | grep -q "content 24.00 fps, .* -> mode 0 (120Hz)" || fail "content-match 24 fps"
+pass
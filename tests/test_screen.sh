@@ -0,0 +1,62 @@
+#!/bin/sh
+# 屏幕状态检测 (user-013)：伪造 sysfs 的背光节点 (普通文件不支持 EPOLLPRI)、uevent 和 dumpsys power 回退
+. "$(dirname "$0")/lib.sh"
+
+BL=$T/sys/class/backlight/panel0-backlight/brightness
+conf screen_poll_ms 200
+conf log_level debug
+
+# 以内核格式广播背光 uevent (需要 root 和 python3)，不能发送时返回非 0
+send_uevent() {
+    command -v python3 > /dev/null || return 1
+    python3 - <<X 2> /dev/null
+import socket
+s = socket.socket(socket.AF_NETLINK, socket.SOCK_DGRAM, 15)
+s.sendto(b"change@/devices/platform/panel/backlight/panel0-backlight\0ACTION=change\0SUBSYSTEM=backlight\0", (0, 1))
+X
+}
+
+count_log() {
+    grep -c "$1" "$T/mod/daemon.log" || true
+}
+
+# 没有事件来源：熄屏后定时检查逐次退避，亮屏仍能检测到
+start_daemon
+wait_log "Screen events / 屏幕事件: EPOLLPRI unavailable"
+echo 0 > "$BL"
+wait_log "Screen off, detection suspended"
+wait_log "Screen poll backoff / 熄屏检查间隔: 1600 ms"
+echo 100 > "$BL"
+wait_log "Screen on, re-applying"
+
+# uevent：第一次收到后停用屏幕定时器，之后只有事件才会检查
+if grep -q "uevent registered" "$T/mod/daemon.log" && echo 0 > "$BL" && send_uevent; then
+    wait_log "Screen events / 屏幕事件: uevent, screen timer off"
+    wait_log "Screen off, detection suspended.*on for"
+    ons=$(count_log "Screen on, re-applying")
+    echo 100 > "$BL"
+    sleep 1.5
+    [ "$(count_log "Screen on, re-applying")" = "$ons" ] || fail "screen timer should be off after a uevent"
+    send_uevent
+    n=50
+    while [ "$(count_log "Screen on, re-applying")" = "$ons" ]; do
+        n=$((n - 1))
+        [ "$n" -gt 0 ] || fail "uevent did not wake the screen check"
+        sleep 0.1
+    done
+else
+    echo "SKIP: $TEST_NAME: cannot send uevents"
+fi
+stop_daemon
+
+# 没有背光节点：dumpsys power
+mkdir -p "$T/sys2"
+rm -f "$T/mod/daemon.log"
+start_daemon --sys-root="$T/sys2"
+wait_log "Screen state / 屏幕状态: dumpsys power"
+echo Asleep > "$T/fb/power"
+wait_log "Screen off, detection suspended"
+echo Awake > "$T/fb/power"
+wait_log "Screen on, re-applying"
+stop_daemon
+pass
@@ -0,0 +1,28 @@
+#!/bin/sh
+# 温控 (user-016)：伪造 thermal_zone，按温度逐级限制最高帧率，降温后带迟滞解除
+. "$(dirname "$0")/lib.sh"
+
+TZ=$T/sys/class/thermal/thermal_zone0
+mkdir -p "$TZ"
+echo skin-therm > "$TZ/type"
+echo 30000 > "$TZ/temp"
+conf thermal_caps 42:90,45:60
+conf thermal_zone skin-therm
+conf thermal_poll_ms 500
+
+start_daemon
+wait_log "Thermal zone / 温度节点: .*thermal_zone0/temp \(2 steps"
+wait_mode 4
+echo 43000 > "$TZ/temp"
+wait_mode 2
+echo 46000 > "$TZ/temp"
+wait_mode 1
+# 44 C 仍在 45 - 2 的迟滞范围内
+echo 44000 > "$TZ/temp"
+sleep 1.2
+[ "$(last_mode)" = 1 ] || fail "cap lifted inside the hysteresis band"
+echo 30000 > "$TZ/temp"
+wait_log "Thermal cap lifted / 温控解除"
+wait_mode 4
+stop_daemon
+pass
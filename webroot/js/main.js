@@ -5,6 +5,7 @@ const MOD_DIR = `/data/adb/modules/${MODULE_ID}`;
 // 配置文件路径
 const CONFIG_FILE = `${MOD_DIR}/config/mode.txt`;
 const LOG_FILE = `${MOD_DIR}/daemon.log`;
+const DAEMON_BIN = `${MOD_DIR}/bin/rate_daemon`;
 
 // 全局状态
 let currentMode = 1;
@@ -221,8 +222,19 @@ async function loadSystemStatus() {
 
     // 2. FPS
     try {
-        const fpsRaw = await ksuExec("dumpsys display | grep -oE 'fps=[0-9.]+' | head -n1");
-        const fps = fpsRaw.split('=')[1] || "未知";
+        // 优先向守护进程查询 (控制 socket)，未运行时回退 dumpsys display
+        let fps = "";
+        const stateRaw = await ksuExec(`"${DAEMON_BIN}" ctl "${MOD_DIR}" get-state`);
+        try {
+            const state = JSON.parse(stateRaw);
+            if (state.ok && state.fps > 0) fps = String(state.fps);
+        } catch (e) {
+            debugLog(`get-state unavailable: ${stateRaw}`);
+        }
+        if (!fps) {
+            const fpsRaw = await ksuExec("dumpsys display | grep -oE 'fps=[0-9.]+' | head -n1");
+            fps = fpsRaw.split('=')[1] || "未知";
+        }
         const fpsEl = document.getElementById('fps-info');
         if (fpsEl) fpsEl.innerText = fps;
         debugLog(`FPS loaded: ${fps}`);
@@ -355,18 +367,18 @@ async function loadDisplayModes() {
     // 排序
     displayModes.sort((a, b) => a.fps - b.fps || a.width - b.width);
 
-    // 读取当前配置
+    // 读取当前配置 (跳过注释行；条件规则由守护进程处理，这里不显示)
     const configRaw = await ksuExec(`cat "${CONFIG_FILE}"`);
-    const configLines = configRaw.split('\n');
-    const globalModeId = configLines[0] ? parseInt(configLines[0].trim()) : -1;
+    const configLines = configRaw.split('\n').map(l => l.trim()).filter(l => l && !l.startsWith('#'));
+    const globalModeId = configLines[0] ? resolveModeKey(configLines[0]) : -1;
 
     // 解析应用配置
     appConfigs = {};
     for (let i = 1; i < configLines.length; i++) {
-        const line = configLines[i].trim();
-        if (line.includes('=')) {
-            const [pkg, modeId] = line.split('=');
-            appConfigs[pkg] = parseInt(modeId);
+        const line = configLines[i];
+        if (line.includes('=') && !line.includes(' if ')) {
+            const [pkg, value] = line.split('=');
+            appConfigs[pkg] = resolveModeKey(value.trim().split(/\s+/)[0]);
         }
     }
     
@@ -381,6 +393,31 @@ async function loadDisplayModes() {
     }
 }
 
+// 配置中的模式键：纯数字为模式ID，WxH@fps 与守护进程相同的规则就近匹配
+function resolveModeKey(key) {
+    if (/^\d+$/.test(key)) return parseInt(key);
+    const m = key.match(/^(\d+)x(\d+)@(\d+)$/);
+    if (!m) return -1;
+    const [w, h, fps] = [parseInt(m[1]), parseInt(m[2]), parseInt(m[3])];
+    let best = null, bestCost = 0;
+    displayModes.forEach(mode => {
+        const cost = Math.abs(mode.width * mode.height - w * h) * 4096 + Math.abs(mode.fps - fps) * 2 + (mode.fps > fps ? 1 : 0);
+        if (best === null || cost < bestCost) {
+            best = mode;
+            bestCost = cost;
+        }
+    });
+    return best ? best.id : -1;
+}
+
+// 写入配置时使用的模式键，重刷 DTBO 改变模式ID后仍然有效
+function modeKeyOf(id) {
+    const mode = displayModes.find(m => m.id === id);
+    if (!mode) return String(id);
+    const same = displayModes.filter(m => m.width === mode.width && m.height === mode.height && m.fps === mode.fps);
+    return same.length === 1 ? `${mode.width}x${mode.height}@${mode.fps}` : String(id);
+}
+
 function renderDisplayModes() {
     const listEl = document.getElementById('mode-list');
     if (!listEl) return;
@@ -434,11 +471,12 @@ async function saveGlobalMode() {
     
     showToast("正在保存全局模式...");
     const scriptPath = `${MOD_DIR}/scripts/web_handler.sh`;
-    const result = await ksuExec(`sh "${scriptPath}" set_config "${currentMode}"`);
+    const result = await ksuExec(`sh "${scriptPath}" set_config "${modeKeyOf(currentMode)}"`);
     
     if (result.includes("Success")) {
         showToast("保存成功！");
-        await loadDisplayModes(); // 刷新
+        // 守护进程会延迟批量写回 mode.txt，这里直接用本地状态刷新，不重新读取文件
+        renderDisplayModes();
     } else {
         showToast("保存失败：" + result);
     }
@@ -771,7 +809,8 @@ function renderAppList(packages) {
 async function saveAppConfig(pkg, modeId) {
     showToast(`正在保存 ${pkg} 配置...`);
     const scriptPath = `${MOD_DIR}/scripts/web_handler.sh`;
-    const result = await ksuExec(`sh "${scriptPath}" set_app_config "${pkg}" "${modeId}"`);
+    const modeKey = modeId == -1 ? "-1" : modeKeyOf(parseInt(modeId));
+    const result = await ksuExec(`sh "${scriptPath}" set_app_config "${pkg}" "${modeKey}"`);
     
     if (result.includes("Success")) {
         showToast("保存成功");